@@ -28,10 +28,9 @@ StaticAPInfo staticAPs[]{ {"Wicked Networks",  "", "http://google.com/"},
 
 DataUploader * DataUploader::instance(nullptr);
 
-DataUploader::DataUploader( uint8_t *uploadData, size_t uploadLen,
+DataUploader::DataUploader( FlashStream *uploadData,
                             APCredentials *preferredAP /* = nullptr */ ) :
-    uploadDataPtr(uploadData),
-    uploadDataLen(uploadLen)
+    uploadData(uploadData)
 {
     assert(instance == nullptr);
     instance = this;
@@ -194,7 +193,8 @@ bool DataUploader::doUpload()
     }
 
     client.addHeader("Content-Type", "application/weatherdata");
-    auto res( client.POST(uploadDataPtr, uploadDataLen) );
+    uploadData->rewind();   // we might be retrying with another AP
+    auto res( client.sendRequest("POST", uploadData, uploadData->size()) );
 
     client.end();
 
@@ -2,6 +2,7 @@
 #define DATA_UPLOADER_HEADER
 
 #include "HouseSensor.h"
+#include "FlashStream.h"
 
 #include <ESP8266WiFi.h>
 
@@ -20,7 +21,7 @@ class DataUploader
 {
     public:
         /// preferredAP is the set of credentials input by the user
-        DataUploader( uint8_t *uploadData, size_t uploadLen,
+        DataUploader( FlashStream *uploadData,
                       APCredentials *preferredAP = nullptr );
 
         /// Puts the WiFi in to sleep mode
@@ -69,11 +70,8 @@ class DataUploader
         /// For callbacks, static functions, etc.
         static DataUploader *instance;
 
-        /// Data we're uploading - owned by caller
-        uint8_t *uploadDataPtr;
-
-        /// Length in bytes of data to upload
-        size_t uploadDataLen;
+        /// Data we're uploading, streamed out of flash - owned by caller
+        FlashStream *uploadData;
 }; // end class DataUploader
 
 #endif // #ifndef DATA_UPLOADER_HEADER
@@ -15,6 +15,7 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "Arduino.h"
+#include <stddef.h>
 
 extern "C" {
 #include "c_types.h"
@@ -32,281 +33,1207 @@ extern "C" {
 //  each page starts with a 4 byte magic number followed by a 4 byte ref number - FFFFFFFF means empty, 
 //  every time we allocate a page we give it an increasing ref number, they are allocated in order going 
 //  backwards (so we can grow the code), they wrap, then overflow to external flash where the same thing 
-//  happens (not yet implemented)
+//  happens - FlashRing keeps a ring on any FlashDevice, HomeFlash puts one in the 8266's flash and
+//  optionally another on an external chip
+//
+//  after the ref is a count of how many times the sector has been erased, EraseSector() writes it 
+//  straight after each erase (so an erased page isn't all FFs) and allocating the page leaves it alone.
+//  Pages written before we kept counts have FLASH_MAGIC_V1 and an 8 byte header, we still read them.
+//
+//  FLASH_MAGIC pages end with a flash_summary footer, records stop at FLASH_PAGE_END. We keep a 
+//  summary of the current page as records are written and program it when we move on, so Seek() 
+//  can skip whole pages by time without decoding them. The footer starts with an FF byte so 
+//  anything looking for the next record stops there, as it would at unwritten flash.
+//  FLASH_MAGIC_V3 pages have the footer but the older record format (below), FLASH_MAGIC_V2 
+//  pages are the same as those without a footer.
+//  When we move to a new page we can skip up to wear_window-1 free pages to get to one that has been
+//  erased noticeably fewer times, skipped pages sit unused inside the run until we come round again,
+//  and when the ring is empty we start it at the least worn sector rather than always at FLASH_LAST
 //
 //  we can find the first record simply by searching thru the pages
 //
+//  pages are not erased when they are freed by CommitBuffer() (erasing takes ~45mS each and 
+//  would land in the upload path), instead we clear bits in their magic number so that they 
+//  are no longer 'in use', and the freed pages, which are always the run of positions from
+//  erase_page up to first_page_address, are erased a few at a time by EraseAhead() on wakes 
+//  that aren't doing anything else, in order starting with the page we'll need next. The
+//  pages from just after the current page up to erase_page are known to be erased.
+//
+//  a ring that's full normally refuses new records until there's an upload, with SetOverwrite()
+//  it frees its oldest page instead - as soon as it starts using the last free page, so that
+//  EraseAhead() can get the erase out of the way - and counts the records it threw away. The
+//  next LoadBuffer() starts with a FLASH_GAP escape and that count so whoever gets the data 
+//  knows that some is missing right there. The count is kept in the cursor, which a cold boot loses,
+//  so while there's one to report the current page has FLASH_REF_EVICTED set in its ref - a cold
+//  boot that finds it reports what it evicts from then on with FLASH_GAP_AT_LEAST
+//
 //  8266 flash operations must be 4 byte aligned, and a multiple of 4 bytes.
 //
 //  within each page there are a bunch of 'records', each is self contained (in the sense that compression 
-//  restarts on each), they start with a length byte followed by data (max 255 bytes) the length 
-//  is the actual length of the embedded data -1 (so values 0-254 representing 1-255, a value of 
-//  255 is the last as yet unused record), records are 4 byte aligned and padded out to 4 byte boundaries
+//  restarts on each), they start with the length of the data that follows, less one. In FLASH_MAGIC
+//  pages that's one byte 0-7f for records of 1-128 bytes, or two bytes MSB first with bit 7 of the
+//  first set for longer ones (up to FLASH_RECORD_MAX, nearly a page), and records are packed one 
+//  straight after another - program_bytes() pads each write out to whole words with FFs, which 
+//  leaves the bytes either side of the record as they were. In older pages the length is one 
+//  byte, records are at most 255 bytes and are 4 byte aligned and padded out to 4 byte boundaries.
+//  Either way a first length byte of 255 is the last as yet unused record
+//
+//  the power can go at any point (see host/flash_crash.cpp). A record it cuts short can come back
+//  torn, records have no checksum, but it never costs the ones before it - DoInit() won't add
+//  to a page with anything but FFs where the next record would go, or with its footer started,
+//  it moves on to a new page. RestoreCursor() can be handed a stale cursor after a reset,
+//  DoInit() checks it against the flash before it's used
 //
 
 
-#define SEC_MAX_DATA (SPI_FLASH_SEC_SIZE-sizeof(flash_page_header))
+#define FLASH_FREED(m) ((m)&0x0fffffff)    // can be programmed over an in use magic
+#define FLASH_GAP_LOST 0x80000000           // or'd into gap_loaded, the gap said a cold boot lost count
 
 
 
+static InternalFlash internal_flash;
 HomeFlash flash;
 
+bool
+InternalFlash::read(unsigned int address, void *p, int len)
+{
+  return spi_flash_read(address, (uint32 *)p, len) == SPI_FLASH_RESULT_OK;
+}
+
+bool
+InternalFlash::write(unsigned int address, const void *p, int len)
+{
+  bool r;
+
+  noInterrupts();
+  r = spi_flash_write(address, (uint32 *)p, len) == SPI_FLASH_RESULT_OK;
+  interrupts();
+  return r;
+}
+
+bool
+InternalFlash::erase(unsigned short sector)
+{
+  bool r;
+
+  noInterrupts();
+  r = spi_flash_erase_sector(sector) == SPI_FLASH_RESULT_OK;
+  interrupts();
+  return r;
+}
+
+//
+//  DoInit() has to find the oldest and newest pages, pages are allocated going backwards
+//  so we number the sectors in allocation order - position 0 is FLASH_LAST, position 1 
+//  FLASH_LAST-1 and so on around the ring. The pages in use are a single run in that order 
+//  whose refs go up by one per position, so once we have found any page in use with ref R
+//  at position p a page at p+d is part of the same run (newer) iff its ref is R+d, and one 
+//  at p-d is (older) iff its ref is R-d. Those tests are true up to the ends of the run and
+//  false after them so both ends can be found with a binary search over the headers
+//
+//  allocate_page() can leave up to wear_window-1 unused pages inside the run (refs still go 
+//  up by one per position, so they skip) and the search can stop just before them, so once
+//  it has an end we look a few pages past it and carry on searching if the run continues
+//
+//  finding that first page is the only part that isn't O(log n), we probe coarse to fine 
+//  (0, N/2, N/4, 3N/4 ....) which hits a run of L pages within about 2N/L probes. The searches
+//  for the ends don't read the positions the probe has already seen, so a short run found
+//  late costs no more than the linear walk of every header would have - and when the ring
+//  is empty the probe has read every header, which says which sector is least worn
+//
+
+unsigned int
+FlashRing::page_address(int pos)
+{
+  pos %= pages();
+  if (pos < 0)
+    pos += pages();
+  return (dev->last-pos)*SPI_FLASH_SEC_SIZE;
+}
+
+//
+//  the erase count in a header, ~0 if it hasn't got one
+//
+static unsigned int
+header_erases(const flash_page_header *h)
+{
+  if (h->magic == FLASH_MAGIC || h->magic == FLASH_FREED(FLASH_MAGIC) ||
+      h->magic == FLASH_MAGIC_V3 || h->magic == FLASH_FREED(FLASH_MAGIC_V3) ||
+      h->magic == FLASH_MAGIC_V2 || h->magic == FLASH_FREED(FLASH_MAGIC_V2) ||
+      (h->magic == 0xffffffff && h->ref == 0xffffffff))  // erased, EraseSector() wrote the count
+    return h->erases;
+  return ~0;
+}
+
+//
+//  how many times a page with this header will have been erased once it's ready to use
+//
+static unsigned int
+header_wear(const flash_page_header *h)
+{
+  unsigned int e = header_erases(h);
+
+  if (h->magic == 0xffffffff && h->ref == 0xffffffff)
+    return e == ~0U ? 0 : e;
+  return e == ~0U ? 1 : e+1;
+}
+
+//
+//  where DoInit()'s probe looks i'th - i bit reversed
+//
+static int
+probe_pos(int i, int bits)
+{
+  int pos = 0;
+
+  for (int b = 0; b < bits; b++)
+    if (i&(1<<b))
+      pos |= 1<<(bits-1-b);
+  return pos;
+}
+
+unsigned int
+FlashRing::read_ref(int pos, flash_page_header *hp)    // returns 0xffffffff for a page that's not in use
+{
+  flash_page_header h;
+
+  pos %= pages();
+  if (pos < 0)
+    pos += pages();
+  if (probe_pos(pos, probe_bits) < probed)  // the probe already found it wasn't
+    return 0xffffffff;
+  if (!hp)
+    hp = &h;
+  dev->read(page_address(pos), (unsigned int *)hp, sizeof(*hp));
+  if (hp->magic != 0xffffffff)  // while we're here, it's not blank
+    mark(sector_dirty, page_address(pos)/SPI_FLASH_SEC_SIZE, 1);
+  if (!FLASH_IN_USE(hp->magic))
+    return 0xffffffff;
+  return hp->ref&~FLASH_REF_EVICTED;
+}
+
+int
+FlashRing::run_end(int pos, unsigned int ref, int top, int dir, unsigned int *end_ref)  // dir 1 for newer, -1 for older
+{
+  flash_page_header h;
+  int lo = 0, hi = top, j;
+
+  for (;;) {
+    while (hi-lo > 1) {
+      int mid = (lo+hi)/2;
+      if (read_ref(pos+dir*mid, &h) == ref+dir*mid) {
+        lo = mid;
+        *end_ref = h.ref;
+      } else {
+        hi = mid;
+      }
+    }
+    for (j = 2; j <= wear_window && lo+j < top; j++)  // we know lo+1 isn't
+    if (read_ref(pos+dir*(lo+j), &h) == ref+dir*(lo+j))
+      break;
+    if (j > wear_window || lo+j >= top)
+      return lo;
+    lo += j;
+    *end_ref = h.ref;
+    hi = top;
+  }
+}
+
 void
-HomeFlash::DoInit()
+FlashRing::DoInit()
 {
   flash_page_header h;
-  unsigned int last_ref;
-printf("doinit\n");
-  current_page_address = first_page_address = (FLASH_LAST*SPI_FLASH_SEC_SIZE);
-  spi_flash_read(current_page_address, (unsigned int *)&h, sizeof(h));
-  last_ref = h.ref;
-  if (h.magic == FLASH_MAGIC && h.ref != 0xffffffff) {
-printf("doinit 1\n");
-    unsigned int  address = (FLASH_FIRST*SPI_FLASH_SEC_SIZE);
-    int last_page_address = current_page_address;
-    spi_flash_read(address, (unsigned int *)&h, sizeof(h));
-    while (h.magic == FLASH_MAGIC && h.ref == (last_ref-1)) {
-        last_ref = h.ref;
-        last_page_address = address;
-        address += SPI_FLASH_SEC_SIZE;
-        spi_flash_read(address, (unsigned int *)&h, sizeof(h));
+  unsigned int ref, newest, best, best_w = ~0;
+  int pos, lo, hi, best_pos = 0;
+
+  cache_len = 0;
+  if (restored) {   // RestoreCursor() gave us where we are, unless it's stale
+    restored = 0;
+    if (cursor_current()) {
+      init = 1;
+      return;
     }
-    first_page_address = last_page_address;
-  } else {
-printf("doinit 2\n");
-    for (int i = 0; i < (FLASH_LAST-FLASH_FIRST+1); i++) {
-      spi_flash_read(current_page_address, (unsigned int *)&h, sizeof(h));
-      if (h.magic == FLASH_MAGIC && h.ref != 0xffffffff) 
-        break;
-      current_page_address -= SPI_FLASH_SEC_SIZE;
+printf("stale cursor\n");
+    first_page_offset = 0;
+    full = 0;
+    memset(sector_blank, 0, sizeof(sector_blank));
+    memset(sector_dirty, 0, sizeof(sector_dirty));
+  }
+printf("doinit\n");
+  searched = 1;
+  packed_page = ~0;
+  for (probe_bits = 0; (1<<probe_bits) < pages(); probe_bits++)
+    ;
+  ref = 0xffffffff;
+  pos = 0;
+  best = dev->last*SPI_FLASH_SEC_SIZE;
+  for (probed = 0; probed < (1<<probe_bits); probed++) {  // look for any page in use, coarse to fine
+    pos = probe_pos(probed, probe_bits);
+    if (pos >= pages())
+      continue;
+    ref = read_ref(pos, &h);
+    if (ref != 0xffffffff)
+      break;
+    if (wear_window > 1 && (header_wear(&h) < best_w || (header_wear(&h) == best_w && pos < best_pos))) {
+      best = page_address(pos);   // in case the ring's empty
+      best_w = header_wear(&h);
+      best_pos = pos;
     }
-    if (current_page_address < (FLASH_FIRST*SPI_FLASH_SEC_SIZE)) {  // empty - make an initial empty record
+  }
+  newest = h.ref;
+  if (ref == 0xffffffff) {  // empty - make an initial empty record, at the least worn sector
 printf("doinit - empty\n");
-      current_page_address = first_page_address = (FLASH_LAST*SPI_FLASH_SEC_SIZE);
+    probed = 0;
+    current_page_address = first_page_address = best;
       
-      EraseSector(current_page_address/SPI_FLASH_SEC_SIZE);
+    EraseSector(current_page_address/SPI_FLASH_SEC_SIZE);
       
-      h.magic = FLASH_MAGIC;
-      h.ref = 0;
-      next_ref = 1;
+    h.magic = FLASH_MAGIC;
+    h.ref = 0;
+    next_ref = 1;
 printf("doinit - writing data 0x%x\n", current_page_address);
-      noInterrupts();
-      if (spi_flash_write(current_page_address, reinterpret_cast<uint32_t*>(&h), sizeof(h)) != SPI_FLASH_RESULT_OK) {
-        interrupts();
-printf("doinit - writing data retry 0x%x\n", current_page_address);
-        noInterrupts(); // retry
-        spi_flash_write(current_page_address, reinterpret_cast<uint32_t*>(&h), sizeof(h));
-      }
-      interrupts();
-      first_page_offset = current_page_offset = 0;
-      goto done;
-    }
-    first_page_address = current_page_address;
-  }
-printf("doinit a fpa=0x%x cpa = 0x%x\n", first_page_address, current_page_address);
-  for (;;) {
-      unsigned int address = current_page_address-SPI_FLASH_SEC_SIZE;
-      if (address < (FLASH_FIRST*SPI_FLASH_SEC_SIZE))
-        break;
-      spi_flash_read(address, (unsigned int *)&h, sizeof(h));
-      if (h.magic != FLASH_MAGIC || h.ref != (last_ref+1))
-        break;
-     current_page_address = address;
-     last_ref = h.ref;
+    program(current_page_address, &h, offsetof(flash_page_header, erases));
+    first_page_offset = 0;
+    current_page_offset = sizeof(h);
+    current_packed = 1;
+    erase_page = next_page(current_page_address);
+    SummaryClear(&summary);
+    goto done;
   }
-printf("doinit b fpa=0x%x cpa = 0x%x\n", first_page_address, current_page_address);
-  next_ref = h.ref+1;
+
+  // newest page - largest d with ref(pos+d) == ref+d
+  lo = run_end(pos, ref, pages(), 1, &newest);
+  current_page_address = page_address(pos+lo);
+  next_ref = ref+lo+1;
+
+  // oldest page - largest d with ref(pos-d) == ref-d, refs start at 0 and the run can't be longer than the ring
+  hi = pages()-lo;
+  if (hi > (int)ref+1)
+    hi = ref+1;
+  lo = run_end(pos, ref, hi, -1, &h.ref);
+  probed = 0;
+  first_page_address = page_address(pos-lo);
+  erase_page = next_page(current_page_address);  // we don't know what's in the free pages
+  if ((newest&FLASH_REF_EVICTED) && !evicted)  // we'd thrown records away, the count went with the cursor
+    evicted_lost = 1;
+printf("doinit fpa=0x%x cpa = 0x%x next_ref=%d\n", first_page_address, current_page_address, next_ref);
+
+  SummaryClear(&summary);   // we don't know what's already in the current page
+  summary.flags |= FLASH_SUMMARY_PARTIAL;
+
   // now search for end of page
-  current_page_offset = 0;
+  current_page_offset = page_data(current_page_address);
+  current_packed = page_is_packed;  // page_data() just looked
   for (;;) {
-      unsigned char v;
-      if (current_page_offset >= SEC_MAX_DATA)
-        break;
-      v = read_length(current_page_address+sizeof(flash_page_header)+current_page_offset);
-      if (v == 0xff)
+      unsigned int data, next;
+
+      if (!record_at(current_page_address, current_page_offset, current_packed, &data, &next))
         break;
-      current_page_offset += (v+2+3)&~3;
+      current_page_offset = next;
+  }
+  if (current_packed && !page_open(current_page_address, current_page_offset)) {
+    if (current_page_offset < FLASH_PAGE_END)
+      current_page_offset = FLASH_PAGE_END; // we lost power writing it, or just after sealing it
+    SummaryClear(&summary);                 // nothing more to seal
   }
 done:
 printf("doinit done\n");
   next_page_address = first_page_address;
   next_page_offset = first_page_offset;
+  next_record_done = 0;
   init = 1;
 }
 
 bool 
-HomeFlash::WriteRecord(unsigned char *p, int len) // write a record len <= 255
+FlashRing::WriteRecord(unsigned char *p, int len, const flash_summary *s) // write a record len <= FLASH_RECORD_MAX
 {
-  union {
-      unsigned char b[256];
-      unsigned int align;
-  }b;
+  flash_page_header h;
+  unsigned char l[2];
+  const unsigned char *b[3] = {(const unsigned char *)&h, l, p};
+  int bl[3] = {0, 1, len};   // no header unless we start a new page
+  int sz;
 
 printf("write record %d bytes\n", len);
-  if (len <= 0 || len > 255)
+  if (len <= 0 || len > (int)FLASH_RECORD_MAX)
     return 0;
-  if (!init)
-    DoInit();
-  int sz = (1+len+3)&~3;
-  b.b[0] = len-1;
-  memcpy(&b.b[1], p, len);
-  for (int i = len+1; i < len; i++)
-    b.b[i] = 0xff;
-  if (full) {
+  if (full && !overwrite) {
     printf("data is full\n");
     return 0;
   }
-  if ((current_page_offset+sz) > SEC_MAX_DATA) { // current page is full move to the next 
-    unsigned int n;
-    
-    if (current_page_address == (FLASH_FIRST*SPI_FLASH_SEC_SIZE)) {
-      n = FLASH_LAST*SPI_FLASH_SEC_SIZE;
-    } else {
-      n = current_page_address-SPI_FLASH_SEC_SIZE;
-    }
-    if (n == first_page_address) {
+  if (!init)
+    DoInit();
+  l[0] = len-1;
+  if (len > 0x80) {   // doesn't fit in 7 bits, it takes two
+    l[0] = 0x80|((len-1)>>8);
+    l[1] = len-1;
+    bl[1] = 2;
+  }
+  sz = bl[1]+len;
+  if (!current_packed || (current_page_offset+sz) > FLASH_PAGE_END) { // current page is full (or old) move to the next 
+    if (overwrite && next_page(current_page_address) == first_page_address)
+      evict();
+    if (next_page(current_page_address) == first_page_address) {
       full = 1;
       printf("data is full\n");
       // here's where we overflow into external flash
       return 0;
     } 
-    current_page_address = n;
-    EraseSector(current_page_address/SPI_FLASH_SEC_SIZE);
-    flash_page_header h;
+    seal();
+    current_page_address = allocate_page();
+    if (current_page_address == packed_page)  // page_packed() might have seen it blank
+      packed_page = ~0;
+    if (overwrite && next_page(current_page_address) == first_page_address)
+      evict();    // this is the last free page, make the next one now
     h.magic = FLASH_MAGIC;
     h.ref = next_ref++;
-printf("writing header 0x%x\n", current_page_address);
-    noInterrupts();
-    if (spi_flash_write(current_page_address, reinterpret_cast<uint32_t*>(&h), sizeof(h)) != SPI_FLASH_RESULT_OK) {
-      interrupts();
-      noInterrupts(); // retry
-      if (spi_flash_write(current_page_address, reinterpret_cast<uint32_t*>(&h), sizeof(h))!= SPI_FLASH_RESULT_OK) {
-        interrupts();
-        return 0;
+    if (evicted || evicted_lost)
+      h.ref |= FLASH_REF_EVICTED;
+    h.erases = 0xffffffff;      // programming FFs leaves the count EraseSector() wrote alone
+    bl[0] = sizeof(h);
+    current_page_offset = 0;    // the header goes in the same program as the record
+    current_packed = 1;
+    SummaryClear(&summary);
+  }
+printf("writing %d bytes to 0x%x\n", bl[0]+sz, current_page_address+current_page_offset);
+  if (!program_bytes(current_page_address+current_page_offset, b, bl, 3))
+    return 0;
+  current_page_offset += bl[0]+sz;
+  if (s) {
+    SummaryMerge(&summary, s);
+  } else {
+    summary.flags |= FLASH_SUMMARY_PARTIAL;
+  }
+  return 1;
+}
+
+//
+//  how long the next record can be, up to max, and still end on a flash program page 
+//  boundary, so that it's written with as few program operations as it can be - whoever is
+//  collecting records sizes them with this. If that would be a small record we go on to the
+//  boundary after. A record of 129 bytes with a one byte length can't be done, that
+//  one ends a byte short. A max bigger than a program page means whoever's collecting has
+//  room for more than one program can write, so rather than stop short at the boundary we
+//  let the record run on up to the end of the next program page - two programs, but fewer
+//  records (the sketch's RTC buffer is a bit over a program page)
+//
+int
+FlashRing::ProgramRoom(int max)
+{
+  unsigned int o, end;
+  int n;
+
+  if (!init)
+    DoInit();
+  o = current_page_offset;
+  if (!current_packed || o+FLASH_PROGRAM_PAGE/4 > FLASH_PAGE_END)  // it'll go in a new page, after the header
+    o = sizeof(flash_page_header);
+  end = (o|(FLASH_PROGRAM_PAGE-1))+1;
+  if (end-o < FLASH_PROGRAM_PAGE/4)
+    end += FLASH_PROGRAM_PAGE;
+  while (end+FLASH_PROGRAM_PAGE <= FLASH_PAGE_END && (int)(end+FLASH_PROGRAM_PAGE-o-2) <= max)
+    end += FLASH_PROGRAM_PAGE;
+  if (max > FLASH_PROGRAM_PAGE && end == (o|(FLASH_PROGRAM_PAGE-1))+1)
+    end += FLASH_PROGRAM_PAGE;
+  if (end > FLASH_PAGE_END)
+    end = FLASH_PAGE_END;
+  n = end-o;
+  n -= n > 0x81 ? 2 : 1;    // the length
+  return n > max ? max : n;
+}
+
+//
+//  we're done with the current page, write its summary in the footer - once, and only if
+//  the page has room for one (it might be from before we had them)
+//
+void
+FlashRing::seal(void)
+{
+  unsigned int m;
+
+  if (!summary.samples && !summary.flags)
+    return;
+  dev->read(current_page_address, &m, sizeof(m));
+  if ((m == FLASH_MAGIC || m == FLASH_MAGIC_V3) && current_page_offset <= FLASH_PAGE_END) {
+    summary.end = 0xff;
+    summary.magic = FLASH_SUMMARY_MAGIC;
+    program(current_page_address+FLASH_PAGE_END, &summary, sizeof(summary));
+  }
+  SummaryClear(&summary);
+}
+
+void
+SummaryClear(flash_summary *s)
+{
+  memset(s, 0, sizeof(*s));
+  s->end = 0xff;
+  s->min_temp = 127;
+  s->max_temp = -128;
+  s->min_humidity = 255;
+  s->min_pressure = 0xffff;
+}
+
+void
+SummaryMerge(flash_summary *to, const flash_summary *from)
+{
+  to->flags |= from->flags;
+  to->samples = to->samples+from->samples > 0xffff ? 0xffff : to->samples+from->samples;
+  if (from->first_time && (!to->first_time || from->first_time < to->first_time))
+    to->first_time = from->first_time;
+  if (from->last_time > to->last_time)
+    to->last_time = from->last_time;
+  if (from->min_temp < to->min_temp)
+    to->min_temp = from->min_temp;
+  if (from->max_temp > to->max_temp)
+    to->max_temp = from->max_temp;
+  if (from->min_humidity < to->min_humidity)
+    to->min_humidity = from->min_humidity;
+  if (from->max_humidity > to->max_humidity)
+    to->max_humidity = from->max_humidity;
+  if (from->min_pressure < to->min_pressure)
+    to->min_pressure = from->min_pressure;
+  if (from->max_pressure > to->max_pressure)
+    to->max_pressure = from->max_pressure;
+}
+
+//
+//  pick the page after the current one - normally the next one round the ring, but if one of
+//  the next wear_window free pages will have been erased at least FLASH_WEAR_SLACK fewer times
+//  we skip ahead to the least worn of them. next_ref goes up by however far we moved so that
+//  DoInit() can still tell which pages belong to the run. Any page we skip that still needs
+//  erasing is left for EraseAhead() to do once the run has moved past it
+//
+unsigned int
+FlashRing::allocate_page(void)
+{
+  unsigned int n = next_page(current_page_address);
+  unsigned int best = n;
+
+  if (wear_window > 1) {
+    unsigned int a = n, w, first_w, best_w;
+    int d = 1;
+
+    first_w = best_w = page_erases(n);
+    for (int i = 1; i < wear_window; i++) {
+      a = next_page(a);
+      if (a == first_page_address)
+        break;
+      w = page_erases(a);
+      if (w < best_w) {
+        best = a;
+        best_w = w;
+        d = i+1;
       }
     }
-    interrupts();
-    current_page_offset = 0;
+    if (best_w+FLASH_WEAR_SLACK > first_w) {
+      best = n;
+      d = 1;
+    }
+    next_ref += d-1;
   }
-printf("writing %d bytes to 0x%x\n", sz, current_page_address+current_page_offset);
-  noInterrupts();
-  if (spi_flash_write(current_page_address+sizeof(flash_page_header)+current_page_offset, reinterpret_cast<uint32_t*>(&b.b[0]), sz) != SPI_FLASH_RESULT_OK) {
-    interrupts();
-    noInterrupts(); // retry
-    if (spi_flash_write(current_page_address+sizeof(flash_page_header)+current_page_offset, reinterpret_cast<uint32_t*>(&b.b[0]), sz) != SPI_FLASH_RESULT_OK) {
-      interrupts();
-      return 0;
+  for (unsigned int a = n; ; a = next_page(a)) {
+    if (a == erase_page) {  // EraseAhead() didn't get here in time
+      EraseSector(best/SPI_FLASH_SEC_SIZE);
+      erase_page = next_page(best);
+      break;
     }
+    if (a == best)
+      break;
   }
-  interrupts();
-  current_page_offset += sz;
+  return best;
+}
+
+//
+//  throw away the oldest page to make room, counting the records in it that haven't been
+//  uploaded - freeing it is just like CommitBuffer() does, EraseAhead() or allocate_page() 
+//  will erase it
+//
+void
+FlashRing::evict(void)
+{
+  unsigned int a = first_page_address, o, m, data;
+  bool packed;
+  int n = 0;
+
+  if (a == current_page_address)  // a one page ring, nothing we can do
+    return;
+  o = first_page_offset ? first_page_offset : page_data(a);
+  packed = page_packed(a);
+  while (o && record_at(a, o, packed, &data, &o))
+    n++;
+  dev->read(a, &m, sizeof(m));
+  if (FLASH_IN_USE(m)) {
+    m = FLASH_FREED(m);
+    program(a, &m, sizeof(m));
+  }
+  do {  // the new oldest page, past any allocate_page() skipped
+    first_page_address = next_page(first_page_address);
+  } while (first_page_address != current_page_address && !page_data(first_page_address));
+  first_page_offset = 0;
+printf("evicted page 0x%x, %d records\n", a, n);
+  for (; a != first_page_address; a = next_page(a))  // an upload was part way through it
+  if (next_page_address == a) {
+    next_page_address = first_page_address;
+    next_page_offset = 0;
+    next_record_done = 0;
+  }
+  evicted += n;
+  full = 0;
+}
+
+unsigned int
+FlashRing::page_erases(unsigned int address)
+{
+  flash_page_header h;
+
+  dev->read(address, (unsigned int *)&h, sizeof(h));
+  return header_wear(&h);
+}
+
+//
+//  program flash, retrying once - everything that writes to the flash comes through here
+//  so that we know the sector is no longer blank, and so that LoadBuffer()'s cache goes
+//
+bool
+FlashRing::program(unsigned int address, void *p, int len)
+{
+  unsigned short s = address/SPI_FLASH_SEC_SIZE;
+
+  mark(sector_blank, s, 0);
+  mark(sector_dirty, s, 1);
+  cache_len = 0;
+  if (!dev->write(address, p, len) && !dev->write(address, p, len)) // retry once
+    return 0;
   return 1;
 }
 
-unsigned int 
-HomeFlash::LoadBuffer(unsigned char *p, int max_len)
+//
+//  program n runs of bytes back to back starting at address, which needn't be aligned - one
+//  program operation per FLASH_PROGRAM_PAGE they touch. The rest of the first and last words
+//  are programmed as FFs, which leaves whatever is already there alone
+//
+bool
+FlashRing::program_bytes(unsigned int address, const unsigned char *const *p, const int *len, int n)
 {
   union {
-      unsigned int align;
-      unsigned char b[256];
+    unsigned char b[FLASH_PROGRAM_PAGE];
+    unsigned int align;
   } b;
-  int r = 0;
+  int i = 0, o = 0;   // which run, how far into it
+
+  while (i < n) {
+    unsigned int start = address&~3;
+    unsigned int end = (address|(FLASH_PROGRAM_PAGE-1))+1;
+    unsigned int k = address-start;
+
+    memset(&b.b[0], 0xff, sizeof(b.b));
+    while (i < n && start+k < end) {
+      unsigned int c = len[i]-o;
+
+      if (c > end-start-k)
+        c = end-start-k;
+      memcpy(&b.b[k], p[i]+o, c);
+      k += c;
+      o += c;
+      if (o == len[i]) {
+        i++;
+        o = 0;
+      }
+    }
+    if (start+k > address && !program(start, &b.align, (k+3)&~3))
+      return 0;
+    address = start+k;
+  }
+  return 1;
+}
+
+//
+//  the sector bitmaps are indexed from the ring's first sector, sectors past the end of 
+//  them (only in a big external ring) are never known
+//
+bool
+FlashRing::known(const unsigned int *map, unsigned short s)
+{
+  s -= dev->first;
+  if (s >= FLASH_BITMAP_WORDS*32)
+    return 0;
+  return (map[s>>5]&(1<<(s&31))) != 0;
+}
+
+void
+FlashRing::mark(unsigned int *map, unsigned short s, bool v)
+{
+  s -= dev->first;
+  if (s >= FLASH_BITMAP_WORDS*32)
+    return;
+  if (v) {
+    map[s>>5] |= 1<<(s&31);
+  } else {
+    map[s>>5] &= ~(1<<(s&31));
+  }
+}
+
+//
+//  LoadBuffer() reads records through a small cache rather than with two dev->read()s 
+//  per record, each read costs a flash command and time with the flash cache disabled. The
+//  cache holds up to FLASH_READ_CACHE bytes from one sector starting where it was needed, 
+//  records never cross a sector so a record is always either a hit or fits after a refill - 
+//  apart from ones longer than the cache, which next_record() hands out a cache full at a time.
+//  Anything that changes the flash throws it away - program() and EraseSector() do.
+//
+FlashRing *FlashRing::cache_ring;
+unsigned int FlashRing::cache_address;
+unsigned int FlashRing::cache_len;
+union FlashRing::cache_buffer FlashRing::cache;
+
+const unsigned char *
+FlashRing::cache_read(unsigned int address, int len)
+{
+  if (cache_ring != this || address < cache_address || address+len > cache_address+cache_len) {
+    cache_ring = this;
+    unsigned int end = (address|(SPI_FLASH_SEC_SIZE-1))+1;
+
+    cache_address = address&~3;
+    cache_len = end-cache_address;
+    if (cache_len > sizeof(cache.b))
+      cache_len = sizeof(cache.b);
+    dev->read(cache_address, &cache.align, cache_len);
+  }
+  return &cache.b[address-cache_address];
+}
+
+//
+//  can we go on adding records to a FLASH_MAGIC page at offset - only if that's unwritten (it
+//  isn't if the power went part way through programming a record, the byte there can be
+//  anything) and the footer is too (it's there if the power went after seal() and before we
+//  got the next page going)
+//
+bool
+FlashRing::page_open(unsigned int address, unsigned int offset)
+{
+  const unsigned char *f;
+
+  if (offset < FLASH_PAGE_END && *cache_read(address+offset, 1) != 0xff)
+    return 0;
+  f = cache_read(address+FLASH_PAGE_END, sizeof(flash_summary));
+  for (unsigned int i = 0; i < sizeof(flash_summary); i++)
+  if (f[i] != 0xff)
+    return 0;
+  return 1;
+}
+
+//
+//  where the records in a page start, 0 if it's not in use (one allocate_page() skipped)
+//
+unsigned int
+FlashRing::page_data(unsigned int address)
+{
+  const flash_page_header *h = (const flash_page_header *)cache_read(address, sizeof(flash_page_header));
+
+  packed_page = address;  // while we have the magic
+  page_is_packed = h->magic == FLASH_MAGIC;
+  if (h->magic == FLASH_MAGIC || h->magic == FLASH_MAGIC_V3 || h->magic == FLASH_MAGIC_V2)
+    return sizeof(flash_page_header);
+  if (h->magic == FLASH_MAGIC_V1)
+    return FLASH_HEADER_V1;
+  return 0;
+}
+
+//
+//  is a page in use one of ours with packed records, or an older one - remembered for the last
+//  page we asked about, which is normally the one we're reading
+//
+bool
+FlashRing::page_packed(unsigned int address)
+{
+  unsigned int m;
+
+  if (address == current_page_address)
+    return current_packed;
+  if (address != packed_page) {
+    dev->read(address, &m, sizeof(m));
+    packed_page = address;
+    page_is_packed = m == FLASH_MAGIC;
+  }
+  return page_is_packed;
+}
+
+//
+//  the record at offset in a page - returns its length, and the offsets of its data and of 
+//  the record after it, or 0 if there isn't one there
+//
+int
+FlashRing::record_at(unsigned int page, unsigned int offset, bool packed, unsigned int *data, unsigned int *next)
+{
+  unsigned int v;
+
+  if (offset >= SPI_FLASH_SEC_SIZE)
+    return 0;
+  v = *cache_read(page+offset, 1);
+  if (v == 0xff)
+    return 0;
+  *data = offset+1;
+  if (packed && (v&0x80)) {   // two bytes
+    if (offset+1 >= SPI_FLASH_SEC_SIZE)
+      return 0;
+    v = ((v&0x7f)<<8)|*cache_read(page+offset+1, 1);
+    *data = offset+2;
+  }
+  *next = packed ? *data+v+1 : (*data+v+1+3)&~3;
+  if (*next > SPI_FLASH_SEC_SIZE)   // not something we wrote
+    return 0;
+  return v+1;
+}
+
+//
+//  the next record to upload, without copying it - the pointer is into the read cache (or
+//  the gap escape) and is only good until the next call into the flash. 0 when there
+//  are no more. Records longer than the cache come back in pieces
+//
+const unsigned char *
+FlashRing::ReadRecord(int *len)
+{
+  return next_record(len, FLASH_RECORD_MAX, 0);
+}
+
+//
+//  ReadRecord() that returns at most room bytes - if whole, stopping with *len set before a
+//  record that's longer than room rather than starting on it. 0 with *len 0 at the end
+//
+const unsigned char *
+FlashRing::next_record(int *len, int room, bool whole)
+{
+  static unsigned char gap[3];
+
   if (!init)
     DoInit();
+  if ((evicted || evicted_lost) && !gap_loaded) { // records are missing before the oldest we have, say so first
+    unsigned int n = evicted;
+
+    if (evicted_lost || n >= FLASH_GAP_AT_LEAST)
+      n = (n >= FLASH_GAP_AT_LEAST ? FLASH_GAP_AT_LEAST-1 : n)|FLASH_GAP_AT_LEAST;
+
+    *len = sizeof(gap);
+    if (room < (int)sizeof(gap))
+      return 0;
+    gap[0] = FLASH_GAP;
+    gap[1] = n>>8;
+    gap[2] = n;
+    gap_loaded = evicted|(evicted_lost ? FLASH_GAP_LOST : 0);
+    return &gap[0];
+  }
   for (;;) { // Loop over pages
-    while(r < max_len) { // Loop over records in page
-      unsigned char sz;
-      if (next_page_offset >= SEC_MAX_DATA) {
-        next_page_offset = 0;
-        break;
+    if (next_page_offset == 0)  // just got here, skip the header
+      next_page_offset = page_data(next_page_address);
+    if (next_page_offset &&
+        // we know where the current page ends, don't go looking
+        !(next_page_address == current_page_address && next_page_offset >= current_page_offset)) {
+      unsigned int data, next;
+      int l = record_at(next_page_address, next_page_offset, page_packed(next_page_address), &data, &next);
+
+      if (l) {
+        *len = l -= next_record_done;
+        if (room <= 0 || (whole && !next_record_done && l > room))
+          return 0;
+        data += next_record_done;
+        if (l > room || l > FLASH_READ_CACHE-3) { // a piece of it, room for data not being aligned
+          l = room < FLASH_READ_CACHE-3 ? room : FLASH_READ_CACHE-3;
+          next_record_done += l;
+        } else {
+          next_page_offset = next;
+          next_record_done = 0;
+        }
+        *len = l;
+        return cache_read(next_page_address+data, l);
       }
-      // Read in first four bytes, which include the size field
-      spi_flash_read(next_page_address+sizeof(flash_page_header)+next_page_offset, (unsigned int *)&b, 4);
-      sz = b.b[0];
-      if (sz == 0xff)
-        break;
-      sz += 1;
-
-      // Don't return partial records
-      if (r + sz > max_len)
-          break;
-
-      // Read remaining bytes
-      int inc = (sz+1+3)&~3;
-      if (inc > 4)
-        spi_flash_read(next_page_address+sizeof(flash_page_header)+next_page_offset+4, (unsigned int *)&b.b[4], inc-4);
-      memcpy(p, &b.b[1], sz);
-      p += sz;
-      r += sz;
-      next_page_offset += inc;
     }
-    if (next_page_address == current_page_address)
-      return r|FLASH_END_MARKER;
-
+    if (next_page_address == current_page_address) {
+      *len = 0;
+      return 0;
+    }
     next_page_offset = 0;
-    if (next_page_address == (FLASH_FIRST*SPI_FLASH_SEC_SIZE)) {
-      next_page_address = FLASH_LAST*SPI_FLASH_SEC_SIZE;
+    next_record_done = 0;
+    next_page_address = next_page(next_page_address);
+  }
+}
+
+unsigned int 
+FlashRing::LoadBuffer(unsigned char *p, int max_len)
+{
+  int r = 0;
+
+  for (;;) {
+    const unsigned char *b;
+    int sz;
+
+    b = next_record(&sz, max_len-r, r != 0);  // Don't return partial records unless they'd never fit, the next call starts with this one
+    if (!b)
+      return sz ? r : r|FLASH_END_MARKER;
+    memcpy(p, b, sz);
+    p += sz;
+    r += sz;
+  }
+}
+
+//
+//  how many bytes ReadRecord()/LoadBuffer() have still to return, reads every record header
+//  from where we are to the end
+//
+unsigned int
+FlashRing::Pending(void)
+{
+  unsigned int a, o, d, g, r = 0;
+  int sz;
+
+  if (!init)
+    DoInit();
+  a = next_page_address;
+  o = next_page_offset;
+  d = next_record_done;
+  g = gap_loaded;
+  while (ReadRecord(&sz))
+    r += sz;
+  next_page_address = a;
+  next_page_offset = o;
+  next_record_done = d;
+  gap_loaded = g;
+  return r;
+}
+
+//
+//  move the read position to the start of the first page that could hold samples from 
+//  from..to (seconds since 2000) - pages with a footer whose times are all before from are 
+//  skipped without reading their records, pages without one we have to assume could. This
+//  is for exports, CommitBuffer() after a Seek() would free everything that was skipped
+//
+int
+FlashRing::Seek(unsigned int from, unsigned int to)
+{
+  if (!init)
+    DoInit();
+  next_record_done = 0;
+  for (unsigned int a = first_page_address; ; a = next_page(a)) {
+    flash_summary f;
+    unsigned int m;
+    bool known;
+
+    if (a == current_page_address) {  // no footer yet, we have it here
+      f = summary;
+      known = 1;
     } else {
-      next_page_address = next_page_address-SPI_FLASH_SEC_SIZE;
+      dev->read(a, &m, sizeof(m));
+      if (!FLASH_IN_USE(m))           // one allocate_page() skipped
+        continue;
+      known = m == FLASH_MAGIC || m == FLASH_MAGIC_V3;
+      if (known) {
+        dev->read(a+FLASH_PAGE_END, (unsigned int *)&f, sizeof(f));
+        known = f.magic == FLASH_SUMMARY_MAGIC;
+      }
     }
+    if (known && !(f.flags&FLASH_SUMMARY_PARTIAL) && f.first_time) {
+      if (f.first_time > to) {
+        next_page_address = a;
+        next_page_offset = a == first_page_address ? first_page_offset : 0;
+        return FLASH_SEEK_AFTER;
+      }
+      if (f.last_time < from) {
+        if (a != current_page_address)
+          continue;
+        next_page_address = current_page_address;  // leave it at the end
+        next_page_offset = current_page_offset;
+        return FLASH_SEEK_BEFORE;
+      }
+    }
+    next_page_address = a;
+    next_page_offset = a == first_page_address ? first_page_offset : 0;
+    return FLASH_SEEK_FOUND;
+  }
+}
+
+//
+//  the cursor lives in RTC memory, it survives a deep sleep but not a power cycle, and might
+//  be stale or trashed if we were reset before saving it - we only trust it if it checks out
+//
+static unsigned char
+cursor_check(const flash_cursor *c)
+{
+  const unsigned char *p = (const unsigned char *)c;
+  unsigned char v = c->magic;
+
+  for (int i = 2; i < (int)sizeof(*c); i++)
+    v = ((v<<1)|(v>>7)) ^ p[i];
+  return v;
+}
+
+void
+FlashRing::SaveCursor(flash_ring_cursor *c)
+{
+  c->first_page = first_page_address/SPI_FLASH_SEC_SIZE;
+  c->current_page = current_page_address/SPI_FLASH_SEC_SIZE;
+  c->first_page_offset = first_page_offset;
+  c->current_page_offset = current_page_offset | (full?FLASH_CURSOR_FULL:0) | (current_packed?0:FLASH_CURSOR_OLD) |
+    (evicted_lost || evicted > 0xffff ? FLASH_CURSOR_LOST : 0);
+  c->next_ref = next_ref;
+  c->erase_page = erase_page/SPI_FLASH_SEC_SIZE;
+  c->evicted = evicted > 0xffff ? 0xffff : evicted;
+  c->summary = summary;
+  memcpy(c->blank, sector_blank, sizeof(c->blank));
+  memcpy(c->dirty, sector_dirty, sizeof(c->dirty));
+}
+
+//
+//  a cursor that checks out can still be stale - a watchdog reset or an exception after we
+//  wrote, freed or evicted, but before enter_deep_sleep() saved the cursor, leaves RTC memory
+//  with the one from the wake before. Writing (or erasing) where that says would destroy
+//  records, so before we use one we check the flash still looks like it: nothing written where
+//  the next record goes, the current page not sealed, the first page not freed. That's up to
+//  three small reads, and only on wakes that use the ring rather than on every wake
+//
+bool
+FlashRing::cursor_current(void)
+{
+  unsigned int m;
+  unsigned char w[4];
+
+  if (current_page_offset < SPI_FLASH_SEC_SIZE) {
+    dev->read(current_page_address+(current_page_offset&~3), (unsigned int *)&w[0], sizeof(w));
+    if (w[current_page_offset&3] != 0xff)
+      return 0;
+  }
+  if (current_packed && current_page_offset <= FLASH_PAGE_END) {
+    dev->read(current_page_address+FLASH_PAGE_END+offsetof(flash_summary, magic), &m, sizeof(m));
+    if (m != 0xffffffff)
+      return 0;
   }
+  if (first_page_address != current_page_address) {
+    dev->read(first_page_address, &m, sizeof(m));
+    if (!FLASH_IN_USE(m))
+      return 0;
+  }
+  return 1;
+}
+
+bool
+FlashRing::RestoreCursor(const flash_ring_cursor *c)  // 0 means search for it
+{
+  unsigned int o = c ? c->current_page_offset&~(FLASH_CURSOR_FULL|FLASH_CURSOR_OLD|FLASH_CURSOR_LOST) : 0;
+
+  if (!c ||
+      c->first_page < dev->first || c->first_page > dev->last ||
+      c->current_page < dev->first || c->current_page > dev->last ||
+      c->erase_page < dev->first || c->erase_page > dev->last ||
+      c->first_page_offset > SPI_FLASH_SEC_SIZE || o < FLASH_HEADER_V1 || o > SPI_FLASH_SEC_SIZE) {
+    init = 0;   // DoInit() will search for it
+    restored = 0;
+    first_page_offset = 0;
+    memset(sector_blank, 0, sizeof(sector_blank));
+    memset(sector_dirty, 0, sizeof(sector_dirty));
+    return 0;
+  }
+  first_page_address = c->first_page*SPI_FLASH_SEC_SIZE;
+  first_page_offset = c->first_page_offset;
+  current_page_address = c->current_page*SPI_FLASH_SEC_SIZE;
+  current_page_offset = o;
+  full = (c->current_page_offset&FLASH_CURSOR_FULL) != 0;
+  current_packed = !(c->current_page_offset&FLASH_CURSOR_OLD);
+  cache_len = 0;
+  next_ref = c->next_ref;
+  erase_page = c->erase_page*SPI_FLASH_SEC_SIZE;
+  evicted = c->evicted;
+  evicted_lost = (c->current_page_offset&FLASH_CURSOR_LOST) != 0;
+  gap_loaded = 0;
+  summary = c->summary;
+  memcpy(sector_blank, c->blank, sizeof(sector_blank));
+  memcpy(sector_dirty, c->dirty, sizeof(sector_dirty));
+  next_page_address = first_page_address;
+  next_page_offset = first_page_offset;
+  next_record_done = 0;
+  packed_page = ~0;
+  init = 0;       // DoInit() checks it against the flash the first time we need it
+  restored = 1;
+  return 1;
+}
+
+bool
+FlashRing::Empty()
+{
+  if (!init)
+    DoInit();
+  if (first_page_address != current_page_address)
+    return 0;
+  if (!first_page_offset) // the start of the page, find out once where that is
+    first_page_offset = page_data(current_page_address);
+  return first_page_offset >= current_page_offset;
 }
 
 void 
-HomeFlash::CommitBuffer(void)
+FlashRing::CommitBuffer(void)
 {
   if (!init)
     DoInit();
-  for (;;) {
+  for (;;) {  // free the pages we've finished with - see EraseAhead()
       if (first_page_address==current_page_address || first_page_address==next_page_address)
         break;
-      if (first_page_address == (FLASH_FIRST*SPI_FLASH_SEC_SIZE)) {
-        first_page_address = FLASH_LAST*SPI_FLASH_SEC_SIZE;
-      } else {
-        first_page_address = first_page_address-SPI_FLASH_SEC_SIZE;
+      unsigned int m;
+      dev->read(first_page_address, &m, sizeof(m));
+      if (FLASH_IN_USE(m)) {  // not one allocate_page() skipped
+        m = FLASH_FREED(m);
+        program(first_page_address, &m, sizeof(m));
       }
-      noInterrupts();
-      spi_flash_erase_sector(first_page_address/SPI_FLASH_SEC_SIZE);
-      interrupts();
+      first_page_address = next_page(first_page_address);
+      full = 0;
   }
   first_page_address = next_page_address;
   first_page_offset = next_page_offset;
+  gap_reported();
 }
 
+//
+//  the gap LoadBuffer() started with has been uploaded - once there's nothing left to report
+//  clear FLASH_REF_EVICTED in the current page, so that a cold boot doesn't report it again
+//
 void
-HomeFlash::EraseSector(unsigned short s)
+FlashRing::gap_reported(void)
+{
+  flash_page_header h;
+
+  if (!gap_loaded)
+    return;
+  evicted -= gap_loaded&~FLASH_GAP_LOST;
+  if (gap_loaded&FLASH_GAP_LOST)
+    evicted_lost = 0;
+  gap_loaded = 0;
+  if (evicted || evicted_lost)
+    return;
+  dev->read(current_page_address, (unsigned int *)&h, sizeof(h));
+  if (FLASH_IN_USE(h.magic) && (h.ref&FLASH_REF_EVICTED)) {
+    h.ref &= ~FLASH_REF_EVICTED;
+    program(current_page_address+offsetof(flash_page_header, ref), &h.ref, sizeof(h.ref));
+  }
+}
+
+//
+//  erase freed pages, the one we'll need next first, until the next erase would take us
+//  past budget uS - call this on wakes where nobody is waiting for us
+//
+void
+FlashRing::EraseAhead(unsigned long budget)
+{
+  unsigned long start = micros();
+
+  if (!init && !restored)  // not worth searching the flash for
+    return;
+  if (erase_page == first_page_address)   // nothing to erase, don't bother checking the cursor
+    return;
+  if (!init)
+    DoInit();
+  while (erase_page != first_page_address) {
+    if (micros()-start+FLASH_ERASE_TIME > budget)
+      break;
+    EraseSector(erase_page/SPI_FLASH_SEC_SIZE);
+    erase_page = next_page(erase_page);
+  }
+printf("erase ahead %luuS\n", micros()-start);
+}
+
+unsigned int
+FlashRing::next_page(unsigned int address)
+{
+  if (address == (dev->first*SPI_FLASH_SEC_SIZE))
+    return dev->last*SPI_FLASH_SEC_SIZE;
+  return address-SPI_FLASH_SEC_SIZE;
+}
+
+//
+//  make sure a sector is erased - we keep track of which sectors we know are blank (erased
+//  and not written since) and which we know have been written, if we know neither we have
+//  to read the sector to find out. Blank here means everything but the erase count is FFs
+//
+void
+FlashRing::EraseSector(unsigned short s)
 {
   unsigned int *p;
   unsigned int address = s*SPI_FLASH_SEC_SIZE;
-  unsigned int b[256/sizeof(unsigned long)];
+  unsigned int b[256/sizeof(unsigned int)];
+  unsigned int erases;
+  flash_page_header h;
+
   printf("erase sector %d address 0x%x\n", s, address);
-  for (int i = 0; i < SPI_FLASH_SEC_SIZE; i+=sizeof(b)) {
-    spi_flash_read(address+i, &b[0], sizeof(b));
-    p = &b[0];
-    for (int j = 0; j < (sizeof(b)/sizeof(b[0])); j++)
-    if (*p++ != ~0UL) {
-      printf("actual erase i=%d @%x %x %x %x\n", i, (int)p,p[-1],p[0], p[1]);
-      noInterrupts(); 
-      spi_flash_erase_sector(s);
-      interrupts();
-      return;
+  if (known(sector_blank, s))
+    return;
+  cache_len = 0;
+  dev->read(address, (unsigned int *)&h, sizeof(h));
+  erases = header_erases(&h);
+  erases = erases == ~0U ? 1 : erases+1;
+  if (!known(sector_dirty, s)) {
+    for (int i = 0; ; i+=sizeof(b)) {
+      if (i >= SPI_FLASH_SEC_SIZE) {  // it's already blank
+        mark(sector_blank, s, 1);
+        return;
+      }
+      dev->read(address+i, &b[0], sizeof(b));
+      if (i == 0)
+        b[offsetof(flash_page_header, erases)/sizeof(b[0])] = 0xffffffff;
+      p = &b[0];
+      int j;
+      for (j = 0; j < (int)(sizeof(b)/sizeof(b[0])); j++)
+      if (*p++ != 0xffffffff) 
+        break;
+      if (j < (int)(sizeof(b)/sizeof(b[0]))) {
+        printf("actual erase i=%d @%x %x %x %x\n", i, address+i+j*4,p[-1],p[0], p[1]);
+        break;
+      }
     }
   }
+  if (dev->erase(s)) {
+    dev->write(address+offsetof(flash_page_header, erases), &erases, sizeof(erases));
+    mark(sector_blank, s, 1);
+    mark(sector_dirty, s, 0);
+  }
 }
 
 void 
-HomeFlash::Erase(void)
+FlashRing::Erase(void)
 {
-  flash_page_header fh, *fhp;
-  for (unsigned int sector = FLASH_FIRST; sector <= FLASH_LAST; sector++) 
+  for (unsigned int sector = dev->first; sector <= dev->last; sector++) 
     EraseSector(sector);
-  first_page_address = next_page_address = current_page_address = FLASH_LAST*SPI_FLASH_SEC_SIZE;
-  first_page_offset = next_page_offset = current_page_address = 0;
-  init = 0;
+  first_page_address = next_page_address = current_page_address = dev->last*SPI_FLASH_SEC_SIZE;
+  first_page_offset = next_page_offset = current_page_offset = 0;
+  next_record_done = 0;
+  full = 0;
+  evicted = gap_loaded = 0;
+  evicted_lost = 0;
+  SummaryClear(&summary);
+  init = restored = 0;   // DoInit() will start the ring at the least worn sector
+}
+
+void
+FlashRing::GetWearStats(flash_wear_stats *s)
+{
+  memset(s, 0, sizeof(*s));
+  s->min = ~0;
+  for (unsigned int sector = dev->first; sector <= dev->last; sector++) {
+    flash_page_header h;
+    unsigned int e;
+
+    dev->read(sector*SPI_FLASH_SEC_SIZE, (unsigned int *)&h, sizeof(h));
+    e = header_erases(&h);
+    if (e == ~0U) {
+      s->uncounted++;
+      continue;
+    }
+    s->sectors++;
+    s->total += e;
+    if (e < s->min)
+      s->min = e;
+    if (e > s->max)
+      s->max = e;
+  }
+  if (!s->sectors)
+    s->min = 0;
 }
 
 void 
-HomeFlash::Dump(void)
+FlashRing::Dump(void)
 {
   if (!init)
     DoInit();
@@ -314,25 +1241,38 @@ HomeFlash::Dump(void)
   unsigned int address = first_page_address;
   for (;;) {
     flash_page_header h;
-    spi_flash_read(address, (unsigned int *)&h, sizeof(h));
-    if (h.magic != FLASH_MAGIC || h.ref == 0xffffffff)
-      break;
-    printf("page @0x%x - ref=0x%x\n", address, h.ref);
-    for (;;) {
-      unsigned char v;
-      if (offset >= SEC_MAX_DATA)
+    dev->read(address, (unsigned int *)&h, sizeof(h));
+    if (!FLASH_IN_USE(h.magic)) {
+      if (address == current_page_address)
         break;
-      v = read_length(address+sizeof(flash_page_header)+offset);
-      if (v == 0xff)
+      printf("page @0x%x - skipped\n", address);
+      address = next_page(address);
+      offset = 0;
+      continue;
+    }
+    printf("page @0x%x - ref=0x%x erases=%d\n", address, h.ref, h.magic != FLASH_MAGIC_V1 ? h.erases : -1);
+    if (h.magic == FLASH_MAGIC || h.magic == FLASH_MAGIC_V3) {
+      flash_summary f;
+
+      dev->read(address+FLASH_PAGE_END, (unsigned int *)&f, sizeof(f));
+      if (f.magic == FLASH_SUMMARY_MAGIC)
+        printf("  %d samples %u-%u flags 0x%x\n", f.samples, f.first_time, f.last_time, f.flags);
+    }
+    if (offset == 0)
+      offset = h.magic != FLASH_MAGIC_V1 ? sizeof(h) : FLASH_HEADER_V1;
+    for (;;) {
+      unsigned int data, next;
+      int len = record_at(address, offset, h.magic == FLASH_MAGIC, &data, &next);
+
+      if (!len)
         break;
-      int len = v+1;
       printf("  %d: len=%d\n", offset, len);
-      offset += (len+1+3)&~3;
+      offset = next;
     }
     if (address == current_page_address)
       break;
-    if (address ==  (FLASH_FIRST*SPI_FLASH_SEC_SIZE)) {
-      address = (FLASH_LAST*SPI_FLASH_SEC_SIZE);
+    if (address ==  (dev->first*SPI_FLASH_SEC_SIZE)) {
+      address = (dev->last*SPI_FLASH_SEC_SIZE);
     } else {
       address -= SPI_FLASH_SEC_SIZE;
     }
@@ -340,14 +1280,167 @@ HomeFlash::Dump(void)
   }
 }
 
-unsigned char
-HomeFlash::read_length(unsigned int offset)
+void
+HomeFlash::_initHomeFlash()
 {
-  union {
-      unsigned int v;
-      unsigned char b[4];  
-  }b;
-  spi_flash_read(offset, &b.v, sizeof(b.v));
-  return b.b[0];
+  internal_flash.first = FLASH_FIRST;
+  internal_flash.last = FLASH_LAST;
+  internal._initFlashRing(&internal_flash);
+  has_external = 0;
+}
+
+void
+HomeFlash::SetExternal(FlashDevice *d)
+{
+  has_external = d != 0;
+  if (has_external)
+    external._initFlashRing(d);
+}
+
+bool 
+HomeFlash::WriteRecord(unsigned char *p, int len, const flash_summary *s)
+{
+  if (has_external && !external.Empty())  // keep the order, see Flash.h
+    return external.WriteRecord(p, len, s);
+  if (internal.WriteRecord(p, len, s))
+    return 1;
+  if (!has_external || !internal.Full())
+    return 0;
+printf("internal flash full, overflowing\n");
+  return external.WriteRecord(p, len, s);
+}
+
+unsigned int 
+HomeFlash::LoadBuffer(unsigned char *p, int max_len)
+{
+  unsigned int r = internal.LoadBuffer(p, max_len);
+
+  if (!has_external || !(r&FLASH_END_MARKER))
+    return r;
+  r &= ~FLASH_END_MARKER;
+  return r + external.LoadBuffer(p+r, max_len-r);
+}
+
+const unsigned char *
+HomeFlash::ReadRecord(int *len)
+{
+  const unsigned char *b = internal.ReadRecord(len);
+
+  if (b || !has_external)
+    return b;
+  return external.ReadRecord(len);
+}
+
+bool
+HomeFlash::Seek(unsigned int from, unsigned int to)
+{
+  int r = internal.Seek(from, to);
+
+  if (r == FLASH_SEEK_BEFORE && has_external)
+    r = external.Seek(from, to);
+  return r == FLASH_SEEK_FOUND;
+}
+
+int
+HomeFlash::ProgramRoom(int max)
+{
+  if (has_external && (!external.Empty() || internal.Full()))  // where WriteRecord() will put it
+    return external.ProgramRoom(max);
+  return internal.ProgramRoom(max);
+}
+
+unsigned int
+HomeFlash::Pending(void)
+{
+  return internal.Pending() + (has_external ? external.Pending() : 0);
+}
+
+void
+HomeFlash::SaveCursor(flash_cursor *c)
+{
+  c->magic = FLASH_CURSOR_MAGIC;
+  c->flags = 0;
+  memset(&c->internal, 0, sizeof(c->internal));
+  memset(&c->external, 0, sizeof(c->external));
+  if (internal.Initialised()) { // if we never found out where we are, neither will the next wake
+    internal.SaveCursor(&c->internal);
+    c->flags |= FLASH_CURSOR_INTERNAL;
+  }
+  if (has_external && external.Initialised()) {
+    external.SaveCursor(&c->external);
+    c->flags |= FLASH_CURSOR_EXTERNAL;
+  }
+  c->check = cursor_check(c);
+}
+
+bool
+HomeFlash::RestoreCursor(const flash_cursor *c)
+{
+  bool ok = c->magic == FLASH_CURSOR_MAGIC && c->check == cursor_check(c);
+  bool r;
+
+  r = internal.RestoreCursor(ok && (c->flags&FLASH_CURSOR_INTERNAL) ? &c->internal : 0);
+  if (has_external)
+    external.RestoreCursor(ok && (c->flags&FLASH_CURSOR_EXTERNAL) ? &c->external : 0);
+  return r;
+}
+
+void 
+HomeFlash::CommitBuffer(void)
+{
+  internal.CommitBuffer();
+  if (has_external)
+    external.CommitBuffer();
 }
 
+void 
+HomeFlash::UnCommitBuffer(void)
+{
+  internal.UnCommitBuffer();
+  if (has_external)
+    external.UnCommitBuffer();
+}
+
+void
+HomeFlash::EraseAhead(unsigned long budget)
+{
+  unsigned long start = micros();
+
+  internal.EraseAhead(budget);
+  if (has_external && micros()-start < budget)
+    external.EraseAhead(budget-(micros()-start));
+}
+
+void 
+HomeFlash::Erase(void)
+{
+  internal.Erase();
+  if (has_external)
+    external.Erase();
+}
+
+void 
+HomeFlash::Dump(void)
+{
+  internal.Dump();
+  if (has_external) {
+    printf("external:\n");
+    external.Dump();
+  }
+}
+
+void
+HomeFlash::SetWearWindow(int w)
+{
+  internal.SetWearWindow(w);
+  if (has_external)
+    external.SetWearWindow(w);
+}
+
+void
+HomeFlash::SetOverwrite(bool on)
+{
+  internal.SetOverwrite(on && !has_external); // we overflow into external instead
+  if (has_external)
+    external.SetOverwrite(on);
+}
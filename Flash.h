@@ -19,49 +19,273 @@
 
 typedef struct flash_page_header {
   unsigned int magic;
-#define FLASH_MAGIC 0xf1a5600d
+#define FLASH_MAGIC 0xf1a5603d          // records packed, 1 or 2 byte lengths - see Flash.cpp
+#define FLASH_MAGIC_V3 0xf1a5602d       // older pages, 4 byte aligned records with a 1 byte length
+#define FLASH_MAGIC_V2 0xf1a5601d       // older still, no footer either
+#define FLASH_MAGIC_V1 0xf1a5600d       // the oldest, the header stops after ref
+#define FLASH_HEADER_V1 8
+#define FLASH_IN_USE(m) ((m) == FLASH_MAGIC || (m) == FLASH_MAGIC_V3 || (m) == FLASH_MAGIC_V2 || (m) == FLASH_MAGIC_V1)
   unsigned int ref;
+#define FLASH_REF_EVICTED 0x80000000    // or'd into the current page's, evicted records aren't reported yet
+  unsigned int erases;                  // written as soon as the sector has been erased
 } flash_page_header;
 
+//
+//  what's in a page - written as a footer in the last bytes of a FLASH_MAGIC(_V3) page when we
+//  move on to the next one, and passed to WriteRecord() for each record. Whoever writes the
+//  records fills it in, we just merge them - see FlashRing::Seek()
+//
+typedef struct flash_summary {
+  unsigned char   end;                  // 0xff, so looking for another record stops at a footer
+  unsigned char   flags;
+#define FLASH_SUMMARY_PARTIAL 0x01      // some records came without one, the page could hold anything
+  unsigned short  samples;
+  unsigned int    first_time;           // seconds since 2000, 0 if no sample had a time
+  unsigned int    last_time;
+  signed char     min_temp, max_temp;   // min > max if there were none
+  unsigned char   min_humidity, max_humidity;
+  unsigned short  min_pressure, max_pressure;
+  unsigned int    magic;                // FLASH_SUMMARY_MAGIC in a footer
+#define FLASH_SUMMARY_MAGIC 0x5e41ed00
+} flash_summary;
+#define FLASH_PAGE_END (SPI_FLASH_SEC_SIZE-sizeof(flash_summary))  // where records stop in a FLASH_MAGIC(_V3) page
+#define FLASH_RECORD_MAX (FLASH_PAGE_END-sizeof(flash_page_header)-2) // longest record, one to a page
+#define FLASH_PROGRAM_PAGE 256   // the most a flash program operation can write, aligned
+void SummaryClear(flash_summary *s);
+void SummaryMerge(flash_summary *to, const flash_summary *from);
+
+//
+//  how worn the ring is, from the erase counts in the page headers - see GetWearStats()
+//
+typedef struct flash_wear_stats {
+  unsigned int    min;
+  unsigned int    max;
+  unsigned int    total;
+  unsigned short  sectors;              // sectors with a count
+  unsigned short  uncounted;            // sectors we've never erased
+} flash_wear_stats;
+
 extern "C" {
 extern unsigned char _irom0_text_end;
 };
 
+// the host build (see host/) supplies its own values
+#ifndef FLASH_FIRST
 #define FLASH_FIRST ((((unsigned)&_irom0_text_end)-0x40200000+SPI_FLASH_SEC_SIZE-1)/SPI_FLASH_SEC_SIZE)
+#endif
+#ifndef FLASH_LAST
 #define FLASH_LAST (((512*1024)-(2*8*1024)-2*SPI_FLASH_SEC_SIZE)/SPI_FLASH_SEC_SIZE)
+#endif
 
-class HomeFlash {
+//
+//  somewhere to keep a ring of pages - sectors first..last of SPI_FLASH_SEC_SIZE bytes
+//  that behave like NOR flash (erasing sets a sector to FFs, writes can only clear bits),
+//  reads and writes are 4 byte aligned and a multiple of 4 bytes long
+//
+class FlashDevice {
 public:
-  
-  void _initHomeFlash() { init = 0; first_page_offset = 0;} // only call when calling before ctors are called out
-  HomeFlash() {_initHomeFlash();}
-  bool WriteRecord(unsigned char *p,int len); // write a record len <= 255
+  virtual bool read(unsigned int address, void *p, int len) = 0;
+  virtual bool write(unsigned int address, const void *p, int len) = 0;
+  virtual bool erase(unsigned short sector) = 0;
+  unsigned short first, last;           // the sectors we can use
+};
+
+//
+//  the 8266's own flash, after the code (see FLASH_FIRST/FLASH_LAST)
+//
+class InternalFlash: public FlashDevice {
+public:
+  bool read(unsigned int address, void *p, int len);
+  bool write(unsigned int address, const void *p, int len);
+  bool erase(unsigned short sector);
+};
+
+//
+//  a ring's position, small enough to keep in RTC memory over a deep sleep so that a 
+//  wake doesn't have to search the flash for it - see SaveCursor()/RestoreCursor()
+//
+#ifndef FLASH_BITMAP_WORDS
+#define FLASH_BITMAP_WORDS 2            // 64 sectors, the internal ring is ~47 - see FlashRing::known()
+#endif
+typedef struct flash_ring_cursor {
+  unsigned short  first_page;           // sector numbers
+  unsigned short  current_page;
+  unsigned short  first_page_offset;    // from the start of the page, 0 if not known
+  unsigned short  current_page_offset;
+#define FLASH_CURSOR_FULL 0x8000        // or'd into current_page_offset
+#define FLASH_CURSOR_OLD 0x4000         // so is this, the current page has an older record format
+#define FLASH_CURSOR_LOST 0x2000        // and this, evicted is only what's been thrown away since a cold boot
+  unsigned int    next_ref;
+  unsigned short  erase_page;           // freed pages from here to first_page need erasing
+  unsigned short  evicted;              // records thrown away, not yet reported - see FlashRing::evict()
+  flash_summary   summary;              // of the current page so far
+  unsigned int    blank[FLASH_BITMAP_WORDS];  // per sector from first, known to be erased
+  unsigned int    dirty[FLASH_BITMAP_WORDS];  // per sector from first, known to have been written
+} flash_ring_cursor;
+
+typedef struct flash_cursor {
+  unsigned char   magic;                // FLASH_CURSOR_MAGIC if valid
+#define FLASH_CURSOR_MAGIC 0xc7
+  unsigned char   check;                // checksum of everything else
+  unsigned char   flags;
+#define FLASH_CURSOR_INTERNAL 0x01      // internal is valid
+#define FLASH_CURSOR_EXTERNAL 0x02      // external is valid
+  flash_ring_cursor internal;
+  flash_ring_cursor external;
+} flash_cursor;
+
+#ifndef FLASH_WEAR_WINDOW
+#define FLASH_WEAR_WINDOW 4       // pages we look ahead for a less worn one, 1 is a plain ring
+#endif
+#define FLASH_WEAR_SLACK 2        // how much less worn it must be before we skip to it
+
+#define FLASH_GAP 0xfe            // stream escape LoadBuffer() puts where records were evicted, see decompress.h
+#define FLASH_GAP_AT_LEAST 0x8000 // in its count, there were more than that
+
+//
+//  a ring of records on one FlashDevice
+//
+class FlashRing {
+public:
+  void _initFlashRing(FlashDevice *d) { dev = d; init = 0; restored = 0; searched = 0; probed = 0; full = 0; first_page_offset = 0; wear_window = FLASH_WEAR_WINDOW; overwrite = 0; evicted = gap_loaded = 0; evicted_lost = 0; next_record_done = 0; packed_page = ~0; SummaryClear(&summary); memset(sector_blank, 0, sizeof(sector_blank)); memset(sector_dirty, 0, sizeof(sector_dirty));}
+  bool WriteRecord(unsigned char *p,int len, const flash_summary *s = 0); // write a record len <= FLASH_RECORD_MAX
 #define FLASH_END_MARKER 0x80000000
+  int ProgramRoom(int max);                   // record length <= max that ends on a FLASH_PROGRAM_PAGE boundary, if it can
   unsigned int LoadBuffer(unsigned char *p, int max_len); 
+  const unsigned char *ReadRecord(int *len);  // the next record in place (long ones in pieces), 0 at the end
+  unsigned int Pending(void);                 // bytes left to read
+  int Seek(unsigned int from, unsigned int to);
+#define FLASH_SEEK_FOUND 1      // reading starts at the first page that might hold from..to
+#define FLASH_SEEK_BEFORE 0     // everything is older than from, reading is at the end
+#define FLASH_SEEK_AFTER -1     // everything that's left is newer than to
 
-  void SetRememberedOffset(int o) { first_page_offset = o; }
-  unsigned int GetRememberedOffset() { return first_page_offset; }
+  void SaveCursor(flash_ring_cursor *c);
+  bool RestoreCursor(const flash_ring_cursor *c);
   void CommitBuffer(void);
-  void UnCommitBuffer(void) {next_page_address=first_page_address;next_page_offset=first_page_offset;};
+  void UnCommitBuffer(void) {next_page_address=first_page_address;next_page_offset=first_page_offset;next_record_done=0;gap_loaded=0;};
+  void EraseAhead(unsigned long budget);     // erase freed pages for up to budget uS
+#define FLASH_ERASE_TIME 45000    // uS, typical 4k sector erase
+#define FLASH_ERASE_BUDGET 50000  // uS per wake, one erase
   void Erase(void);
   void Dump(void);
+  void GetWearStats(flash_wear_stats *s);   // reads every header
+  void SetWearWindow(int w) { wear_window = w; init = 0; }   // DoInit() has to use the same window
+  void SetOverwrite(bool on) { overwrite = on; }  // when full throw away the oldest page rather than new records
+  unsigned int Evicted() { return evicted; }    // records thrown away since the last upload
+  bool Full() { return full; }
+  bool Empty();                             // nothing written that hasn't been committed
+
+  // where DoInit() found the ring - for diagnostics and the host benchmarks
+  bool Initialised() { return init || restored; }
+  bool Searched() { return searched; }        // no cursor, or a stale one
+  unsigned int GetFirstPage() { if (!init) DoInit(); return first_page_address; }
+  unsigned int GetCurrentPage() { if (!init) DoInit(); return current_page_address; }
+  unsigned int GetNextRef() { if (!init) DoInit(); return next_ref; }
 private:
+  FlashDevice *dev;
   bool init;
   bool full;
   void DoInit();
   void EraseSector(unsigned short s);
-  unsigned char read_length(unsigned int offset);
+  int pages() { return dev->last-dev->first+1; }
+  unsigned int page_address(int pos);
+  unsigned int read_ref(int pos, flash_page_header *h = 0);
+  int run_end(int pos, unsigned int ref, int top, int dir, unsigned int *end_ref);
+  int probe_bits, probed;     // DoInit()'s probe has found the first probed positions aren't in use
+  unsigned int next_page(unsigned int address);
+  unsigned int page_data(unsigned int address);
+  bool page_packed(unsigned int address);
+  bool page_open(unsigned int address, unsigned int offset);
+  bool restored;              // RestoreCursor() set us up, DoInit() hasn't checked it yet
+  bool searched;              // DoInit() has had to search the flash
+  bool cursor_current(void);
+  unsigned int packed_page;   // the last page page_packed() looked at, ~0 for none
+  bool page_is_packed;        // and what it found
+  int record_at(unsigned int page, unsigned int offset, bool packed, unsigned int *data, unsigned int *next);
+  const unsigned char *next_record(int *len, int room, bool whole);
+  unsigned int page_erases(unsigned int address);
+  unsigned int allocate_page(void);
+  int wear_window;
+  bool overwrite;
+  void evict(void);
+  unsigned int evicted;
+  bool evicted_lost;          // and there were more before a cold boot, we don't know how many
+  unsigned int gap_loaded;    // how many of them the last LoadBuffer() reported, FLASH_GAP_LOST if it said so
+  void gap_reported(void);
+  flash_summary summary;      // of the current page so far
+  void seal(void);
+  bool program(unsigned int address, void *p, int len);
+  bool program_bytes(unsigned int address, const unsigned char *const *p, const int *len, int n);
   unsigned int first_page_address;
   unsigned int first_page_offset;
   /// Address of the page that will be read by next call to LoadBuffer()
   unsigned int next_page_address;
   /// Offset to the current record in page at next_page_address
   unsigned int next_page_offset;
+  /// How much of that record has already been read, it's a long one
+  unsigned int next_record_done;
   unsigned int current_page_address;
   unsigned int current_page_offset;
+  bool current_packed;        // the current page is a FLASH_MAGIC one, we can add to it
   unsigned int next_ref;
+  /// first freed page still to be erased, == first_page_address if there are none
+  unsigned int erase_page;
+  unsigned int sector_blank[FLASH_BITMAP_WORDS];  // what we know about each sector, see EraseSector()
+  unsigned int sector_dirty[FLASH_BITMAP_WORDS];
+  bool known(const unsigned int *map, unsigned short s);
+  void mark(unsigned int *map, unsigned short s, bool v);
+
+  // read cache for LoadBuffer(), shared by all the rings
+#ifndef FLASH_READ_CACHE
+#define FLASH_READ_CACHE 1024
+#endif
+  const unsigned char *cache_read(unsigned int address, int len);
+  static FlashRing *cache_ring;
+  static unsigned int cache_address;
+  static unsigned int cache_len;   // 0 means empty
+  static union cache_buffer {
+    unsigned int align;
+    unsigned char b[FLASH_READ_CACHE];
+  } cache;
+}; 
+
+//
+//  records go in the internal ring, if that fills up and there's an external device they 
+//  overflow into a second ring there. Everything in the external ring is newer than 
+//  everything in the internal one - once we've overflowed we keep writing there until it
+//  has all been uploaded - so LoadBuffer() just reads the internal ring then the external.
+//  With SetOverwrite() the last ring we can write to throws away its oldest page when it 
+//  fills rather than refusing new records
+//
+class HomeFlash {
+public:
+  
+  void _initHomeFlash(); // only call when calling before ctors are called out
+  HomeFlash() {_initHomeFlash();}
+  void SetExternal(FlashDevice *d);           // call before anything else, after every wake
+  bool WriteRecord(unsigned char *p,int len, const flash_summary *s = 0); // write a record len <= FLASH_RECORD_MAX
+  int ProgramRoom(int max);                   // size records with this, see FlashRing::ProgramRoom()
+  unsigned int LoadBuffer(unsigned char *p, int max_len); 
+  const unsigned char *ReadRecord(int *len);  // zero copy LoadBuffer(), good until the next call
+  unsigned int Pending(void);                 // bytes left to read, reads every record header
+  bool Seek(unsigned int from, unsigned int to);  // skip to from..to for an export, UnCommitBuffer() after
+
+  void SaveCursor(flash_cursor *c);           // snapshot our position before deep sleep
+  bool RestoreCursor(const flash_cursor *c);  // use it after a wake, false if it's no good
+  void CommitBuffer(void);
+  void UnCommitBuffer(void);
+  void EraseAhead(unsigned long budget);     // erase freed pages for up to budget uS
+  void Erase(void);
+  void Dump(void);
+  void SetWearWindow(int w);
+  void SetOverwrite(bool on);                // after SetExternal()
+  unsigned int Evicted() { return internal.Evicted()+(has_external ? external.Evicted() : 0); }
+
+  FlashRing internal;
+  FlashRing external;                        // only if has_external
+private:
+  bool has_external;
 }; 
 
 extern HomeFlash flash;
 #endif
-
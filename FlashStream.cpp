@@ -0,0 +1,118 @@
+#include "FlashStream.h"
+
+#include "Flash.h"
+
+FlashStream::FlashStream( const uint8_t *head, size_t headLen,
+                          const uint8_t *tail, size_t tailLen ) :
+    headPtr(head),
+    tailPtr(tail),
+    headLen(headLen),
+    tailLen(tailLen)
+{
+    rewind();
+    totalLen = headLen + flash.Pending() + tailLen;
+}
+
+
+size_t FlashStream::size() const
+{
+    return totalLen;
+}
+
+
+void FlashStream::rewind()
+{
+    flash.UnCommitBuffer();
+    part = Part::HEAD;
+    chunkPtr = headPtr;
+    chunkLen = headLen;
+    readLen = 0;
+}
+
+
+bool FlashStream::nextChunk()
+{
+    while( chunkLen == 0 ) {
+        switch(part) {
+            case Part::HEAD:
+                part = Part::FLASH;
+                // fall through
+            case Part::FLASH: {
+                int len;
+
+                chunkPtr = flash.ReadRecord(&len);
+                if( chunkPtr ) {
+                    chunkLen = len;
+                    break;
+                }
+                part = Part::TAIL;
+                chunkPtr = tailPtr;
+                chunkLen = tailLen;
+                break;
+            }
+
+            case Part::TAIL:
+                part = Part::DONE;
+                // fall through
+            case Part::DONE:
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+
+int FlashStream::available()
+{
+    return totalLen - readLen;
+}
+
+
+int FlashStream::read()
+{
+    if( !nextChunk() )
+        return -1;
+
+    --chunkLen;
+    ++readLen;
+    return *chunkPtr++;
+}
+
+
+int FlashStream::peek()
+{
+    if( !nextChunk() )
+        return -1;
+
+    return *chunkPtr;
+}
+
+
+size_t FlashStream::readBytes(char *buffer, size_t length)
+{
+    size_t done(0);
+
+    while( done < length && nextChunk() ) {
+        auto n( length - done < chunkLen ? length - done : chunkLen );
+
+        memcpy(buffer + done, chunkPtr, n);
+        chunkPtr += n;
+        chunkLen -= n;
+        done += n;
+    }
+    readLen += done;
+    return done;
+}
+
+
+void FlashStream::flush()
+{
+}
+
+
+size_t FlashStream::write(uint8_t)
+{
+    return 0;   // read only
+}
+
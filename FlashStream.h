@@ -0,0 +1,58 @@
+#ifndef FLASH_STREAM_HEADER
+#define FLASH_STREAM_HEADER
+
+#include <Stream.h>
+
+/// Reads everything waiting in HomeFlash as a Stream, for HTTPClient to send.
+/*!
+ * Records are handed over straight from the flash read cache, a record at a
+ * time, so the whole backlog goes out in one request without us buffering it.
+ * A fixed head (eg an ID) goes in front, and a tail (eg the samples still in
+ * RTC memory) goes after; both are owned by the caller.
+ *
+ * Reading doesn't free anything in the flash - call flash.CommitBuffer() once
+ * the upload has succeeded, or rewind() to send it again.  Nothing else may
+ * touch the flash while a FlashStream is in use.
+ */
+class FlashStream : public Stream
+{
+    public:
+        FlashStream( const uint8_t *head, size_t headLen,
+                     const uint8_t *tail, size_t tailLen );
+
+        /// Total bytes we'll produce, for the Content-Length
+        size_t size() const;
+
+        /// Back to the start, for a retry
+        void rewind();
+
+        int available();
+        int read();
+        int peek();
+        size_t readBytes(char *buffer, size_t length);
+        void flush();
+        size_t write(uint8_t);
+
+    protected:
+        /// Move on to the next chunk once we've used the current one
+        bool nextChunk();
+
+        const uint8_t *headPtr, *tailPtr;
+        size_t headLen, tailLen;
+
+        enum class Part {
+            HEAD,
+            FLASH,
+            TAIL,
+            DONE,
+        } part;
+
+        /// What we're part way through - the head, a record or the tail
+        const uint8_t *chunkPtr;
+        size_t chunkLen;
+
+        size_t totalLen, readLen;
+}; // end class FlashStream
+
+#endif // #ifndef FLASH_STREAM_HEADER
+
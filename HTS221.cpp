@@ -42,74 +42,18 @@ bool HTS221::begin(void)
 bool
 HTS221::storeCalibration(void)
 {
-    uint8_t data;
-    uint16_t tmp;
-
-    for (int reg=CALIB_START; reg<=CALIB_END; reg++) {
-        if ((reg!=CALIB_START+8) && (reg!=CALIB_START+9) && (reg!=CALIB_START+4)) {
-
-            data = readRegister(HTS221_ADDRESS, reg);
-            switch (reg) {
-            case CALIB_START:
-                _h0_rH = data;
-                break;
-            case CALIB_START+1:
-            _h1_rH = data;
-            break;
-            case CALIB_START+2:
-            _T0_degC = data;
-            break;
-            case CALIB_START+3:
-            _T1_degC = data;
-            break;
-
-            case CALIB_START+5:
-            tmp = _T0_degC;
-            _T0_degC = (data&0x3)<<8;
-            _T0_degC |= tmp;
-
-            tmp = _T1_degC;
-            _T1_degC = ((data&0xC)>>2)<<8;
-            _T1_degC |= tmp;
-            break;
-            case CALIB_START+6:
-            _H0_T0 = data;
-            break;
-            case CALIB_START+7:
-            _H0_T0 |= data<<8;
-            break;
-            case CALIB_START+0xA:
-            _H1_T0 = data;
-            break;
-            case CALIB_START+0xB:
-            _H1_T0 |= data <<8;
-            break;
-            case CALIB_START+0xC:
-            _T0_OUT = data;
-            break;
-            case CALIB_START+0xD:
-            _T0_OUT |= data << 8;
-            break;
-            case CALIB_START+0xE:
-            _T1_OUT = data;
-            break;
-            case CALIB_START+0xF:
-            _T1_OUT |= data << 8;
-            break;
-
-
-            case CALIB_START+8:
-            case CALIB_START+9:
-            case CALIB_START+4:
-            //DO NOTHING
-            break;
-
-            // to cover any possible error
-            default:
-                return false;
-            } /* switch */
-        } /* if */
-    }  /* for */
+    uint8_t data[CALIB_END-CALIB_START+1];
+
+    if (!readRegisters(_address, CALIB_START, data, sizeof(data)))
+        return false;
+    _h0_rH = data[0];
+    _h1_rH = data[1];
+    _T0_degC = ((data[5]&0x3)<<8) | data[2];
+    _T1_degC = ((data[5]&0xC)<<6) | data[3];
+    _H0_T0 = data[6] | (data[7]<<8);
+    _H1_T0 = data[0xA] | (data[0xB]<<8);
+    _T0_OUT = data[0xC] | (data[0xD]<<8);
+    _T1_OUT = data[0xE] | (data[0xF]<<8);
     return true;
 }
 
@@ -168,18 +112,13 @@ HTS221::bduDeactivate(void)
 const int
 HTS221::readHumidity(void)
 {
-    uint8_t data   = 0;
+    uint8_t data[3];    // STATUS_REG, HUMIDITY_L_REG, HUMIDITY_H_REG
     uint16_t h_out = 0;
     double h_temp  = 0.0;
     double hum     = 0.0;
 
-    data = readRegister(_address, STATUS_REG);
-
-    if (data & HUMIDITY_READY) {
-        data = readRegister(_address, HUMIDITY_H_REG);
-        h_out = data << 8;  // MSB
-        data = readRegister(_address, HUMIDITY_L_REG);
-        h_out |= data;      // LSB
+    if (readRegisters(_address, STATUS_REG, data, sizeof(data)) && (data[0] & HUMIDITY_READY)) {
+        h_out = data[1] | (data[2] << 8);
 
         // Decode Humidity
         hum = ((int16_t)(_h1_rH) - (int16_t)(_h0_rH))/2.0;  // remove x2 multiple
@@ -197,19 +136,13 @@ HTS221::readHumidity(void)
 const double
 HTS221::readTemperature(void)
 {
-    uint8_t data   = 0;
+    uint8_t data[5];    // STATUS_REG, HUMIDITY_L_REG ... TEMP_H_REG
     uint16_t t_out = 0;
     double t_temp  = 0.0;
     double deg     = 0.0;
 
-    data = readRegister(_address, STATUS_REG);
-
-    if (data & TEMPERATURE_READY) {
-
-        data= readRegister(_address, TEMP_H_REG);
-        t_out = data  << 8; // MSB
-        data = readRegister(_address, TEMP_L_REG);
-        t_out |= data;      // LSB
+    if (readRegisters(_address, STATUS_REG, data, sizeof(data)) && (data[0] & TEMPERATURE_READY)) {
+        t_out = data[3] | (data[4] << 8);
 
         // Decode Temperature
         deg    = ((int16_t)(_T1_degC) - (int16_t)(_T0_degC))/8.0; // remove x8 multiple
@@ -242,6 +175,20 @@ byte HTS221::readRegister(byte slaveAddress, byte regToRead)
    return Wire.read(); //Return this one byte
 }
 
+// Read len registers from regToRead on into data, in one transaction
+bool HTS221::readRegisters(byte slaveAddress, byte regToRead, byte *data, int len)
+{
+    Wire.beginTransmission(slaveAddress);
+    Wire.write(regToRead | AUTO_INCREMENT);
+    Wire.endTransmission(false); //endTransmission but keep the connection active
+
+    if (Wire.requestFrom((uint8_t)slaveAddress, (uint8_t)len) != len)
+        return false;
+    for (int i = 0; i < len; i++)
+        data[i] = Wire.read();
+    return true;
+}
+
 // Writes a single byte (dataToWrite) into regToWrite
 bool HTS221::writeRegister(byte slaveAddress, byte regToWrite, byte dataToWrite)
 {
@@ -36,6 +36,7 @@ private:
     uint8_t _address;
 
     byte readRegister(byte slaveAddress, byte regToRead);
+    bool readRegisters(byte slaveAddress, byte regToRead, byte *data, int len);
     bool writeRegister(byte slaveAddress, byte regToWrite, byte dataToWrite);
 };
 
@@ -11,6 +11,7 @@
 
 
 #define HTS221_ADDRESS     0x5F
+#define AUTO_INCREMENT     0x80 // sub-address bit 7: reads step on through the registers
 
 //Define a few of the registers that we will be accessing on the HTS221
 #define WHO_AM_I           0x0F
@@ -56,23 +56,46 @@ bool LPS25H::deactivate(void)
     return true;
 }
 
+bool
+LPS25H::startFifo(void)
+{
+    writeRegister(_address, CTRL_REG1, POWER_UP|ODR0_SET);
+    writeRegister(_address, FIFO_CTRL, FIFO_MODE_STREAM);
+    writeRegister(_address, CTRL_REG2, FIFO_EN);
+    return true;
+}
+
+// With the FIFO on, reading on past PRESSURE_H_REG rolls back to PRESSURE_XL_REG for the
+// next sample, so FIFO_BURST of them come out in one transaction
+int
+LPS25H::readFifo(long *pressure, bool *overran)
+{
+    unsigned char status = readRegister(_address, FIFO_STATUS);
+    unsigned char read[FIFO_BURST*3];
+    int n = (status & FIFO_EMPTY) ? 0 : (status & FIFO_OVR) ? FIFO_SIZE : status & FIFO_LEVEL;
+
+    *overran = (status & FIFO_OVR) != 0;
+    for (int i = 0; i < n; i += FIFO_BURST) {
+        int len = n-i < FIFO_BURST ? n-i : FIFO_BURST;
+
+        if (!readRegisters(_address, PRESSURE_XL_REG, read, len*3))
+            return i;
+        for (int j = 0; j < len; j++)
+            pressure[i+j] = read[3*j] | (read[3*j+1] << 8) | ((long)read[3*j+2] << 16);
+    }
+    return n;
+}
+
 
 
 int
 LPS25H::readTemperature(void)
 {
-    unsigned int   data = 0;
-    unsigned char  read = 0;
+    unsigned char  read[6];   // STATUS_REG, PRESSURE_XL_REG ... TEMP_H_REG
     double         t_temp = 0.0;
 
-    read = readRegister(_address, STATUS_REG);
-    if (read & TEMPERATURE_READY) {
-        read = readRegister(_address, TEMP_L_REG);
-        data = read;      // LSB
-
-        read = readRegister(_address, TEMP_H_REG);
-        data |= read << 8; // MSB
-        _temperature = data;
+    if (readRegisters(_address, STATUS_REG, read, sizeof(read)) && (read[0] & TEMPERATURE_READY)) {
+        _temperature = read[4] | (read[5] << 8);
         // Decode Temperature
         t_temp = 42.5 +(_temperature/480.0);
         _temperature  = t_temp;  // temp in Celsius degree
@@ -85,16 +108,10 @@ LPS25H::readPressure(void)
 {
     unsigned long data   = 0;
     double        p_temp = 0.0;
-    unsigned char read   = 0;
+    unsigned char read[4];    // STATUS_REG, PRESSURE_XL_REG, PRESSURE_L_REG, PRESSURE_H_REG
 
-    read = readRegister(_address, STATUS_REG);
-    if (read & PRESSURE_READY) {
-        read = readRegister(_address, PRESSURE_H_REG);
-        data = read << 16;  // MSB
-        read = readRegister(_address, PRESSURE_L_REG);
-        data |= read << 8; // LSB
-        read = readRegister(_address, PRESSURE_XL_REG);
-        data |= read; // XLSB
+    if (readRegisters(_address, STATUS_REG, read, sizeof(read)) && (read[0] & PRESSURE_READY)) {
+        data = read[1] | (read[2] << 8) | ((unsigned long)read[3] << 16);
 
         // Decode pressure
         p_temp = ((long) data) / 4096.0;
@@ -121,10 +138,23 @@ byte LPS25H::readRegister(byte slaveAddress, byte regToRead)
       if (i == 100000)
         return 0xff;
     }
-    while(!Wire.available()) ; //Wait for the data to come back
     return Wire.read(); //Return this one byte
 }
 
+// Read len registers from regToRead on into data, in one transaction
+bool LPS25H::readRegisters(byte slaveAddress, byte regToRead, byte *data, int len)
+{
+    Wire.beginTransmission(slaveAddress);
+    Wire.write(regToRead | AUTO_INCREMENT);
+    Wire.endTransmission(false); //endTransmission but keep the connection active
+
+    if (Wire.requestFrom((uint8_t)slaveAddress, (uint8_t)len) != len)
+        return false;
+    for (int i = 0; i < len; i++)
+        data[i] = Wire.read();
+    return true;
+}
+
 // Writes a single byte (dataToWrite) into regToWrite
 bool LPS25H::writeRegister(byte slaveAddress, byte regToWrite, byte dataToWrite)
 {
@@ -17,6 +17,7 @@ class LPS25H
     private:
     uint8_t _address;
     byte readRegister(byte slaveAddress, byte regToRead);
+    bool readRegisters(byte slaveAddress, byte regToRead, byte *data, int len);
     bool writeRegister(byte slaveAddress, byte regToWrite, byte dataToWrite);
 
 public:
@@ -24,6 +25,10 @@ public:
     bool begin(void);
     bool activate(void);
     bool deactivate(void);
+    bool startFifo(void);   // sample at 1Hz into the FIFO until deactivate()
+    // what's queued since, oldest first in 1/4096 hPa - how many, all 32 with
+    // overran set if it filled and the oldest were lost
+    int readFifo(long *pressure, bool *overran);
 
     int readPressure(void);
     int readTemperature(void);
@@ -11,6 +11,7 @@
 
 
 #define LPS25H_ADDRESS     0x5C
+#define AUTO_INCREMENT     0x80 // sub-address bit 7: reads step on through the registers
 
 #define WHO_AM_I           0x0F
 #define WHO_AM_I_RETURN    0xBD // Contains the device ID, BDh
@@ -56,6 +57,7 @@
 
 
 #define CTRL_REG2   0x21
+#define FIFO_EN     0x40  // [6] FIFO_EN: samples queue in the FIFO, read out through PRESS_OUT
 #define CTRL_REG3   0x22
 #define REG_DEFAULT 0x00
 
@@ -106,6 +108,27 @@
 #define TEMP_L_REG          0x2B
 #define TEMP_H_REG          0x2C
 
+/*
+ * [7:5] F_MODE: FIFO mode. 000 bypass, 001 FIFO (stop when full),
+ * 010 stream (when full the newest replaces the oldest)
+ * [4:0] WTM_POINT: watermark level
+ */
+#define FIFO_CTRL           0x2E
+#define FIFO_MODE_STREAM    0x40
+
+/*
+ * [7] FTH_FIFO: level is at or past the watermark
+ * [6] OVR: the FIFO's full, another sample replaces the oldest
+ * [5] EMPTY_FIFO
+ * [4:0] FSS: how many samples are queued
+ */
+#define FIFO_STATUS         0x2F
+#define FIFO_OVR            0x40
+#define FIFO_EMPTY          0x20
+#define FIFO_LEVEL          0x1F
+#define FIFO_SIZE           32
+#define FIFO_BURST          10    // samples a read, the 3 bytes each fit Wire's 32 byte buffer
+
 
 
 
@@ -44,7 +44,7 @@ PC8563::read(pc_time &tm)
 {
   Wire.beginTransmission((uint8_t)ADDRESS);
   Wire.write((uint8_t)2);
-  Wire.endTransmission();
+  Wire.endTransmission(false);	// a repeated start, all 7 in one transaction
   Wire.requestFrom((uint8_t)ADDRESS, (uint8_t)7);	
   if (!Wire.available())
 	  return false;
@@ -0,0 +1,152 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "RtcMemory.h"
+
+void
+rtc_mem_write(int offset, const void *p,  int bytes)
+{
+  union {
+      unsigned char b[4];
+      unsigned int l;
+  }b;
+  const unsigned char *pp = (const unsigned char *)p;
+  int w = offset>>2;
+
+  offset &= 3;
+  if (offset) {
+    b.l = RTC_USER_MEM[w];
+
+    for (int i = offset; i < 4 && bytes>0; i++) {
+        b.b[i] = *pp++;
+        bytes--;
+    }
+    RTC_USER_MEM[w++] = b.l;
+    if (bytes == 0)
+      return;
+  }
+  if (((long)pp)&3) {
+    while (bytes >= 4) {
+      b.b[0] = pp[0];
+      b.b[1] = pp[1];
+      b.b[2] = pp[2];
+      b.b[3] = pp[3];
+      RTC_USER_MEM[w++] = b.l;
+      pp += 4;
+      bytes -= 4;
+    }
+  } else {
+    while (bytes >= 4) {
+      RTC_USER_MEM[w++] = *(const unsigned int *)pp;
+      pp += 4;
+      bytes -= 4;
+    }
+  }
+  if (bytes&3) {
+    b.l = RTC_USER_MEM[w];
+    for (int i = 0; i < (bytes&3); i++)
+      b.b[i] = *pp++;
+    RTC_USER_MEM[w] = b.l;
+  }
+}
+
+void
+rtc_mem_read(int offset, void *p,  int bytes)
+{
+  union {
+      unsigned char b[4];
+      unsigned int l;
+  }b;
+  unsigned char *pp = (unsigned char *)p;
+  int w = offset>>2;
+
+  offset &= 3;
+  if (offset) {
+    b.l = RTC_USER_MEM[w++];
+    for (int i = offset; i < 4 && bytes>0; i++) {
+        *pp++ = b.b[i];
+        bytes--;
+    }
+    if (bytes == 0)
+      return;
+  }
+
+  if (((long)pp)&3) {
+    while (bytes >= 4) {
+      b.l = RTC_USER_MEM[w++];
+      pp[0] = b.b[0];
+      pp[1] = b.b[1];
+      pp[2] = b.b[2];
+      pp[3] = b.b[3];
+      pp += 4;
+      bytes -= 4;
+    }
+  } else {
+    while (bytes >= 4) {
+      *(unsigned int *)pp = RTC_USER_MEM[w++];
+      pp += 4;
+      bytes -= 4;
+    }
+  }
+  if (bytes&3) {
+    b.l = RTC_USER_MEM[w];
+    for (int i = 0; i < (bytes&3); i++)
+      *pp++ = b.b[i];
+  }
+}
+
+void
+RtcStream::Write(int offset, const unsigned char *b, int len)
+{
+  offset += base;
+  while (len > 0) {
+    int w = offset>>2, i = offset&3;
+
+    if (w != word) {
+      Sync();
+      word = w;
+      if (i)            // keep what's before it in the word, what's after is past the end
+        v.l = RTC_USER_MEM[w];
+    }
+    while (i < 4 && len > 0) {
+      v.b[i++] = *b++;
+      offset++;
+      len--;
+    }
+    dirty = 1;
+  }
+}
+
+unsigned char
+RtcStream::Read(int offset)
+{
+  offset += base;
+  if ((offset>>2) != word) {
+    Sync();
+    word = offset>>2;
+    v.l = RTC_USER_MEM[word];
+  }
+  return v.b[offset&3];
+}
+
+void
+RtcStream::Sync(void)
+{
+  if (dirty)
+    RTC_USER_MEM[word] = v.l;
+  dirty = 0;
+}
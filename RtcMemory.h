@@ -0,0 +1,59 @@
+#ifndef RTC_MEMORY__H__
+#define RTC_MEMORY__H__
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  the user part of the 8266's RTC memory, which survives a deep sleep. It can only be
+//  read and written a 32 bit word at a time, every access is a slow trip to the RTC block
+//
+// the host build (see host/rtc_sim.h) supplies its own
+#ifndef RTC_USER_MEM
+#define RTC_USER_MEM (((volatile unsigned int *)0x60001100)+64)
+#endif
+#define RTC_USER_SIZE 512
+
+void rtc_mem_write(int offset, const void *p, int bytes);
+void rtc_mem_read(int offset, void *p, int bytes);
+
+//
+//  bytes written and read back at the end of a stream in RTC memory (the sample buffer),
+//  offsets from base. The word we're in is kept here and only written to RTC memory when
+//  we move off it or Sync(), rather than a read-modify-write of it for every byte, and
+//  reads get a word at a time. Bytes after the last one written are past the end of the
+//  stream, so starting a new word doesn't read it first.
+//
+//  Call Sync() before anything else reads or writes the stream's RTC memory, and before
+//  a deep sleep
+//
+class RtcStream {
+public:
+  RtcStream(int base) { this->base = base; word = -1; dirty = 0; }
+  void Write(int offset, const unsigned char *b, int len);
+  unsigned char Read(int offset);
+  void Sync(void);
+private:
+  int base;
+  int word;                 // the word we have, -1 if none
+  bool dirty;               // and it needs writing
+  union {
+    unsigned char b[4];
+    unsigned int l;
+  } v;
+};
+
+#endif
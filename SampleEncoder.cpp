@@ -0,0 +1,448 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  The sample compressor, out of the sketch so that the host can run it (see host/encoder_bench.cpp).
+//
+//  A sample is a full value (2 bytes each for temp/humidity and pressure) when it's moved
+//  too far from the last one for a delta, otherwise a 3 bit delta each of temp and humidity
+//  in one byte and a 7 bit delta of pressure in another, which is left out if it's 0. The
+//  second unchanged sample in a row turns the first into a 1111 1000 repeat of 2, the ones
+//  after that bump the count, reading it back out of the buffer to do it.
+//
+//  Every buffer starts with a time signature and a full sample, so it can be decoded on its
+//  own - unless we've been asked to resync only every so many, when the rest start with a
+//  1111 1001 and carry on with deltas from the last sample of the one before, saving the
+//  time signature and full sample. The check byte after it lets the decoder tell if that
+//  isn't the record it has just decoded (one's been lost or overwritten).
+//
+//  With pressure_every more than 1 (only with temp/humidity and pressure) the time signature
+//  is followed by a 1111 1011 and only every that many samples has pressure, the rest are
+//  temp/humidity alone. PressureDue() says if the next does, so that the sketch needn't wake
+//  the LPS25H for the others. It counts on across records, whether they start afresh or not.
+//
+//  With SAMPLE_TENTHS in types the values are in tenths and the time signature is a
+//  1111 1010. Each sample is a byte saying how many nibbles each delta takes (0, 1, 2 or
+//  4), then the zigzagged deltas in that many nibbles - about two bytes indoors rather than
+//  one - and the first is from 0. Unchanged samples become repeat counts as above.
+//
+//  Before each thing we put we check there's room for it before flush_at (and for a
+//  sample after it) and have the sink store the buffer if there isn't - so that the next
+//  one's time signature is for the sample we're about to put, at whatever rate we're at by
+//  then (see Period()). If it can't (the flash is full) we keep going in whatever room is
+//  left after flush_at, then drop samples until it can.
+//
+#include "SampleEncoder.h"
+
+void
+SampleEncoder::Init(unsigned char types, int period, int flush_at, int resync, int pressure_every)
+{
+  s->types = types;
+  s->period = period;
+  s->flush_at = flush_at;
+  s->resync = resync < 1 ? 1 : resync > 255 ? 255 : resync;
+  if ((types&(SAMPLE_TH|SAMPLE_P)) != (SAMPLE_TH|SAMPLE_P))
+    pressure_every = 1;
+  s->pressure_every = pressure_every < 1 ? 1 : pressure_every > 255 ? 255 : pressure_every;
+  s->pressure_in = 0;
+  Reset();
+}
+
+void
+SampleEncoder::Reset(void)
+{
+  s->last_humidity = s->types&SAMPLE_TENTHS ? 0 : 255;
+  s->last_temp = s->types&SAMPLE_TENTHS ? 0 : 127;
+  s->last_pressure = 0;
+  s->have = 0;
+  s->cstate = 0;
+  s->boff = 0;
+  s->records = 0;
+}
+
+void
+SampleEncoder::put(const unsigned char *b, int len)
+{
+  sink->write(s->boff, b, len);
+  s->boff += len;
+}
+
+//
+//  store the buffer and start the next one, afresh if resync
+//
+void
+SampleEncoder::flush(bool resync)
+{
+  int next = sink->flush(s->boff);
+  unsigned char b[2];
+
+  if (!next)
+    return;
+  s->boff = 0;
+  s->cstate = 0;    // a repeat count can't span records
+  s->flush_at = next;
+  if (resync || ++s->records >= s->resync) {
+    Reset();
+    TimeSignature();
+    return;
+  }
+  b[0] = 0xf9;
+  b[1] = stream_check(s->types, s->last_temp, s->last_humidity, s->last_pressure);
+  put(&b[0], 2);
+}
+
+void
+SampleEncoder::TimeSignature(void)
+{
+  unsigned char b[5];
+  time_stamp t;
+
+  s->cstate = 0;
+  s->have &= ~SAMPLE_STEPPED;
+  if (s->boff > s->flush_at-room()-2-(s->types&SAMPLE_TENTHS ? 1 : 0)-(s->period == 60 ? 0 : 3)-(s->pressure_every == 1 ? 0 : 3)) {  // room for another?
+    flush(1);
+    return; // puts one as a side effect
+  }
+  sink->now(&t);
+  if (s->types&SAMPLE_TENTHS) {   // the time signature follows without its 1111 00xx
+    b[0] = 0xfa;
+    b[1] = s->types&(SAMPLE_TH|SAMPLE_P);
+    put(&b[0], 2);
+  }
+  b[0] = 0xf0|s->types;
+  if (t.valid) {
+    b[1] = t.year-2000;
+    b[2] = (t.month<<4) | (t.day>>1);
+    b[3] = (t.day<<7) | (t.hour<<2) | (t.minute>>4);
+    b[4] = (t.minute<<4) | 0xf;
+  } else {
+    b[1] = 0xff;
+  }
+  if (s->types&SAMPLE_TENTHS)
+    put(&b[1], t.valid ? 4 : 1);
+  else
+    put(&b[0], t.valid ? 5 : 2);
+  if (s->period != 60) { // not 1 minute? output sampling rate
+    b[0] = 0xf4;
+    b[1] = s->period>>8;
+    b[2] = s->period;
+    put(&b[0], 3);
+  }
+  if (s->pressure_every != 1) {  // pressure less often, and where we are in it
+    b[0] = 0xfb;
+    b[1] = s->pressure_every;
+    b[2] = s->pressure_in;
+    put(&b[0], 3);
+  }
+}
+
+//
+//  before putting len bytes, that there's room for them before flush_at - a new period
+//  that there wasn't room for goes in the next record's time signature
+//
+void
+SampleEncoder::make_room(int len)
+{
+  if (s->cstate&CSTATE_PERIOD) {
+    flush(1);
+    if (s->cstate&CSTATE_PERIOD && !full(3+len)) {  // the sink didn't take it, it goes here
+      put_period();
+      s->cstate = 0;
+    }
+  } else
+  if (s->boff > s->flush_at-len) {
+    flush();
+  }
+}
+
+void
+SampleEncoder::put_period(void)
+{
+  unsigned char b[3];
+
+  b[0] = 0xf4;
+  b[1] = s->period>>8;
+  b[2] = s->period;
+  put(&b[0], 3);
+}
+
+void
+SampleEncoder::Sample(int temp, int humidity, int pressure)
+{
+  unsigned char b[4];
+  unsigned char th_delta = 0, p_delta = 0;
+  unsigned char types = s->types;
+  bool force = 0;
+  int dt, dh, sz = 0;
+
+  unchanged = 0;
+  if (s->have&SAMPLE_RESTAMP) {
+    s->have &= ~SAMPLE_RESTAMP;
+    TimeSignature();
+  }
+  make_room(room());
+  if (full(room()))
+    return;
+  if (s->pressure_in) {   // not one with pressure
+    types &= ~SAMPLE_P;
+    s->pressure_in--;
+  } else {
+    s->pressure_in = s->pressure_every-1;
+  }
+  s->have |= (types&(SAMPLE_TH|SAMPLE_P))|SAMPLE_STEPPED;
+  if (types&SAMPLE_TENTHS) {
+    sample_tenths(types, temp, humidity, pressure);
+    return;
+  }
+  if (types&SAMPLE_TH) {
+    dt = temp-s->last_temp;
+    s->last_temp = temp;
+    dh = humidity-s->last_humidity;
+    s->last_humidity = humidity;
+    if (dh > 3 || dh < -4 || dt > 3 || dt < -4)
+      force = 1;
+    th_delta = (dt&0x7)|((dh&0x7)<<4);
+  }
+  if (types&SAMPLE_P) {
+    dt = pressure-s->last_pressure;
+    s->last_pressure = pressure;
+    if (dt > 63 || dt < -64)
+      force = 1;
+    p_delta = dt&0x7f;
+  }
+  if (force) {    // send full values rather than deltas
+    s->cstate = 0;
+    if (types&SAMPLE_TH) {
+      b[sz++] = 0x80|s->last_humidity;
+      b[sz++] = (unsigned char)s->last_temp;
+    }
+    if (types&SAMPLE_P) {
+      b[sz++] = 0x80|(s->last_pressure>>8);
+      b[sz++] = s->last_pressure;
+    }
+  } else
+  if (th_delta == 0x00 && p_delta == 0x00) {
+    unchanged = 1;
+    if (s->cstate&CSTATE_SAME) { // 3rd and subsequent deltas
+      unsigned char count = sink->read(s->boff-1);
+
+      if (count == 255) {   // repeat is full, add an extra one
+        b[sz++] = 0xf8;
+        b[sz++] = 1;
+      } else {          // increment count
+        s->boff--;
+        b[sz++] = count+1;
+      }
+    } else
+    if (s->cstate&CSTATE_LAST_SAME) { // 2nd delta convert previous delta into a 'repeat'
+      if (types&SAMPLE_TH)
+        s->boff--;
+      if (types&SAMPLE_P && !(s->cstate&CSTATE_NOPR))
+        s->boff--;
+      s->cstate = CSTATE_SAME;
+      b[sz++] = 0xf8;
+      b[sz++] = 2;
+    } else { // first '0' delta just store the '0'
+      s->cstate |= CSTATE_LAST_SAME;
+      if (types&SAMPLE_TH) {
+        b[sz++] = th_delta|0x08;
+        s->cstate |= CSTATE_NOPR;
+      } else {
+        b[sz++] = p_delta;
+      }
+    }
+  } else {  // non-0 delta just save the deltas
+    s->cstate &= ~(CSTATE_SAME|CSTATE_LAST_SAME);
+    if (p_delta == 0x00 && (types&(SAMPLE_TH|SAMPLE_P)) == (SAMPLE_TH|SAMPLE_P)) {
+      s->cstate |= CSTATE_NOPR;
+      b[sz++] = th_delta|0x08;
+    } else {
+      s->cstate &= ~CSTATE_NOPR;
+      if (types&SAMPLE_TH)
+        b[sz++] = th_delta;
+      if (types&SAMPLE_P)
+        b[sz++] = p_delta;
+    }
+  }
+  put(&b[0], sz);
+}
+
+void
+SampleEncoder::Mark(unsigned char mark)
+{
+  unsigned char b[2];
+
+  make_room(2+room());  // and a sample after it
+  if (full(2))
+    return;
+  b[0] = 0xf6;
+  b[1] = mark;
+  s->cstate = 0;
+  put(&b[0], 2);
+}
+
+//
+//  the time from the last sample to the next changes - the decoder needs to know to get its
+//  times right. If it doesn't fit in this record the next starts afresh, with a time
+//  signature that has it
+//
+void
+SampleEncoder::Period(int period)
+{
+  if (period == s->period)
+    return;
+  s->period = period;
+  s->cstate = 0;    // the next sample can't add to a repeat count before it
+  if (s->boff+3 <= s->flush_at || (s->boff > s->flush_at && !full(3)))  // fits, or we're past flush_at because the sink won't take the buffer
+    put_period();
+  else
+    s->cstate = CSTATE_PERIOD;
+}
+
+//
+//  the last sample's values stand in for what a sensor that timed out didn't give us -
+//  unless the stream's started afresh since, when all last_* hold is what the first
+//  sample's a delta from
+//
+bool
+SampleEncoder::Fill(unsigned char missing, int *temp, int *humidity, int *pressure)
+{
+  missing &= s->types&(SAMPLE_TH|SAMPLE_P);
+  if ((s->have&missing) != missing)
+    return 0;
+  if (missing&SAMPLE_TH) {
+    *temp = s->last_temp;
+    *humidity = s->last_humidity;
+  }
+  if (missing&SAMPLE_P)
+    *pressure = s->last_pressure;
+  return 1;
+}
+
+//
+//  a sample we couldn't put - the next is that much further on from the last. If there's
+//  been none since the time signature the decoder would put the next at its time, so it
+//  gets one of its own instead
+//
+void
+SampleEncoder::Skip(int period)
+{
+  if (!(s->have&SAMPLE_STEPPED))
+    s->have |= SAMPLE_RESTAMP;
+  else
+    Period(s->period+period);
+}
+
+void
+SampleEncoder::Comment(const char *c)
+{
+  unsigned char b = 0xf5;
+  int len = 0;
+
+  while (c[len])
+    len++;
+  make_room(len+2+room());  // and a sample after it
+  s->cstate = 0;
+  if (full(len+2))
+    return;
+  put(&b, 1);
+  put((const unsigned char *)c, len+1);
+}
+
+//
+//  a delta of tenths, zigzagged (0, -1, 1, -2 ... become 0, 1, 2, 3 ...) into up to 4 nibbles,
+//  returns how many it needs - 0 if it's 0. One too big for 4 is cut down to fit, and last
+//  moved by what's sent so that we stay where the decoder is
+//
+static int
+zigzag(int v, short *last, unsigned int *z)
+{
+  int d = v-*last;
+
+  if (d > 0x7fff)
+    d = 0x7fff;
+  else
+  if (d < -0x8000)
+    d = -0x8000;
+  *last += d;
+  *z = d < 0 ? ~((unsigned int)d<<1) : (unsigned int)d<<1;
+  return *z == 0 ? 0 : *z < 0x10 ? 1 : *z < 0x100 ? 2 : 4;
+}
+
+void
+SampleEncoder::sample_tenths(unsigned char types, int temp, int humidity, int pressure)
+{
+  unsigned char b[7];
+  unsigned int z[3];
+  int n[3], sz = 1, nibble = 0;
+  short last;
+  static const unsigned char widths[5] = {0, 1, 2, 0, 3};
+
+  n[0] = n[1] = n[2] = 0;
+  if (types&SAMPLE_TH) {
+    n[0] = zigzag(temp, &s->last_temp, &z[0]);
+    last = s->last_humidity;
+    n[1] = zigzag(humidity, &last, &z[1]);
+    s->last_humidity = last;
+  }
+  if (types&SAMPLE_P) {
+    last = s->last_pressure;
+    n[2] = zigzag(pressure, &last, &z[2]);
+    s->last_pressure = last;
+  }
+  if (!(n[0]|n[1]|n[2])) {    // unchanged
+    unchanged = 1;
+    if (s->cstate&CSTATE_SAME) { // 3rd and subsequent
+      unsigned char count = sink->read(s->boff-1);
+
+      if (count == 255) {   // repeat is full, add an extra one
+        b[0] = 0xf8;
+        b[1] = 1;
+        put(&b[0], 2);
+      } else {          // increment count
+        s->boff--;
+        b[0] = count+1;
+        put(&b[0], 1);
+      }
+    } else
+    if (s->cstate&CSTATE_LAST_SAME) { // 2nd, convert the first into a 'repeat'
+      s->boff--;
+      s->cstate = CSTATE_SAME;
+      b[0] = 0xf8;
+      b[1] = 2;
+      put(&b[0], 2);
+    } else {  // first, just store it
+      s->cstate = CSTATE_LAST_SAME;
+      b[0] = 0;
+      put(&b[0], 1);
+    }
+  } else {
+    s->cstate = 0;
+    b[0] = widths[n[0]]|(widths[n[1]]<<2)|(widths[n[2]]<<4);
+    for (int f = 0; f < 3; f++)
+    for (int i = n[f]-1; i >= 0; i--) {
+      unsigned char v = (z[f]>>(4*i))&0xf;
+
+      if (nibble)
+        b[sz++] |= v;
+      else
+        b[sz] = v<<4;
+      nibble = !nibble;
+    }
+    put(&b[0], sz+nibble);
+  }
+}
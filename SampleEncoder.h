@@ -0,0 +1,103 @@
+#ifndef SAMPLE_ENCODER__H__
+#define SAMPLE_ENCODER__H__
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "decompress.h"     // the format we write, and time_stamp
+
+//
+//  the compressor's state - small enough to keep in RTC memory over a deep sleep along
+//  with the buffer it's filling
+//
+typedef struct sample_encoder_state {
+  unsigned char   cstate;
+#define CSTATE_SAME       0x01          // we have an active 'same' entry
+#define CSTATE_LAST_SAME  0x02          // the last entry we put was deltas '0'
+#define CSTATE_NOPR       0x04          // the last entry had a skipped - 0 pressure valoue
+#define CSTATE_PERIOD     0x08          // period's changed and there wasn't room to say so
+  unsigned char   types;                // what each sample has, the time signature's stream type
+#define SAMPLE_TH 0x01                  // temp/humidity
+#define SAMPLE_P  0x02                  // pressure
+#define SAMPLE_TENTHS 0x04              // in tenths of a degree, % and hPa (1111 1010)
+  signed short    last_temp;            // 0x7f means no last value (0 in tenths)
+  unsigned short  last_humidity;        // 0xff means no last value (0 in tenths)
+  unsigned short  last_pressure;        // 0 means no last value
+  unsigned short  period;               // seconds per sample, time signatures say so if it isn't 60
+  unsigned short  boff;                 // offset into the buffer for the next byte
+  unsigned short  flush_at;             // hand the buffer to the sink when it gets this big
+  unsigned char   resync;               // every this many records start afresh, the rest carry on (1111 1001)
+  unsigned char   records;              // since the last fresh one
+  unsigned char   pressure_every;       // only every this many samples has pressure (1111 1011)
+  unsigned char   pressure_in;          // samples before the next one that does
+  unsigned char   have;                 // SAMPLE_TH/SAMPLE_P if last_* hold a sample's since it started afresh
+#define SAMPLE_STEPPED 0x40             // and there's been one since the time signature
+#define SAMPLE_RESTAMP 0x80             // the first since it was Skip()ped, the next needs its own
+} sample_encoder_state;
+
+//
+//  where a SampleEncoder's output goes - a buffer it writes into at increasing offsets
+//  (and steps back over when a run of unchanged samples becomes a repeat count)
+//
+class SampleSink {
+public:
+  virtual void write(int offset, const unsigned char *b, int len) = 0;
+  virtual unsigned char read(int offset) = 0;
+  // store the first len bytes of the buffer (eg as a flash record), return the flush_at
+  // for the next one, 0 if it couldn't be stored and the buffer has to be kept - we go
+  // on past flush_at, trying again after each sample, until it's full
+  virtual int flush(int len) = 0;
+  // the time for a time signature, valid = 0 if we don't know it
+  virtual void now(time_stamp *t) = 0;
+};
+
+//
+//  turns samples into the compressed stream decompress.c reads (see decompress.h), a buffer
+//  of up to size bytes at a time, each starting with a time signature - or, if resync is
+//  more than 1, with a note that it carries on from the one before for resync-1 in every resync
+//
+class SampleEncoder {
+public:
+  SampleEncoder(sample_encoder_state *state, SampleSink *sink, int size) { s = state; this->sink = sink; this->size = size; unchanged = 0; }
+  void Init(unsigned char types, int period, int flush_at, int resync = 1, int pressure_every = 1);  // at power on, then TimeSignature()
+  void Reset(void);                     // the buffer's been sent elsewhere, start again with a TimeSignature()
+  void TimeSignature(void);
+  void Sample(int temp, int humidity, int pressure);   // only the ones in types are used, in its units
+  bool PressureDue(void) { return s->pressure_in == 0; }  // the next Sample() has pressure, otherwise it's ignored
+  void Mark(unsigned char mark);
+  void Comment(const char *c);
+  void Period(int period);              // seconds from the last sample to the next (1111 0100)
+  // a sensor couldn't be read - the missing (SAMPLE_TH, SAMPLE_P) of the last sample, false
+  // if there's been none since the stream started afresh and the sample has to be Skip()ped
+  bool Fill(unsigned char missing, int *temp, int *humidity, int *pressure);
+  void Skip(int period);                // leave a sample out, the next is period after it would have been
+  bool Unchanged(void) { return unchanged; }   // the last Sample() was the same as the one before it
+  int Length(void) { return s->boff; }
+private:
+  void put(const unsigned char *b, int len);
+  void flush(bool resync = 0);
+  void make_room(int len);
+  void put_period(void);
+  void sample_tenths(unsigned char types, int temp, int humidity, int pressure);
+  int room(void) { return s->types&SAMPLE_TENTHS ? 7 : 4; }  // the most a sample can take
+  bool full(int len) { return s->boff+len > size; }
+  sample_encoder_state *s;
+  SampleSink *sink;
+  int size;
+  bool unchanged;
+};
+
+#endif
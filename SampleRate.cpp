@@ -0,0 +1,50 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  A quiet room gives long runs of unchanged samples, which the encoder makes into repeat
+//  counts - we may as well not wake for them. Once steady samples in a row are the same we
+//  double the time to the next, and again after that many more at the new rate, up to max.
+//  Any change goes straight back to min, so a door opening costs at most one long period
+//  before we're following it again. host/encoder_bench.cpp has wakes a day against how far
+//  the decoded samples are from what we'd have seen at min.
+//
+#include "SampleRate.h"
+
+void
+SampleRate::Init(int min, int max, int steady)
+{
+  s->min = min;
+  s->max = max < min ? min : max;
+  s->steady = steady < 1 ? 1 : steady > 255 ? 255 : steady;
+  s->period = min;
+  s->still = 0;
+}
+
+int
+SampleRate::Next(bool unchanged)
+{
+  if (!unchanged) {
+    s->period = s->min;
+    s->still = 0;
+  } else
+  if (s->period < s->max && ++s->still >= s->steady) {
+    s->period = s->period*2 > s->max ? s->max : s->period*2;
+    s->still = 0;
+  }
+  return s->period;
+}
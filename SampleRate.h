@@ -0,0 +1,42 @@
+#ifndef SAMPLE_RATE__H__
+#define SAMPLE_RATE__H__
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  how long to sleep between samples - doubling up to a cap while they don't change, back
+//  to the shortest as soon as they do. Tell the SampleEncoder each new period (Period())
+//  so that the times decode right
+//
+typedef struct sample_rate_state {
+  unsigned short  period;               // seconds to the next sample
+  unsigned short  min, max;             // the range of period
+  unsigned char   steady;               // unchanged samples in a row it takes to double it
+  unsigned char   still;                // how many we've had since it last changed
+} sample_rate_state;
+
+class SampleRate {
+public:
+  SampleRate(sample_rate_state *state) { s = state; }
+  void Init(int min, int max, int steady);  // at power on, period starts at min
+  int Next(bool unchanged);             // after each sample, the period to the next
+  int Period(void) { return s->period; }
+private:
+  sample_rate_state *s;
+};
+
+#endif
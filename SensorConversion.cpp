@@ -0,0 +1,131 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  Both parts power up with CTRL_REG1 PD set and ODR 0 - one-shot - and convert once when
+//  ONE_SHOT in CTRL_REG2 is written, setting their STATUS_REG bits when it's done. Until
+//  then we sit in delayMicroseconds() rather than on the bus, and between looks too, so a
+//  look costs a STATUS_REG read every SENSOR_POLL_US rather than back to back. Each part
+//  is powered down as soon as it's read out, or at the deadline if it never finishes.
+//  host/i2c_bench.cpp runs it against simulated parts, present, slow and missing
+//
+#include "Arduino.h"
+#include "Wire.h"
+#include "SensorConversion.h"
+
+static const struct sensor {
+  unsigned char   address;
+  unsigned char   ready;        // STATUS_REG bits that say it's done
+  unsigned char   len;          // output registers from 0x28 on
+  unsigned long   first_us;     // when we first look
+} sensors[SENSORS] = {
+  {0x5f, 0x03, 4, SENSOR_HTS221_US},   // HTS221, humidity and temp
+  {0x5c, 0x02, 3, SENSOR_LPS25H_US},   // LPS25H, pressure
+};
+
+static void
+write_register(unsigned char address, unsigned char reg, unsigned char v)
+{
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  Wire.write(v);
+  Wire.endTransmission();
+}
+
+//
+//  len registers from reg on in one transaction (bit 7 of the sub-address steps through
+//  them), false if the part didn't answer
+//
+static bool
+read_registers(unsigned char address, unsigned char reg, unsigned char *b, int len)
+{
+  Wire.beginTransmission(address);
+  Wire.write(reg|0x80);
+  Wire.endTransmission(false);    // a part that isn't there gets the STOP after requestFrom()
+  if (Wire.requestFrom((uint8_t)address, (uint8_t)len) != len)
+    return 0;
+  for (int i = 0; i < len; i++)
+    b[i] = Wire.read();
+  return 1;
+}
+
+void
+SensorConversion::Start(bool humidity, bool pressure)
+{
+  asked = (humidity ? 1<<SENSOR_HUMIDITY : 0) | (pressure ? 1<<SENSOR_PRESSURE : 0);
+  done = 0;
+  for (int i = 0; i < SENSORS; i++) {
+    latency[i] = 0;
+    if (asked&(1<<i)) {
+      write_register(sensors[i].address, 0x20, 0x80);   // CTRL_REG1 PD, one-shot
+      write_register(sensors[i].address, 0x21, 0x01);   // CTRL_REG2 ONE_SHOT
+    }
+  }
+  started = micros();
+}
+
+//
+//  if it's done read it out, and power it down
+//
+bool
+SensorConversion::collect(int i)
+{
+  unsigned char status;
+
+  if (!read_registers(sensors[i].address, 0x27, &status, 1) || (status&sensors[i].ready) != sensors[i].ready)
+    return 0;
+  latency[i] = micros()-started;
+  if (!read_registers(sensors[i].address, 0x28, &out[i][0], sensors[i].len))
+    return 0;
+  write_register(sensors[i].address, 0x20, 0);
+  done |= 1<<i;
+  return 1;
+}
+
+int
+SensorConversion::Collect(unsigned long deadline_us)
+{
+  unsigned long now, next;
+
+  for (;;) {
+    now = micros()-started;
+    next = deadline_us;
+    for (int i = 0; i < SENSORS; i++) {
+      if (!((asked&~done)>>i&1))
+        continue;
+      if (now < sensors[i].first_us) {
+        if (sensors[i].first_us < next)
+          next = sensors[i].first_us;
+      } else
+      if (!collect(i) && now+SENSOR_POLL_US < next)
+        next = now+SENSOR_POLL_US;
+    }
+    if (!(asked&~done))
+      break;
+    now = micros()-started;
+    if (now >= deadline_us)
+      break;
+    if (next > now)
+      delayMicroseconds(next-now);
+  }
+  for (int i = 0; i < SENSORS; i++)
+    if ((asked&~done)>>i&1) {
+      latency[i] = 0;
+      write_register(sensors[i].address, 0x20, 0);  // and don't leave it powered up
+    }
+  return done;
+}
@@ -0,0 +1,59 @@
+#ifndef SENSOR_CONVERSION__H__
+#define SENSOR_CONVERSION__H__
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  a wake's readings from the HTS221 and LPS25H - Start() sets a one-shot conversion going
+//  in each, Collect() idles until they should be done, then looks at their status every
+//  SENSOR_POLL_US and reads each out as it finishes, giving up at a deadline. A sensor
+//  that's gone or stuck costs a wake the deadline rather than hanging it until the
+//  watchdog bites
+//
+#define SENSOR_HUMIDITY 0       // HTS221, humidity and temp
+#define SENSOR_PRESSURE 1       // LPS25H
+#define SENSORS         2
+
+// when we first look - about what a one-shot takes at the parts' default averaging,
+// Latency() says what they really take
+#define SENSOR_HTS221_US    4000
+#define SENSOR_LPS25H_US    8000
+#define SENSOR_POLL_US      2000
+// past the longest either datasheet allows at that averaging, a period at their fastest
+// output rate (12.5Hz and 25Hz)
+#define SENSOR_DEADLINE_US  100000
+
+class SensorConversion {
+public:
+  SensorConversion(void) { asked = done = 0; }
+  void Start(bool humidity, bool pressure);
+  int Collect(unsigned long deadline_us = SENSOR_DEADLINE_US);   // the ones that finished, 1<<SENSOR_*
+  bool Done(int sensor) { return (done>>sensor)&1; }
+  bool TimedOut(int sensor) { return ((asked&~done)>>sensor)&1; }
+  unsigned long Latency(int sensor) { return latency[sensor]; }  // us from Start() to seeing it done, 0 if it didn't
+  int Humidity(void) { return (int16_t)(out[SENSOR_HUMIDITY][1]<<8 | out[SENSOR_HUMIDITY][0]); }  // HUMIDITY_OUT
+  int Temperature(void) { return (int16_t)(out[SENSOR_HUMIDITY][3]<<8 | out[SENSOR_HUMIDITY][2]); }  // TEMP_OUT
+  long Pressure(void) { return (long)out[SENSOR_PRESSURE][2]<<16 | out[SENSOR_PRESSURE][1]<<8 | out[SENSOR_PRESSURE][0]; }  // 1/4096 hPa
+private:
+  bool collect(int sensor);
+  unsigned long started;
+  unsigned char asked, done;
+  unsigned long latency[SENSORS];
+  unsigned char out[SENSORS][4];
+};
+
+#endif
@@ -0,0 +1,160 @@
+/*   
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Arduino.h"
+#include <SPI.h>
+
+extern "C" {
+#include "spi_flash.h"
+}
+#include "Flash.h"
+#include "SpiNorFlash.h"
+
+#define CMD_WRITE_ENABLE	0x06
+#define CMD_READ_STATUS		0x05
+#define CMD_READ		0x03
+#define CMD_PAGE_PROGRAM	0x02
+#define CMD_SECTOR_ERASE	0x20
+#define CMD_JEDEC_ID		0x9f
+#define CMD_POWER_DOWN		0xb9
+#define CMD_RELEASE		0xab
+
+#define STATUS_BUSY		0x01
+#define PROGRAM_PAGE		256
+
+#define PROGRAM_TIMEOUT		5000	// uS, tPP max is 3mS
+#define ERASE_TIMEOUT		500000	// uS, tSE max is 400mS
+
+static SPISettings settings(20000000, MSBFIRST, SPI_MODE0);
+
+void
+SpiNorFlash::command(uint8_t cmd, unsigned int address)
+{
+	digitalWrite(cs_pin, LOW);
+	SPI.transfer(cmd);
+	SPI.transfer(address>>16);
+	SPI.transfer(address>>8);
+	SPI.transfer(address);
+}
+
+bool
+SpiNorFlash::wait(unsigned long timeout)
+{
+	unsigned long start = micros();
+	uint8_t s;
+
+	digitalWrite(cs_pin, LOW);
+	SPI.transfer(CMD_READ_STATUS);
+	do {
+		s = SPI.transfer(0);
+	} while ((s&STATUS_BUSY) && micros()-start < timeout);
+	digitalWrite(cs_pin, HIGH);
+	return !(s&STATUS_BUSY);
+}
+
+bool
+SpiNorFlash::begin()
+{
+	uint8_t id[3];
+
+	pinMode(cs_pin, OUTPUT);
+	digitalWrite(cs_pin, HIGH);
+	SPI.begin();
+	SPI.beginTransaction(settings);
+	digitalWrite(cs_pin, LOW);
+	SPI.transfer(CMD_RELEASE);
+	digitalWrite(cs_pin, HIGH);
+	delayMicroseconds(5);		// tRES1 is 3uS
+	digitalWrite(cs_pin, LOW);
+	SPI.transfer(CMD_JEDEC_ID);
+	for (int i = 0; i < 3; i++)
+		id[i] = SPI.transfer(0);
+	digitalWrite(cs_pin, HIGH);
+	SPI.endTransaction();
+	if (id[0] == 0 || id[0] == 0xff || id[2] < 16 || id[2] > 24)	// nothing there, or not 64k-16M bytes
+		return false;
+	first = 0;
+	last = ((1UL<<id[2])/SPI_FLASH_SEC_SIZE)-1;
+	return true;
+}
+
+void
+SpiNorFlash::sleep()
+{
+	SPI.beginTransaction(settings);
+	digitalWrite(cs_pin, LOW);
+	SPI.transfer(CMD_POWER_DOWN);
+	digitalWrite(cs_pin, HIGH);
+	SPI.endTransaction();
+}
+
+bool
+SpiNorFlash::read(unsigned int address, void *p, int len)
+{
+	uint8_t *b = (uint8_t *)p;
+
+	SPI.beginTransaction(settings);
+	command(CMD_READ, address);
+	for (int i = 0; i < len; i++)
+		b[i] = SPI.transfer(0);
+	digitalWrite(cs_pin, HIGH);
+	SPI.endTransaction();
+	return true;
+}
+
+bool
+SpiNorFlash::write(unsigned int address, const void *p, int len)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	bool ok = true;
+
+	SPI.beginTransaction(settings);
+	while (len > 0 && ok) {		// a program can't cross a 256 byte page
+		int n = PROGRAM_PAGE-(address&(PROGRAM_PAGE-1));
+
+		if (n > len)
+			n = len;
+		digitalWrite(cs_pin, LOW);
+		SPI.transfer(CMD_WRITE_ENABLE);
+		digitalWrite(cs_pin, HIGH);
+		command(CMD_PAGE_PROGRAM, address);
+		SPI.writeBytes((uint8_t *)b, n);
+		digitalWrite(cs_pin, HIGH);
+		ok = wait(PROGRAM_TIMEOUT);
+		address += n;
+		b += n;
+		len -= n;
+	}
+	SPI.endTransaction();
+	return ok;
+}
+
+bool
+SpiNorFlash::erase(unsigned short sector)
+{
+	bool ok;
+
+	SPI.beginTransaction(settings);
+	digitalWrite(cs_pin, LOW);
+	SPI.transfer(CMD_WRITE_ENABLE);
+	digitalWrite(cs_pin, HIGH);
+	command(CMD_SECTOR_ERASE, sector*SPI_FLASH_SEC_SIZE);
+	digitalWrite(cs_pin, HIGH);
+	ok = wait(ERASE_TIMEOUT);
+	SPI.endTransaction();
+	return ok;
+}
@@ -0,0 +1,37 @@
+#ifndef SpiNorFlash_h
+#define SpiNorFlash_h
+/*   
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  a 25 series SPI NOR chip (W25Q, MX25L, ...) on the HSPI pins for HomeFlash to 
+//  overflow into - include Flash.h first
+//
+class SpiNorFlash: public FlashDevice {
+public:
+	SpiNorFlash(int cs) { cs_pin = cs; }
+	bool begin();		// wakes the chip and sizes it from its JEDEC id, false if there isn't one
+	void sleep();		// deep power down, call before we deep sleep
+	bool read(unsigned int address, void *p, int len);
+	bool write(unsigned int address, const void *p, int len);
+	bool erase(unsigned short sector);
+private:
+	int cs_pin;
+	void command(uint8_t cmd, unsigned int address);
+	bool wait(unsigned long timeout);
+};
+#endif
@@ -61,7 +61,7 @@ increment_time(time_stamp *t, int period)
     d++;
   period += t->day;
   if (period > d) {
-      t->day = period-d+1;
+      t->day = period-d;
       t->month++;
       if (t->month > 12) {
           t->month = 1;
@@ -72,22 +72,131 @@ increment_time(time_stamp *t, int period)
   }
 }
 
+//
+//  seconds since the start of 2000, 0 if the time isn't known
+//
+unsigned long
+time_stamp_seconds(const time_stamp *t)
+{
+  unsigned long days = 0;
+  int y, m;
+
+  if (!t->valid || t->month < 1 || t->month > 12)  // or it's garbage
+    return 0;
+  for (y = 2000; y < t->year; y++)
+    days += (y&3) == 0 ? 366 : 365;
+  for (m = 1; m < t->month; m++)
+    days += dm[m] + (m == 2 && (t->year&3) == 0);
+  days += t->day-1;
+  return ((days*24+t->hour)*60+t->minute)*60+t->second;
+}
+
+//
+//  seconds earlier - for a sample that was taken a while before we put it (see PRESSURE_BATCH)
+//
+void
+time_stamp_back(time_stamp *t, unsigned long seconds)
+{
+  int s, m, h;
+
+  if (!t->valid)
+    return;
+  s = t->second - seconds%60;
+  seconds /= 60;
+  m = t->minute - seconds%60;
+  seconds /= 60;
+  h = t->hour - seconds%24;
+  seconds /= 24;
+  if (s < 0) {
+    s += 60;
+    m--;
+  }
+  if (m < 0) {
+    m += 60;
+    h--;
+  }
+  if (h < 0) {
+    h += 24;
+    seconds++;
+  }
+  t->second = s;
+  t->minute = m;
+  t->hour = h;
+  while (seconds--) {   // days
+    if (--t->day == 0) {
+      if (--t->month == 0) {
+        t->month = 12;
+        t->year--;
+      }
+      t->day = dm[t->month] + (t->month == 2 && (t->year&3) == 0);
+    }
+  }
+}
+
+//
+//  the next sample's a sampling period after the last one - at the rate it was when it
+//  was taken, an 1111 0100 between them changes it
+//
+static time_stamp *
+next_time(decompress_state *s, time_stamp *t)
+{
+  *t = s->tm;
+  if (s->stepped)
+    increment_time(t, s->period);
+  return t;
+}
+
+static void
+log_sample(decompress_state *s, unsigned char valid_th, unsigned char valid_p)
+{
+  next_time(s, &s->tm);
+  s->stepped = 1;
+  if (s->pressure_in) {   // not one with pressure (1111 1011)
+    valid_p = 0;
+    s->pressure_in--;
+  } else {
+    s->pressure_in = s->pressure_every-1;
+  }
+  if (s->stream_type&4)
+    log_data_tenths(&s->tm, valid_th,  s->last_temp, s->last_humidity, valid_p, s->last_pressure);
+  else
+    log_data(&s->tm, valid_th,  s->last_temp, s->last_humidity, valid_p, s->last_pressure);
+}
+
+void
+decompress_start(decompress_state *s)
+{
+  s->tm.valid = 0;
+  s->tm.second = 0;
+  s->last_temp = s->last_humidity = s->last_pressure = 0;
+  s->period = 60;
+  s->stream_type = 0;
+  s->stepped = 0;
+  s->pressure_every = 1;
+  s->pressure_in = 0;
+}
+
 int
 dump_rtc_data(void)
+{
+  decompress_state s;
+
+  decompress_start(&s);
+  return decompress(&s);
+}
+
+int
+decompress(decompress_state *s)
 {
   int i;
-  unsigned char stream_type=0;
-  int last_temp, last_pressure, last_humidity;
   unsigned char b[5];
   unsigned char c=0x66;
   int samples=0;
-  unsigned char valid_th=0;
-  unsigned char valid_p=0;
-  time_stamp tm;
-  int period = 60;
+  unsigned char tenths=0;
+  time_stamp t;
+  unsigned char valid_th = (s->stream_type&1) != 0;
+  unsigned char valid_p = (s->stream_type&2) != 0;
 
-  tm.valid = 0;
-  tm.second = 0;
   for (i = 0; ;) {
     c = get_compressed_byte(i);
 //printf("C=%x\n",c);
@@ -96,29 +205,42 @@ dump_rtc_data(void)
       if (c == 0xff)
           return samples;
       switch (c&0xf) {
+      case 10: // in tenths, the stream type and a time signature follow
+        c = get_compressed_byte(i);
+        i++;
+        tenths = 4;
+        // fall through
       case 0:
       case 1:
       case 2:
       case 3:
-        stream_type = c&0x3;
-        valid_p = stream_type >= 2;
-        valid_th = (stream_type&1) != 0;
+        s->stream_type = (c&0x3)|tenths;
+        tenths = 0;
+        s->period = 60;           // an 1111 0100 follows if it isn't
+        s->stepped = 0;           // the next sample is at the time signature
+        s->pressure_every = 1;    // an 1111 1011 follows if it isn't
+        s->pressure_in = 0;
+        s->last_temp = s->stream_type&4 ? 0 : 127;       // no last sample, as the encoder has it after one
+        s->last_humidity = s->stream_type&4 ? 0 : 255;
+        s->last_pressure = 0;
+        valid_p = (s->stream_type&2) != 0;
+        valid_th = (s->stream_type&1) != 0;
         for (int j = 0; j < 5; j++)
             b[j] = get_compressed_byte(i+j);
         if (b[0]==0xff) {
             i++;
-            tm.valid = 0;
+            s->tm.valid = 0;
             break;
         }
         i += ((b[3]&0xf)==0xf?4:5);
-        tm.valid = 1;
-        tm.year = b[0]+2000;
-        tm.month = b[1]>>4;
-        tm.day = ((b[1]&0xf)<<1)|((b[2]>>7)&1);
-        tm.hour = (b[2]>>2)&0x1f;
-        tm.minute = ((b[2]&3)<<4)|(b[3]>>4);
+        s->tm.valid = 1;
+        s->tm.year = b[0]+2000;
+        s->tm.month = b[1]>>4;
+        s->tm.day = ((b[1]&0xf)<<1)|((b[2]>>7)&1);
+        s->tm.hour = (b[2]>>2)&0x1f;
+        s->tm.minute = ((b[2]&3)<<4)|(b[3]>>4);
         if ((b[3]&0xf)!=0xf) 
-           tm.second = b[4]&0x3f;
+           s->tm.second = b[4]&0x3f;
         break;
       case 4:
         b[0] = get_compressed_byte(i);
@@ -127,21 +249,21 @@ dump_rtc_data(void)
 //        Serial.print("Data rate: ");
 //        Serial.print((b[0]<<8)|b[1]);
 //        Serial.println(" seconds/sample");
-        period = (b[0]<<8)|b[1];
+        s->period = (b[0]<<8)|b[1];
         break;
       case 5:
 #ifdef NOTDEF
         Serial.print("Comment: ");
 #endif
         for (;;) {
-            char ch;
+            int ch;
             
             ch = get_compressed_byte(i);
             i++;
-            if (ch == 0 || ch == 0xff)
+            if (ch <= 0 || ch == 0xff)  // -1 is the end of what we have
               break;
 #ifdef NOTDEF
-            Serial.print(ch);
+            Serial.print((char)ch);
 #endif
         }
 #ifdef NOTDEF
@@ -151,72 +273,113 @@ dump_rtc_data(void)
       case 6:
         b[0] = get_compressed_byte(i);
         i++;
-        log_mark(&tm, b[0]);
+        log_mark(next_time(s, &t), b[0]);
         break;
       case 7: // null
         break;
       case 8:
         b[0] = get_compressed_byte(i);
         i++;
-        if (stream_type == 0) {
+        if (s->stream_type == 0) {
             //Serial.println("No data type specified - quitting");
             return samples;
         }
         while (b[0]--) {
           samples++;
-          log_data(&tm, valid_th,  last_temp, last_humidity, valid_p, last_pressure);
-          increment_time(&tm, period);
+          log_sample(s, valid_th, valid_p);
         }
         break;
+      case 9: // carries on from the last record
+        b[0] = get_compressed_byte(i);
+        i++;
+        if (s->stream_type == 0 || b[0] != stream_check(s->stream_type, s->last_temp, s->last_humidity, s->last_pressure)) {
+            //Serial.println("Not the record this one carries on from - quitting");
+            s->stream_type = 0;
+            return samples;
+        }
+        break;
+      case 11: // pressure in only some samples
+        b[0] = get_compressed_byte(i);
+        b[1] = get_compressed_byte(i+1);
+        i += 2;
+        s->pressure_every = b[0] ? b[0] : 1;
+        s->pressure_in = b[1] < s->pressure_every ? b[1] : 0;
+        break;
+      case 14: // records lost
+        b[0] = get_compressed_byte(i);
+        b[1] = get_compressed_byte(i+1);
+        i += 2;
+        log_gap(next_time(s, &t), (b[0]<<8)|b[1]);
+        s->stream_type = 0;   // a record after the gap can't carry on from one before it
+        break;
       default:
         //Serial.print("Invalid escape code - ");
         //Serial.println(c,HEX);
         return samples;
       }
     } else {
-        if (stream_type == 0) {
+        if (s->stream_type == 0) {
             //Serial.println("No data type specified - quitting");
             return samples;
         }
         samples++;
+        if (s->stream_type&4) { // tenths - nibble counts then the deltas, zigzagged
+          static const unsigned char nibbles[4] = {0, 1, 2, 4};
+          short *last[3];
+          int nibble = 0;
+
+          last[0] = &s->last_temp;
+          last[1] = &s->last_humidity;
+          last[2] = &s->last_pressure;
+          for (int f = 0; f < 3; f++) {
+            unsigned int z = 0;
+
+            for (int n = nibbles[(c>>(2*f))&3]; n > 0; n--) {
+              if (!nibble)
+                b[0] = get_compressed_byte(i++);
+              z = (z<<4) | (nibble ? b[0]&0xf : b[0]>>4);
+              nibble = !nibble;
+            }
+            *last[f] += z&1 ? -(int)(z>>1)-1 : (int)(z>>1);
+          }
+        } else
         if (!(c&0x80)) { // delta?
-          int skip=0;
-          if (stream_type&1) {
+          int skip=s->pressure_in != 0;   // bit 3 doesn't count if it has none
+          if (s->stream_type&1) {
             int d=c&0x7;
             if (d&0x4) // sign extend
               d -= 8;
-            last_temp += d;
+            s->last_temp += d;
             d=(c>>4)&0x7;
             if (d&0x4)  // sign extend 
               d -= 8;
-            last_humidity += d;
-            skip= c&0x8;
-            if (stream_type&2 && !skip)
+            s->last_humidity += d;
+            skip |= c&0x8;
+            if (s->stream_type&2 && !skip)
               c = get_compressed_byte(i++);
           }
-          if (stream_type&2 && !skip) {
+          if (s->stream_type&2 && !skip) {
             int d=c;
             if (d&0x40) // sign extend
               d -= 128;
-            last_pressure += d;
+            s->last_pressure += d;
           }
         } else {
-          if (stream_type&1) {
-            last_humidity = c&0x7f;
+          if (s->stream_type&1) {
+            s->last_humidity = c&0x7f;
             b[0] = get_compressed_byte(i++);
-            last_temp = b[0];
-            if (last_temp&0x80) // sign extend
-              last_temp -= 256;
-            if (stream_type&2) 
+            s->last_temp = b[0];
+            if (s->last_temp&0x80) // sign extend
+              s->last_temp -= 256;
+            if (s->stream_type&2 && !s->pressure_in)
               c = get_compressed_byte(i++);
           }
-          if (stream_type&2) {
+          if (s->stream_type&2 && !s->pressure_in) {
             b[1] = get_compressed_byte(i++);
-            last_pressure = ((c&0x7f)<<8)|b[1];
+            s->last_pressure = ((c&0x7f)<<8)|b[1];
           }
         }
-        log_data(&tm, valid_th,  last_temp, last_humidity, valid_p, last_pressure);
-        increment_time(&tm, period);
+        log_sample(s, valid_th, valid_p);
     }
   }
   return samples;
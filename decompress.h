@@ -35,11 +35,25 @@
       //  1111 0010 - time signature + change following samples to pressure only (first Afollowing sample will be a full sample)
       //  1111 0011 - time signature + change following samples to temp/humidity followed by pressure (first following sample will be a full sample)
       //  1111 0100 - followed by 2 bytes MSB LSB, sampling rate in seconds (default is 60 seconds, one sample per minute)
+      //              from the last sample (or time signature) on - it can change between any two samples
       //  1111 0101 - followed by 0 terminated string comment
       //  1111 0110 - followed by a 1-byte value - 'mark' a user inserted mark in the stream (for example "I turned on the heater here")
       //  1111 0111 - null - ignored for padding
       //  1111 1000 - followed by 1-byte count 1-255 - previous value didn't change to N samples
-      //  1111 1001-1110 undefined
+      //  1111 1001 - followed by a 1-byte check - this record carries on from the end of the one before it:
+      //              the same stream type, sampling rate and 1111 1011, the next sample is a delta from its last one
+      //              and is a sampling period after it. The check is stream_check() of the last sample,
+      //              if it doesn't match what we have the record before is missing and we can't go on
+      //  1111 1010 - followed by a 1-byte stream type (1 temp/humidity, 2 pressure, 3 both) and a time signature -
+      //              the following samples are in tenths of a degree C, % and hPa (see below)
+      //  1111 1011 - followed by 2 bytes, N 1-255 and K 0-254 - in a temp/humidity and pressure stream only every
+      //              Nth sample has pressure, the next that does is K samples on (0 the next one), until the
+      //              next time signature. The rest are temp/humidity alone - no pressure byte(s), bit 3 means
+      //              nothing, and in tenths their pressure nibble count is 0
+      //  1111 1100-1101 undefined
+      //  1111 1110 - followed by 2 bytes MSB LSB, count of records (flash writes) lost here because the flash filled
+      //              and they were overwritten before being uploaded. Bit 15 set means at least the rest - the
+      //              unit lost power while it was counting, or there were more than 7FFF
       //
       // time signature:
       //  byte0 - bits 7:0 years since 2000 0-254 - value '0xff' means no time is known (bytes1-4 are missing)
@@ -48,6 +62,14 @@
       //  byte3 - bits 7:4 minutes lsb 0-59, bits 3:0 - F means byte4 not included, otherwise undefined, set to 0
       //  byte4 - bits 7:6 undefined set to 0, bits 5:0 seconds
 
+      // samples in tenths:
+      //  byte0 - bits 7:6 0, bits 5:4 pressure, bits 3:2 humidity, bits 1:0 temp - the nibbles each's delta
+      //          from the last sample takes, 0-3 meaning 0, 1, 2 or 4. Fields the stream doesn't have are 0.
+      //          The first sample after the time signature is a delta from 0
+      //  then the deltas, zigzagged (0, -1, 1, -2 ... sent as 0, 1, 2, 3 ...) most significant nibble first,
+      //          packed high nibble first, the last byte padded with a 0 nibble. A sample that's all 0 is just
+      //          byte0, a run of them becomes a 1111 1000 repeat count as with whole units
+
 typedef struct time_stamp {
   unsigned char valid;
   int year;
@@ -58,14 +80,51 @@ typedef struct time_stamp {
   unsigned char second; 
 } time_stamp;
 
+//
+//  where decoding has got to - a record that carries on from the one before needs it
+//
+typedef struct decompress_state {
+  time_stamp tm;                // of the last sample, or the time signature
+  short last_temp;
+  short last_humidity;
+  short last_pressure;
+  unsigned short period;        // seconds per sample
+  unsigned char stream_type;    // 0 until we've had a time signature, 4 set for tenths
+  unsigned char stepped;        // there's been a sample since it, the next is a period after tm
+  unsigned char pressure_every; // only every this many samples has pressure (1111 1011)
+  unsigned char pressure_in;    // samples before the next one that does
+} decompress_state;
+
+//
+//  a byte that depends on the last sample, for a record that carries on from it to check
+//  that it's carrying on from what we think - see 1111 1001
+//
+static inline unsigned char
+stream_check(unsigned char stream_type, int temp, int humidity, int pressure)
+{
+  unsigned int c = 0x5a;
+
+  if (stream_type&1)
+    c += (temp&0xff) + 3*humidity;
+  if (stream_type&2)
+    c += 7*pressure + (pressure>>8);
+  return c ^ (c>>8);
+}
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 void log_data(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure);
+void log_data_tenths(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure); // 1111 1010 streams
 int get_compressed_byte(int offset);
 void log_mark(time_stamp *t, int mark);
-int dump_rtc_data(void);
+void log_gap(time_stamp *t, int records);  // the 2 bytes, 0x8000 set for at least
+int dump_rtc_data(void);                // decompress() a stream that stands alone
+void decompress_start(decompress_state *s);
+int decompress(decompress_state *s);    // what get_compressed_byte() has, carrying on from s
+unsigned long time_stamp_seconds(const time_stamp *t);
+void time_stamp_back(time_stamp *t, unsigned long seconds);
 #ifdef __cplusplus
 }
 #endif
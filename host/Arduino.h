@@ -0,0 +1,24 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+//
+//  host stand-in for the bits of the ESP8266 Arduino core that the flash code and sensor
+//  drivers use
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+void noInterrupts(void);
+void interrupts(void);
+unsigned long micros(void);   // the simulator's modelled flash time, or I2C bus time
+void delayMicroseconds(unsigned int us);  // moves the I2C bus's clock on
+
+//
+//  the firmware's debug printf()s go to the serial port, on the host they would
+//  swamp the benchmark output so they're only shown when host_verbose is set
+//
+extern int host_verbose;
+#define printf(...) (host_verbose ? printf(__VA_ARGS__) : 0)
+#endif
@@ -0,0 +1,74 @@
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  host stand-in for the Arduino core's Wire, an I2C bus of simulated register files
+//  (see wire_sim.cpp). It counts what the bus would do - transactions (a START through
+//  to its STOP, a repeated START doesn't end one), bytes including the address ones,
+//  and bit times. micros() is the bus's clock, which those bit times and
+//  delayMicroseconds() move on
+//
+#include "Arduino.h"
+
+class TwoWire {
+public:
+  void begin(int sda, int scl) {}
+  void begin(void) {}
+  void beginTransmission(uint8_t address);
+  size_t write(uint8_t b);
+  uint8_t endTransmission(bool stop = 1);     // 0 if the device answered
+  uint8_t requestFrom(uint8_t address, uint8_t len, bool stop = 1);   // bytes we got
+  int available(void);
+  int read(void);
+};
+extern TwoWire Wire;
+
+//
+//  a device on the bus - its registers, and how it steps through them. The ST parts
+//  (HTS221, LPS25H) only move on to the next register when bit 7 of the sub-address
+//  is set, the PC8563 always does. Writing start_bit to start_reg starts a conversion
+//  that sets ready_bits in ready_reg, and clears start_bit, convert_us later - never if
+//  convert_us is 0. A FIFO is read out through window_len registers from window_reg,
+//  which stepping on past the last goes back to the first of
+//
+typedef struct wire_sim_device {
+  uint8_t   address;
+  bool      msb_increment;
+  uint8_t   regs[256];
+  uint8_t   reg;            // where the next read or write goes
+  bool      increment;
+  unsigned long reads;      // register bytes read out of it
+  uint8_t   start_reg, start_bit;
+  uint8_t   ready_reg, ready_bits;
+  unsigned long convert_us;
+  unsigned long done_at;    // micros() the conversion going finishes, 0 if there isn't one
+  uint8_t   window_reg, window_len;
+  uint8_t   fifo[128];      // what's queued in it, reads of the window take it oldest first
+  int       fifo_len, fifo_off;
+} wire_sim_device;
+
+wire_sim_device *wire_sim_add(uint8_t address, bool msb_increment);
+void wire_sim_reset(void);      // zero the counters, devices stay
+
+extern unsigned long wire_sim_transactions, wire_sim_bytes, wire_sim_bits;
+#define WIRE_SIM_KHZ 100                        // the 8266 core's default clock
+#define WIRE_SIM_BUFFER 32                      // its BUFFER_LENGTH, a requestFrom() gets no more
+#define wire_sim_us() (wire_sim_bits*1000/WIRE_SIM_KHZ)
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef HOST_C_TYPES_H
+#define HOST_C_TYPES_H
+//
+//  host stand-in for the ESP8266 SDK's c_types.h - just enough for our own code
+//
+#include <stdint.h>
+
+typedef unsigned char   uint8;
+typedef signed char     sint8;
+typedef unsigned short  uint16;
+typedef signed short    sint16;
+typedef unsigned int    uint32;
+typedef signed int      sint32;
+#endif
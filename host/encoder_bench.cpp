@@ -0,0 +1,831 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  encoder_bench [-v] - the sketch's sample compressor (SampleEncoder) on the host
+//
+//  For some synthetic signals: how fast it encodes (ns and, on x86, cycles per sample),
+//  and how many bytes per sample it makes with the sketch's 255 byte RTC buffer and with
+//  bigger records, before and after padding each record out to flush_at, in whole units
+//  and in tenths. Then round trips -
+//  every record is decoded by decompress.c's decompress() as it's flushed, and must give
+//  back every sample, mark and time we put in, for each mix of sensors. Last, the RTC
+//  memory word reads and writes a wake of the sketch costs (see rtc_sim.h), with samples
+//  written and read back through an RtcStream and the way they were before, an
+//  rtc_mem_write()/rtc_mem_read() each, how many samples the RTC buffer holds once
+//  the flash won't take any more records, SampleRate's wakes a day against the error
+//  they cost, what reading pressure only every so many samples (PRESSURE_EVERY) saves a day,
+//  and the wakes an hour PRESSURE_BATCH saves. Exits 1 if anything didn't decode
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "../SampleEncoder.h"
+#include "../SampleRate.h"
+#include "../RtcMemory.h"
+#include "rtc_sim.h"
+
+#define SAMPLES       (1<<20)       // of each signal
+#define SPEED_REPS    8             // times through them for the speed test
+#define ROUND_SAMPLES 200000
+#define EPOCH_2000    946684800     // time_t of the start of 2000, decompress.c counts from there
+#define START         (5904UL*24*60*60)   // 1 March 2016
+
+static bool verbose;
+
+//
+//  the signals - whole degrees C, % and hPa as the sketch stores them, and in tenths
+//
+static int temps[SAMPLES], humidities[SAMPLES], pressures[SAMPLES];
+static int temps10[SAMPLES], humidities10[SAMPLES], pressures10[SAMPLES];
+static unsigned int seed;
+
+static double
+noise(double range)
+{
+  seed = seed*1103515245+12345;
+  return range*(((seed>>8)&0xffff)/32768.0-1.0);
+}
+
+static int
+clamp(int v, int lo, int hi)
+{
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void
+make_signal(int kind)
+{
+  static const int edges[] = {0, 3, -4, 4, -5, 0, 63, -64, 64, -65};   // either side of a full sample
+  double weather = 0, t, h, p;
+
+  seed = 1+kind;
+  for (int i = 0; i < SAMPLES; i++) {
+    double day = 2*M_PI*((i+16*60)%(24*60))/(24*60);
+
+    switch (kind) {
+    case 0:     // indoors, a sample a minute - like flash_bench's trace
+      weather += noise(0.02);
+      t = 19.5+2.5*sin(day)+noise(0.3);
+      h = 45-6*sin(day)+noise(0.6);
+      p = 1013+8*sin(2*M_PI*i/(5*24*60))+weather+noise(0.3);
+      break;
+    case 1:     // a quiet room, long runs of the same sample
+      temps[i] = 18+(i/5000)%3;
+      humidities[i] = 50-(i/7000)%2;
+      pressures[i] = 1010+(i/3000)%4;
+      break;
+    case 2:     // noisy sensors
+      weather += noise(0.05);
+      temps[i] = (int)floor(21+3*sin(day)+noise(2.5)+0.5);
+      humidities[i] = (int)floor(55+8*sin(day)+noise(3.5)+0.5);
+      pressures[i] = (int)floor(1000+weather+noise(20)+0.5);
+      break;
+    case 3:     // steps either side of what a delta can hold
+      if (!i) {
+        temps[i] = 20;
+        humidities[i] = 50;
+        pressures[i] = 1000;
+        break;
+      }
+      seed = seed*1103515245+12345;
+      temps[i] = clamp(temps[i-1]+edges[(seed>>8)%5], -40, 60);
+      humidities[i] = clamp(humidities[i-1]+edges[(seed>>12)%5], 0, 100);
+      pressures[i] = clamp(pressures[i-1]+edges[5+(seed>>16)%5], 300, 1100);
+      break;
+    case 5:     // lived in by day, the heating off and nobody about at night
+      weather += noise(0.01);
+      if ((i/60+1)%24 >= 8) {   // 7am to 11pm
+        t = 20.5+1.5*sin(day)+noise(0.3);
+        h = 45+noise(0.6);
+        p = 1013+weather+noise(0.3);
+      } else {
+        t = 20.5-2.5*((i+60)%(24*60))/(8*60);   // slowly cooling
+        h = 48+((i+60)%(24*60))/(4*60.0);
+        p = 1013+weather;
+      }
+      break;
+    default:    // nothing to do with the last one
+      seed = seed*1103515245+12345;
+      temps[i] = (int)((seed>>8)%101)-40;
+      humidities[i] = (seed>>12)%101;
+      pressures[i] = 300+(seed>>4)%800;
+      break;
+    }
+    if (kind == 0 || kind == 5) {   // from t, h and p
+      temps[i] = (int)floor(t+0.5);
+      humidities[i] = (int)floor(h+0.5);
+      pressures[i] = (int)floor(p+0.5);
+      temps10[i] = (int)floor(t*10+0.5);
+      humidities10[i] = (int)floor(h*10+0.5);
+      pressures10[i] = (int)floor(p*10+0.5);
+      continue;
+    }
+    temps10[i] = temps[i]*10+(i/7*3)%10;     // something in the tenths that doesn't change every sample
+    humidities10[i] = humidities[i]*10+(i/11*7)%10;
+    pressures10[i] = pressures[i]*10+(i/5)%10;
+  }
+}
+
+static const char *signals[] = {"indoors", "quiet", "noisy", "edges", "random", "nights"};
+#define SIGNALS (int)(sizeof(signals)/sizeof(signals[0]))
+
+static void
+seconds_to_stamp(unsigned long s, time_stamp *t)
+{
+  time_t tt = EPOCH_2000+s;
+  struct tm tm;
+
+  gmtime_r(&tt, &tm);
+  t->valid = 1;
+  t->year = tm.tm_year+1900;
+  t->month = tm.tm_mon+1;
+  t->day = tm.tm_mday;
+  t->hour = tm.tm_hour;
+  t->minute = tm.tm_min;
+  t->second = tm.tm_sec;
+}
+
+//
+//  where the encoder's records go - kept in b until they're flushed, then counted and, for a
+//  round trip, decoded
+//
+static class BenchSink: public SampleSink {
+public:
+  void write(int offset, const unsigned char *p, int len) { memcpy(&b[offset], p, len); }
+  unsigned char read(int offset) { return b[offset]; }
+  int flush(int len);
+  void now(time_stamp *t) { seconds_to_stamp(START+next*period, t); time_stamp_back(t, behind*period); }
+
+  unsigned char b[4096];
+  int max;              // every record's flush_at
+  bool check;           // decode each record as it's flushed
+  long drop;            // but not this one, as if it was lost
+  unsigned long per_record[16];  // samples decoded from each of the first few
+  int period;
+  unsigned long next;   // the sample we're putting, a time signature's for it
+  unsigned long behind; // or for the one this many before it (a batch drained at once)
+  unsigned long records, bytes, padded;
+} sink;
+static sample_encoder_state state;
+static SampleEncoder encoder(&state, &sink, sizeof(sink.b));
+
+//
+//  decompress.c's callbacks, checking what it decodes against what we encoded
+//
+static const unsigned char *decoding;
+static SampleSink *decoding_from;       // or read it back out of this
+static int decoding_len;
+static unsigned long decoded, marks, errors;
+static unsigned char decode_types;
+static int decode_period;
+static int decode_every;                // only every this many has pressure
+static unsigned long mark_at[ROUND_SAMPLES/500+2];
+static decompress_state decode_state;   // carried from one record to the next
+static const unsigned long *decode_taken;   // which of the signal each sample was, if not every one
+
+static void
+error(const char *what, unsigned long i)
+{
+  if (errors++ < 10)
+    printf("    sample %lu: %s\n", i, what);
+}
+
+extern "C" int
+get_compressed_byte(int offset)
+{
+  if (offset >= decoding_len)
+    return -1;
+  return decoding_from ? decoding_from->read(offset) : decoding[offset];
+}
+
+static void
+check_sample(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure, bool tenths)
+{
+  unsigned long i = decoded++;
+  bool want_p = decode_types&SAMPLE_P && i%decode_every == 0;
+
+  if (i >= ROUND_SAMPLES) {
+    error("more samples than we encoded", i);
+    return;
+  }
+  if (decode_taken)
+    i = decode_taken[i];
+  if (!valid_th != !(decode_types&SAMPLE_TH) || !valid_p != !want_p || !tenths != !(decode_types&SAMPLE_TENTHS))
+    error("wrong stream type", i);
+  if (valid_th && (temp != (tenths ? temps10 : temps)[i] || humidity != (tenths ? humidities10 : humidities)[i]))
+    error("temp/humidity", i);
+  if (valid_p && pressure != (tenths ? pressures10 : pressures)[i])
+    error("pressure", i);
+  if (!t->valid || time_stamp_seconds(t) != START+i*decode_period)
+    error("time", i);
+}
+
+extern "C" void
+log_data(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
+{
+  check_sample(t, valid_th, temp, humidity, valid_p, pressure, 0);
+}
+
+extern "C" void
+log_data_tenths(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
+{
+  check_sample(t, valid_th, temp, humidity, valid_p, pressure, 1);
+}
+
+extern "C" void
+log_mark(time_stamp *t, int mark)
+{
+  if (marks >= sizeof(mark_at)/sizeof(mark_at[0]) || mark_at[marks] != decoded || mark != (int)(marks&0xff))
+    error("mark", decoded);
+  marks++;
+}
+
+extern "C" void
+log_gap(time_stamp *t, int records)
+{
+  error("gap", decoded);
+}
+
+static void
+decode(const unsigned char *b, int len)
+{
+  decoding = b;
+  decoding_len = len;
+  decompress(&decode_state);
+}
+
+int
+BenchSink::flush(int len)
+{
+  unsigned long n = decoded;
+
+  records++;
+  bytes += len;
+  padded += state.flush_at;
+  if (check && (long)records-1 != drop) {
+    while (len < state.flush_at)
+      b[len++] = 0xf7;
+    decode(&b[0], len);
+  }
+  if (records <= sizeof(per_record)/sizeof(per_record[0]))
+    per_record[records-1] = decoded-n;
+  return max;
+}
+
+static void
+start(unsigned char types, int period, int max, int resync, bool check, int every = 1)
+{
+  sink.max = max;
+  sink.check = check;
+  sink.drop = -1;
+  sink.period = period;
+  sink.next = 0;
+  sink.behind = 0;
+  sink.records = sink.bytes = sink.padded = 0;
+  decompress_start(&decode_state);
+  decode_every = every;
+  encoder.Init(types, period, max, resync, every);
+  encoder.TimeSignature();
+}
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+//
+//  bytes per sample, and how long each takes, for a signal
+//
+static void
+bench_speed(int signal, int max, int resync, unsigned char tenths)
+{
+  const int *t = tenths ? temps10 : temps, *h = tenths ? humidities10 : humidities, *p = tenths ? pressures10 : pressures;
+  unsigned long n = (unsigned long)SAMPLES*SPEED_REPS;
+  double ns;
+#ifdef HAVE_RDTSC
+  unsigned long long cycles;
+#endif
+
+  start(SAMPLE_TH|SAMPLE_P|tenths, 60, max, resync, 0);
+  ns = now_ns();
+#ifdef HAVE_RDTSC
+  cycles = __rdtsc();
+#endif
+  for (int r = 0; r < SPEED_REPS; r++)
+  for (int i = 0; i < SAMPLES; i++)
+    encoder.Sample(t[i], h[i], p[i]);
+#ifdef HAVE_RDTSC
+  cycles = __rdtsc()-cycles;
+#endif
+  ns = now_ns()-ns;
+  printf("  %-8s %4d max %2d resync%s  %6.3f bytes/sample, %6.3f padded, %6lu records  %6.1f ns/sample",
+    signals[signal], max, resync, tenths ? " tenths" : "       ", (double)(sink.bytes+encoder.Length())/n, (double)sink.padded/n,
+    sink.records, ns/n);
+#ifdef HAVE_RDTSC
+  printf(" %6.1f cycles/sample", (double)cycles/n);
+#endif
+  printf(" %5.1fM samples/s\n", n/ns*1000);
+}
+
+//
+//  encode a signal with marks and comments in it, decoding each record as it's flushed
+//  (carrying on from the one before if it says so)
+//
+static bool
+round_trip(int signal, unsigned char types, int period, int max, int resync, int every)
+{
+  unsigned long m = 0;
+  bool tenths = types&SAMPLE_TENTHS;
+  const int *t = tenths ? temps10 : temps, *h = tenths ? humidities10 : humidities, *p = tenths ? pressures10 : pressures;
+
+  decoded = marks = errors = 0;
+  decode_types = types;
+  decode_period = period;
+  start(types, period, max, resync, 1, (types&(SAMPLE_TH|SAMPLE_P)) == (SAMPLE_TH|SAMPLE_P) ? every : 1);
+  for (unsigned long i = 0; i < ROUND_SAMPLES; i++) {
+    sink.next = i;
+    if (i%997 == 13) {
+      mark_at[m] = i;
+      encoder.Mark(m++);
+    }
+    if (i%4999 == 7)
+      encoder.Comment("a comment");
+    encoder.Sample(t[i], h[i], p[i]);
+  }
+  decode(&sink.b[0], encoder.Length());     // what's left in the buffer
+  if (decoded != ROUND_SAMPLES)
+    error("samples decoded", decoded);
+  if (marks != m)
+    error("marks decoded", marks);
+  if (errors || verbose)
+    printf("  %-8s types %d, %3d s/sample, %4d max, %d resync, pressure every %d: %lu samples %lu records, %lu errors\n",
+      signals[signal], types, period, max, resync, every, decoded, sink.records, errors);
+  return errors == 0;
+}
+
+//
+//  a record that carries on from one that's been lost mustn't be decoded as if it hadn't
+//  been - nothing from it or the ones after it until the next that starts afresh
+//
+static bool
+lost_record(int resync)
+{
+  bool ok = 1;
+
+  make_signal(0);
+  decoded = marks = 0;
+  errors = 10;      // what's decoded after the lost record doesn't line up, don't list it
+  decode_types = SAMPLE_TH|SAMPLE_P;
+  decode_period = 60;
+  start(SAMPLE_TH|SAMPLE_P, 60, 255, resync, 1);
+  sink.drop = 1;
+  for (unsigned long i = 0; sink.records < (unsigned long)resync+2; i++) {
+    sink.next = i;
+    encoder.Sample(temps[i], humidities[i], pressures[i]);
+  }
+  for (int r = 2; r < resync; r++)   // carried on from the lost one
+    if (sink.per_record[r])
+      ok = 0;
+  if (sink.per_record[0] == 0 || sink.per_record[resync] == 0)
+    ok = 0;
+  printf("  record 1 of every %d lost: %lu %lu | %lu ... %lu %lu samples decoded from the records around it, %s\n",
+    resync, sink.per_record[0], sink.per_record[1], sink.per_record[2], sink.per_record[resync-1],
+    sink.per_record[resync], ok ? "ok" : "wrong");
+  return ok;
+}
+
+//
+//  the sketch's RtcSink - the buffer is in RTC memory after save_info, flushed the way
+//  unload_rtc_buffer() does, decoding it through get_compressed_byte() and reading it
+//  out in one go. words uses rtc_buffer, otherwise it's an rtc_mem_write()/rtc_mem_read()
+//  a time as it was before
+//
+#define RTC_BASE    196     // sizeof(rtc_info) with the 8266's 4 byte longs
+#define RTC_MAX     (RTC_USER_SIZE-RTC_BASE)  // RTC_BUFF_SIZE
+#define RTC_WAKES   100000
+#define SAVE_INFO_WORDS (RTC_BASE/4)
+
+static class RtcBenchSink: public SampleSink {
+public:
+  RtcBenchSink(): stream(RTC_BASE) {}
+  void write(int offset, const unsigned char *p, int len);
+  unsigned char read(int offset);
+  int flush(int len);
+  void now(time_stamp *t) { seconds_to_stamp(START+next*60, t); }
+
+  bool words;
+  bool refuse;          // the flash is full, records can't be written
+  RtcStream stream;
+  unsigned long next;
+  unsigned long records;
+} rtc_sink;
+static SampleEncoder rtc_encoder(&state, &rtc_sink, RTC_MAX);
+
+void
+RtcBenchSink::write(int offset, const unsigned char *p, int len)
+{
+  if (words)
+    stream.Write(offset, p, len);
+  else
+    rtc_mem_write(RTC_BASE+offset, p, len);
+}
+
+unsigned char
+RtcBenchSink::read(int offset)
+{
+  unsigned char c;
+
+  if (words)
+    return stream.Read(offset);
+  rtc_mem_read(RTC_BASE+offset, &c, 1);
+  return c;
+}
+
+int
+RtcBenchSink::flush(int len)
+{
+  unsigned char b[RTC_MAX];
+
+  if (words)
+    stream.Sync();
+  if (refuse)
+    return 0;
+  decoding_from = this;
+  decoding_len = len;
+  decompress(&decode_state);
+  rtc_mem_read(RTC_BASE, &b[0], len);
+  records++;
+  return RTC_MAX;
+}
+
+//
+//  a sample a wake, with the odd mark and comment, checking it all decodes
+//
+static bool
+bench_rtc(bool words)
+{
+  unsigned long m = 0, reads, writes, flush_reads = 0, flush_writes = 0;
+
+  make_signal(0);
+  rtc_sim_reset();
+  decoded = marks = errors = 0;
+  decode_types = SAMPLE_TH|SAMPLE_P;
+  decode_period = 60;
+  rtc_sink.words = words;
+  rtc_sink.refuse = 0;
+  rtc_sink.next = 0;
+  rtc_sink.records = 0;
+  decompress_start(&decode_state);
+  rtc_encoder.Init(SAMPLE_TH|SAMPLE_P, 60, RTC_MAX, 8);   // the sketch's SAMPLE_RESYNC
+  rtc_encoder.TimeSignature();
+  rtc_sink.stream.Sync();
+  reads = rtc_sim_reads;
+  writes = rtc_sim_writes;
+  for (unsigned long i = 0; i < RTC_WAKES; i++) {
+    unsigned long records = rtc_sink.records, r = rtc_sim_reads, w = rtc_sim_writes;
+
+    rtc_sink.stream = RtcStream(RTC_BASE);    // nothing survives a deep sleep but RTC memory
+    rtc_sink.next = i;
+    if (i%997 == 13) {
+      mark_at[m] = i;
+      rtc_encoder.Mark(m++);
+    }
+    if (i%4999 == 7)
+      rtc_encoder.Comment("a comment");
+    rtc_encoder.Sample(temps[i], humidities[i], pressures[i]);
+    if (words)
+      rtc_sink.stream.Sync();
+    if (rtc_sink.records != records) {
+      flush_reads += rtc_sim_reads-r;
+      flush_writes += rtc_sim_writes-w;
+    }
+  }
+  reads = rtc_sim_reads-reads;
+  writes = rtc_sim_writes-writes;
+  decoding_from = &rtc_sink;
+  decoding_len = rtc_encoder.Length();
+  decompress(&decode_state);
+  decoding_from = 0;
+  if (decoded != RTC_WAKES)
+    error("samples decoded", decoded);
+  if (marks != m)
+    error("marks decoded", marks);
+  printf("  %-22s %5.2f reads %5.2f writes a wake, %6.1f reads %5.2f writes a flush (%lu), %lu errors\n",
+    words ? "RtcStream" : "a byte at a time", (double)reads/RTC_WAKES, (double)writes/RTC_WAKES,
+    (double)flush_reads/rtc_sink.records, (double)flush_writes/rtc_sink.records, rtc_sink.records, errors);
+  return errors == 0;
+}
+
+//
+//  how long the RTC buffer lasts once the flash won't take records (it's full and we don't
+//  overwrite), at a sample a minute - a buffer of size with records flushed at 254 bytes,
+//  a program page
+//
+static bool
+bench_full(int size)
+{
+  SampleEncoder e(&state, &rtc_sink, size);
+  unsigned long i;
+
+  make_signal(0);
+  rtc_sim_reset();
+  decoded = marks = errors = 0;
+  decode_types = SAMPLE_TH|SAMPLE_P;
+  decode_period = 60;
+  rtc_sink.words = 1;
+  rtc_sink.refuse = 1;
+  rtc_sink.next = 0;
+  e.Init(SAMPLE_TH|SAMPLE_P, 60, 254);
+  e.TimeSignature();
+  for (i = 0; i < 24*60; i++) {
+    rtc_sink.next = i;
+    e.Sample(temps[i], humidities[i], pressures[i]);
+  }
+  rtc_sink.stream.Sync();
+  decoding_from = &rtc_sink;
+  decoding_len = e.Length();
+  dump_rtc_data();
+  decoding_from = 0;
+  printf("  %d byte buffer: %lu samples (%.1f hours) in %d bytes, %lu errors\n", size, decoded,
+    decoded/60.0, e.Length(), errors);
+  return errors == 0;
+}
+
+//
+//  SampleRate, waking every 60 seconds to every max seconds, on a month of a signal - wakes
+//  a day, and how far the samples (each held until the next) are from the signal each
+//  minute, in whole units. The times must all decode exactly
+//
+#define RATE_MINUTES (30*24*60)
+
+static bool
+bench_rate(int signal, int max)
+{
+  static unsigned long taken[RATE_MINUTES];   // the minute of each sample
+  sample_rate_state rs;
+  SampleRate rate(&rs);
+  unsigned long n = 0, k = 0;
+  double sum[3] = {0, 0, 0};
+  int worst[3] = {0, 0, 0};
+
+  decoded = marks = errors = 0;
+  decode_types = SAMPLE_TH|SAMPLE_P;
+  decode_period = 60;
+  decode_taken = taken;
+  start(SAMPLE_TH|SAMPLE_P, 60, 255, 8, 1);
+  rate.Init(60, max, 4);
+  for (unsigned long m = 0; m < RATE_MINUTES; m += rate.Period()/60) {
+    sink.next = m;
+    taken[n++] = m;
+    encoder.Sample(temps[m], humidities[m], pressures[m]);
+    encoder.Period(rate.Next(encoder.Unchanged()));
+  }
+  decode(&sink.b[0], encoder.Length());
+  decode_taken = 0;
+  if (decoded != n)
+    error("samples decoded", decoded);
+  for (unsigned long m = 0; m < RATE_MINUTES; m++) {
+    int d[3];
+
+    if (k+1 < n && taken[k+1] <= m)
+      k++;
+    d[0] = abs(temps[m]-temps[taken[k]]);
+    d[1] = abs(humidities[m]-humidities[taken[k]]);
+    d[2] = abs(pressures[m]-pressures[taken[k]]);
+    for (int f = 0; f < 3; f++) {
+      sum[f] += d[f];
+      if (d[f] > worst[f])
+        worst[f] = d[f];
+    }
+  }
+  printf("  %-8s %4d s max  %6.1f wakes a day  %.3f %.3f %.3f mean error, worst %d %d %d, %lu errors\n",
+    signals[signal], max, n/30.0, sum[0]/RATE_MINUTES, sum[1]/RATE_MINUTES, sum[2]/RATE_MINUTES,
+    worst[0], worst[1], worst[2], errors);
+  return errors == 0;
+}
+
+//
+//  PRESSURE_EVERY - a day of a wake a second, reading pressure only when PressureDue() says
+//  so, with every sample decoded. What the LPS25H reads left out save, by what one costs a
+//  wake of the sketch with the HTS221 read too: wake it, one status read (its conversion's
+//  done by the time the HTS221's is), 3 bytes of pressure and power it down - a 100kHz I2C
+//  transaction each, about 30 bit times a write and 40 a read
+//
+#define DAY_SAMPLES       (24*60*60)
+#define P_TRANSACTIONS    6
+#define P_BUS_US          (2*300+4*400)
+
+static bool
+bench_every(int every)
+{
+  unsigned long reads = 0;
+
+  decoded = marks = errors = 0;
+  decode_types = SAMPLE_TH|SAMPLE_P;
+  decode_period = 60;
+  start(SAMPLE_TH|SAMPLE_P, 60, 255, 8, 1, every);
+  for (unsigned long i = 0; i < DAY_SAMPLES; i++) {
+    sink.next = i;
+    if (encoder.PressureDue())
+      reads++;
+    encoder.Sample(temps[i], humidities[i], pressures[i]);
+  }
+  decode(&sink.b[0], encoder.Length());
+  if (decoded != DAY_SAMPLES)
+    error("samples decoded", decoded);
+  printf("  every %2d  %5lu pressure reads a day  %6lu fewer I2C transactions  %9lu us less awake  %.3f bytes/sample  %lu errors\n",
+    every, reads, (DAY_SAMPLES-reads)*P_TRANSACTIONS, (DAY_SAMPLES-reads)*P_BUS_US,
+    (double)(sink.bytes+encoder.Length())/DAY_SAMPLES, errors);
+  return errors == 0;
+}
+
+//
+//  PRESSURE_BATCH - the LPS25H samples into its 32 deep FIFO once a period while we sleep
+//  batch periods, give or take drift (the 8266's sleep timer is only good to a few %). Then
+//  we drain it and put everything queued, timing each back from the newest as the sketch
+//  does, with the temp/humidity we read as we woke. How many wakes an hour that is at the
+//  sketch's 1Hz, bytes a sample, and how many samples a late wake loses to the FIFO
+//  overrunning (the times after that are wrong, so we stop checking them)
+//
+#define FIFO_SIZE 32
+
+static bool
+bench_batch(int batch, double drift)
+{
+  static unsigned long taken[ROUND_SAMPLES];
+  unsigned long n = 0, wakes = 0, lost = 0, have = 0;
+  double woke = 0;
+
+  decoded = marks = errors = 0;
+  decode_types = SAMPLE_TH|SAMPLE_P;
+  decode_period = 60;
+  decode_taken = taken;
+  make_signal(0);
+  start(SAMPLE_TH|SAMPLE_P, 60, 255, 8, 1);
+  for (;;) {
+    unsigned long from = have;
+
+    woke += batch*(1+noise(drift));
+    have = (unsigned long)woke;  // samples the LPS25H has taken by now
+    if (have >= ROUND_SAMPLES)
+      break;
+    wakes++;
+    if (have-from > FIFO_SIZE) {
+      lost += have-FIFO_SIZE-from;
+      from = have-FIFO_SIZE;
+      sink.check = 0;   // no use decoding the rest
+    }
+    sink.next = have-1;
+    for (unsigned long i = from; i < have; i++) {
+      temps[i] = temps[have-1];    // one temp/humidity reading a wake
+      humidities[i] = humidities[have-1];
+      taken[n++] = i;
+      sink.behind = have-1-i;
+      encoder.Sample(temps[i], humidities[i], pressures[i]);
+    }
+    sink.behind = 0;
+  }
+  if (!lost)
+    decode(&sink.b[0], encoder.Length());
+  decode_taken = 0;
+  if (!lost && decoded != n)
+    error("samples decoded", decoded);
+  printf("  %2d a wake, %2.0f%% drift  %7.1f wakes an hour  %.3f bytes/sample  %lu lost  %lu errors\n",
+    batch, drift*100, 3600.0*wakes/have, (double)sink.padded/n, lost, lost ? 0 : errors);
+  return lost || errors == 0;
+}
+
+//
+//  time_stamp_back() against gmtime()
+//
+static bool
+check_time_back(void)
+{
+  unsigned long bad = 0;
+
+  for (int i = 0; i < 1000000; i++) {
+    unsigned long s = START+(long)(noise(1)*START/2)+START/2, back;
+    time_stamp t;
+
+    seed = seed*1103515245+12345;
+    back = i&1 ? (seed>>8)%7200 : (seed>>8)%(400L*24*60*60);
+    seconds_to_stamp(s, &t);
+    time_stamp_back(&t, back);
+    if (time_stamp_seconds(&t) != s-back && bad++ < 10)
+      printf("    %lu back %lu\n", s, back);
+  }
+  printf("  time_stamp_back(): %lu wrong\n", bad);
+  return bad == 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  static const int maxes[] = {255, 1024, 4058};
+  static const unsigned char types[] = {SAMPLE_TH|SAMPLE_P, SAMPLE_TH, SAMPLE_P,
+    SAMPLE_TH|SAMPLE_P|SAMPLE_TENTHS, SAMPLE_TH|SAMPLE_TENTHS, SAMPLE_P|SAMPLE_TENTHS};
+  static const int periods[] = {60, 300};
+  static const int resyncs[] = {1, 8};
+  static const int everies[] = {1, 10};
+  static const int day_everies[] = {1, 2, 5, 10, 30, 60};
+  int trips = 0, bad = 0;
+
+  if (argc > 1 && strcmp(argv[1], "-v") == 0)
+    verbose = 1;
+  printf("SampleEncoder, temp/humidity and pressure a minute apart\n");
+  for (int s = 0; s < SIGNALS; s++) {
+    make_signal(s);
+    for (unsigned int x = 0; x < sizeof(maxes)/sizeof(maxes[0]); x++)
+    for (unsigned int r = 0; r < sizeof(resyncs)/sizeof(resyncs[0]); r++) {
+      bench_speed(s, maxes[x], resyncs[r], 0);
+      bench_speed(s, maxes[x], resyncs[r], SAMPLE_TENTHS);
+    }
+  }
+  printf("round trips through decompress()\n");
+  for (int s = 0; s < SIGNALS; s++) {
+    make_signal(s);
+    for (unsigned int t = 0; t < sizeof(types); t++)
+    for (unsigned int p = 0; p < sizeof(periods)/sizeof(periods[0]); p++)
+    for (unsigned int x = 0; x < sizeof(maxes)/sizeof(maxes[0]); x++)
+    for (unsigned int r = 0; r < sizeof(resyncs)/sizeof(resyncs[0]); r++)
+    for (unsigned int e = 0; e < sizeof(everies)/sizeof(everies[0]); e++) {
+      if (everies[e] != 1 && (types[t]&(SAMPLE_TH|SAMPLE_P)) != (SAMPLE_TH|SAMPLE_P))
+        continue;
+      trips++;
+      if (!round_trip(s, types[t], periods[p], maxes[x], resyncs[r], everies[e]))
+        bad++;
+    }
+  }
+  printf("  %d of %d round trips bad\n", bad, trips);
+  if (!lost_record(8))
+    bad++;
+  printf("RTC memory word accesses for the sample buffer, a sample a wake, %d byte records\n", RTC_MAX);
+  printf("(the wake's save_info is another %d reads and writes either way)\n", SAVE_INFO_WORDS);
+  if (!bench_rtc(0))
+    bad++;
+  if (!bench_rtc(1))
+    bad++;
+  printf("waking less often while nothing changes - temp, humidity, pressure errors against a sample a minute\n");
+  for (int s = 0; s < SIGNALS; s++) {
+    static const int rate_maxes[] = {60, 240, 480, 960};
+
+    if (s != 0 && s != 1 && s != 5)    // indoors, quiet, nights
+      continue;
+    make_signal(s);
+    for (unsigned int x = 0; x < sizeof(rate_maxes)/sizeof(rate_maxes[0]); x++)
+      if (!bench_rate(s, rate_maxes[x]))
+        bad++;
+  }
+  printf("a sample a minute into RTC memory while the flash is full\n");
+  if (!bench_full(255))
+    bad++;
+  if (!bench_full(RTC_MAX))
+    bad++;
+  printf("pressure in only some samples, a sample a second\n");
+  make_signal(0);
+  for (unsigned int e = 0; e < sizeof(day_everies)/sizeof(day_everies[0]); e++)
+    if (!bench_every(day_everies[e]))
+      bad++;
+  printf("pressure sampled into the LPS25H FIFO, drained a batch a wake\n");
+  for (int d = 0; d < 2; d++) {
+    static const int batches[] = {1, 8, 16, 24, 30};
+
+    for (unsigned int b = 0; b < sizeof(batches)/sizeof(batches[0]); b++)
+      if (!bench_batch(batches[b], d ? 0.15 : 0.05))
+        bad++;
+  }
+  if (!check_time_back())
+    bad++;
+  if (bad) {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
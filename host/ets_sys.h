@@ -0,0 +1,5 @@
+#ifndef HOST_ETS_SYS_H
+#define HOST_ETS_SYS_H
+// host stand-in for the ESP8266 SDK header of the same name - nothing we use lives here
+#include "c_types.h"
+#endif
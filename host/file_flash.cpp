@@ -0,0 +1,117 @@
+/*   
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spi_flash.h"
+#include "flash_sim.h"
+#include "../Flash.h"
+#include "file_flash.h"
+
+#define FILE_COMMAND_NS     2000      // command+address, chip select
+#define FILE_BYTE_NS        400       // 20MHz, 1 bit
+#define FILE_PROGRAM_NS     700000    // tPP typical, per 256 byte program page
+#define FILE_ERASE_NS       45000000  // tSE typical
+
+static void
+charge(FileFlash *f, unsigned long long ns)
+{
+  f->busy_ns += ns;
+  sim_other_ns += ns;
+}
+
+bool
+FileFlash::open(const char *path, unsigned short sectors)
+{
+  unsigned char b[SPI_FLASH_SEC_SIZE];
+
+  close();
+  fp = fopen(path, "w+b");
+  if (!fp)
+    return 0;
+  memset(b, 0xff, sizeof(b));
+  for (int i = 0; i < sectors; i++)
+    fwrite(b, sizeof(b), 1, fp);
+  first = 0;
+  last = sectors-1;
+  reads = writes = erases = 0;
+  busy_ns = 0;
+  return 1;
+}
+
+void
+FileFlash::close()
+{
+  if (fp)
+    fclose(fp);
+  fp = 0;
+}
+
+bool
+FileFlash::check(unsigned int address, int len)
+{
+  if ((address&3) || (len&3) || address+len > (last+1)*(unsigned int)SPI_FLASH_SEC_SIZE) {
+    fprintf(stderr, "file flash: bad access 0x%x %d\n", address, len);
+    abort();
+  }
+  return fp != 0;
+}
+
+bool
+FileFlash::read(unsigned int address, void *p, int len)
+{
+  if (!check(address, len))
+    return 0;
+  reads++;
+  charge(this, FILE_COMMAND_NS+len*FILE_BYTE_NS);
+  fseek(fp, address, SEEK_SET);
+  return (int)fread(p, 1, len, fp) == len;
+}
+
+bool
+FileFlash::write(unsigned int address, const void *p, int len)
+{
+  unsigned char b[SPI_FLASH_SEC_SIZE];
+  const unsigned char *s = (const unsigned char *)p;
+
+  if (!check(address, len) || len > (int)sizeof(b))
+    return 0;
+  writes++;
+  charge(this, ((address+len-1)/256-address/256+1)*(FILE_COMMAND_NS+FILE_PROGRAM_NS)+len*FILE_BYTE_NS);
+  fseek(fp, address, SEEK_SET);
+  if ((int)fread(b, 1, len, fp) != len)
+    return 0;
+  for (int i = 0; i < len; i++)  // NOR - can only clear bits
+    b[i] &= s[i];
+  fseek(fp, address, SEEK_SET);
+  return (int)fwrite(b, 1, len, fp) == len;
+}
+
+bool
+FileFlash::erase(unsigned short sector)
+{
+  unsigned char b[SPI_FLASH_SEC_SIZE];
+
+  if (!check(sector*SPI_FLASH_SEC_SIZE, 0))
+    return 0;
+  erases++;
+  charge(this, FILE_COMMAND_NS+FILE_ERASE_NS);
+  memset(b, 0xff, sizeof(b));
+  fseek(fp, sector*SPI_FLASH_SEC_SIZE, SEEK_SET);
+  return fwrite(b, 1, sizeof(b), fp) == sizeof(b);
+}
@@ -0,0 +1,43 @@
+#ifndef FILE_FLASH_H
+#define FILE_FLASH_H
+/*   
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  a file standing in for an external SPI NOR chip (see SpiNorFlash), with the
+//  same rules as the simulator - erase sets FFs, writes only clear bits, 4 byte
+//  alignment - and its own counters. Time is modelled on a 25 series part on a
+//  20MHz single bit SPI bus and added to the simulator's clock. Include Flash.h first
+//
+#include <stdio.h>
+
+class FileFlash: public FlashDevice {
+public:
+  FileFlash() { fp = 0; }
+  bool open(const char *path, unsigned short sectors);  // creates it blank
+  void close();
+  bool read(unsigned int address, void *p, int len);
+  bool write(unsigned int address, const void *p, int len);
+  bool erase(unsigned short sector);
+
+  unsigned long reads, writes, erases;
+  unsigned long long busy_ns;
+private:
+  FILE *fp;
+  bool check(unsigned int address, int len);
+};
+#endif
@@ -0,0 +1,1114 @@
+/*   
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  benchmarks for HomeFlash running on the flash simulator
+//
+//  every number is in simulated flash operations and modelled flash time, not
+//  host time, so results are repeatable and comparable between changes
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "spi_flash.h"
+#include "flash_sim.h"
+#include "../Flash.h"
+#include "../SampleEncoder.h"
+#include "file_flash.h"
+
+#define RECORD_SIZE   250       // what unload_rtc_buffer() usually hands us
+#define RECORD_BYTES(len) ((len)+((len) > 0x80 ? 2 : 1))  // what one takes in flash, with its length
+#define UPLOAD_SIZE   (8*256-20)  // what setup() asks get_stored_flash_data() for
+#define SECTORS       (FLASH_LAST-FLASH_FIRST+1)
+
+static unsigned long long bytes_written;
+static unsigned long long bytes_read;
+
+static flash_cursor rtc_cursor;   // what the firmware keeps in RTC memory
+static int wear_window = FLASH_WEAR_WINDOW;
+static FileFlash *external;       // the overflow chip, if we have one
+static bool overwrite;            // SetOverwrite()
+
+// every record is a run of the same byte sequence, so uploads can be checked for order,
+// bytes are < 0x80 so a FLASH_GAP stands out
+static unsigned char write_seq, upload_seq;
+static unsigned long order_errors;
+static unsigned long gaps, gap_records;
+static unsigned long gaps_at_least;   // FLASH_GAP_AT_LEAST, a cold boot lost the count
+static int failures;              // checks that didn't hold, main() fails if there were any
+
+//
+//  what a deep sleep does to us - BSS is cleared, the HomeFlash object is
+//  rebuilt from scratch and only the cursor in RTC memory survives
+//
+static void
+reboot(void)
+{
+  flash.SaveCursor(&rtc_cursor);
+  memset((void *)&flash, 0, sizeof(flash));
+  flash._initHomeFlash();
+  flash.SetExternal(external);
+  flash.SetOverwrite(overwrite);
+  flash.SetWearWindow(wear_window);
+  flash.RestoreCursor(&rtc_cursor);
+}
+
+//
+//  a power cycle, or a wake where the cursor didn't survive
+//
+static void
+cold_boot(void)
+{
+  memset((void *)&flash, 0, sizeof(flash));
+  flash._initHomeFlash();
+  flash.SetExternal(external);
+  flash.SetOverwrite(overwrite);
+  flash.SetWearWindow(wear_window);
+}
+
+//
+//  records are 0.5 bytes/sample at 1Hz, so each covers len*2 seconds from record_time
+//
+#define BENCH_START_TIME 500000000   // seconds since 2000, early 2015
+static unsigned int record_time = BENCH_START_TIME;
+
+static bool
+write_record(int len)
+{
+  unsigned char b[FLASH_RECORD_MAX];
+  flash_summary sum;
+
+  for (int i = 0; i < len; i++)
+    b[i] = (write_seq+i)&0x7f;
+  SummaryClear(&sum);
+  sum.samples = len*2;
+  sum.first_time = record_time;
+  sum.last_time = record_time+len*2-1;
+  sum.min_temp = sum.max_temp = 20;
+  sum.min_humidity = sum.max_humidity = 50;
+  sum.min_pressure = sum.max_pressure = 1013;
+  if (!flash.WriteRecord(&b[0], len, &sum))
+    return 0;
+  write_seq += len;
+  bytes_written += len;
+  record_time += len*2;
+  return 1;
+}
+
+//
+//  upload everything, a buffer at a time, the way a run of successful button
+//  presses would
+//
+static void
+drain(flash_sim_stats *load, flash_sim_stats *commit, unsigned long *calls)
+{
+  static unsigned char b[UPLOAD_SIZE];
+  bool resync = 0;
+
+  for (;;) {
+    flash_sim_stats s = sim_stats;
+    unsigned int l = flash.LoadBuffer(&b[0], sizeof(b));
+    flash_sim_stats d = sim_delta(s);
+
+    bytes_read += l&~FLASH_END_MARKER;
+    for (unsigned int i = 0; i < (l&~FLASH_END_MARKER); i++)
+    if (b[i] == FLASH_GAP) {  // evicted records, skip what they would have held
+      unsigned int n = (b[i+1]<<8)|b[i+2];
+
+      gaps++;
+      if (n&FLASH_GAP_AT_LEAST) {  // there were more, the next record says where we've got to
+        gaps_at_least++;
+        n &= ~FLASH_GAP_AT_LEAST;
+        resync = 1;
+      }
+      gap_records += n;
+      upload_seq += n*RECORD_SIZE;
+      bytes_read -= 3;
+      i += 2;
+    } else {
+      for (int k = 0; resync && k < 0x80 && b[i] != (upload_seq&0x7f); k++)
+        upload_seq += RECORD_SIZE;
+      resync = 0;
+      if (b[i] != (upload_seq++&0x7f))
+        order_errors++;
+    }
+    if (load)
+      sim_add(load, d);
+    s = sim_stats;
+    flash.CommitBuffer();
+    d = sim_delta(s);
+    if (commit)
+      sim_add(commit, d);
+    if (calls)
+      (*calls)++;
+    if ((l&FLASH_END_MARKER) || !(l&~FLASH_END_MARKER))
+      break;
+  }
+}
+
+//
+//  fill the ring to 'pages' pages worth of records
+//
+static void
+fill(int pages)
+{
+  int per_page = (SPI_FLASH_SEC_SIZE-sizeof(flash_page_header))/RECORD_BYTES(RECORD_SIZE);
+
+  for (int i = 0; i < pages*per_page; i++)
+    if (!write_record(RECORD_SIZE))
+      break;
+}
+
+static void
+bench_cold_boot(void)
+{
+  static const int fills[] = {0, 1, SECTORS/2, SECTORS-1};
+
+  printf("\ncold boot - first WriteRecord() after power up, ring holding N pages (%d sectors)\n", SECTORS);
+  for (unsigned int i = 0; i < sizeof(fills)/sizeof(fills[0]); i++) {
+    char label[64];
+
+    sim_reset();
+    cold_boot();
+    fill(fills[i]);
+    cold_boot();
+    flash_sim_stats s = sim_stats;
+    write_record(RECORD_SIZE);
+    snprintf(label, sizeof(label), "  %3d pages", fills[i]);
+    sim_print(label, sim_delta(s));
+  }
+
+  // same again but after the ring has wrapped
+  sim_reset();
+  cold_boot();
+  fill(SECTORS/2);
+  drain(0, 0, 0);
+  fill(SECTORS/2+SECTORS/4);
+  cold_boot();
+  flash_sim_stats s = sim_stats;
+  write_record(RECORD_SIZE);
+  sim_print("  wrapped", sim_delta(s));
+}
+
+//
+//  cold boot page discovery, header reads made by DoInit() against a linear walk
+//  of every header, for rings holding runs of pages that start at every position
+//
+static unsigned long header_reads;
+
+static void
+count_headers(uint32 addr, uint32 size)
+{
+  if ((addr%SPI_FLASH_SEC_SIZE) == 0 && size == sizeof(flash_page_header))
+    header_reads++;
+}
+
+static unsigned int
+pos_address(int pos)
+{
+  return (FLASH_LAST-(pos%SECTORS))*SPI_FLASH_SEC_SIZE;
+}
+
+static void
+linear_walk(unsigned int *first, unsigned int *current, unsigned int *next_ref)
+{
+  unsigned int refs[SECTORS];
+  int newest = -1;
+
+  for (int pos = 0; pos < SECTORS; pos++) {
+    flash_page_header h;
+
+    spi_flash_read(pos_address(pos), (uint32 *)&h, sizeof(h));
+    refs[pos] = h.magic == FLASH_MAGIC ? h.ref&~FLASH_REF_EVICTED : 0xffffffff;
+    if (refs[pos] != 0xffffffff && (newest < 0 || refs[pos] > refs[newest]))
+      newest = pos;
+  }
+  int oldest = newest;
+  while (refs[(oldest+SECTORS-1)%SECTORS] == refs[oldest]-1 && (oldest+SECTORS-1)%SECTORS != newest)
+    oldest = (oldest+SECTORS-1)%SECTORS;
+  *first = pos_address(oldest);
+  *current = pos_address(newest);
+  *next_ref = refs[newest]+1;
+}
+
+static void
+bench_init_search(void)
+{
+  static const int runs[] = {1, 2, 5, SECTORS/4, SECTORS/2, SECTORS-1, SECTORS};
+
+  printf("\ncold boot page discovery - header reads, run of L pages starting at every position\n");
+  sim_read_hook = count_headers;
+  for (unsigned int i = 0; i < sizeof(runs)/sizeof(runs[0]); i++) {
+    unsigned long bin_total = 0, bin_max = 0, lin_total = 0, bad = 0;
+
+    for (int start = 0; start < SECTORS; start++) {
+      unsigned int first, current, next_ref;
+
+      sim_reset();
+      for (int k = 0; k < runs[i]; k++) {
+        flash_page_header h;
+
+        h.magic = FLASH_MAGIC;
+        h.ref = 1000+k;
+        h.erases = 1;
+        memcpy(&sim_image[pos_address(start+k)], &h, sizeof(h));
+      }
+      cold_boot();
+      header_reads = 0;
+      flash.internal.GetCurrentPage();
+      bin_total += header_reads;
+      if (header_reads > bin_max)
+        bin_max = header_reads;
+
+      header_reads = 0;
+      linear_walk(&first, &current, &next_ref);
+      lin_total += header_reads;
+      if (first != flash.internal.GetFirstPage() || current != flash.internal.GetCurrentPage() || next_ref != flash.internal.GetNextRef())
+        bad++;
+    }
+    bool fail = bad || bin_max > lin_total/SECTORS;  // nor may a short run cost more than the walk
+
+    printf("  L=%2d  DoInit mean %5.1f max %2lu   linear walk %5.1f   mismatches %lu%s\n", runs[i],
+      (double)bin_total/SECTORS, bin_max, (double)lin_total/SECTORS, bad, fail ? " - FAILED" : "");
+    failures += fail;
+  }
+  sim_read_hook = 0;
+}
+
+//
+//  EraseSector() only has to read a sector to see if it's blank when it doesn't
+//  already know
+//
+static void
+bench_erase_verify(void)
+{
+  flash_sim_stats s;
+
+  printf("\nerase verify - reads made by Erase() and EraseAhead() with and without sector state\n");
+  sim_reset();
+  cold_boot();
+  s = sim_stats;
+  flash.Erase();
+  sim_print("  Erase(), blank, unknown", sim_delta(s));
+  s = sim_stats;
+  flash.Erase();
+  sim_print("  Erase(), blank, known", sim_delta(s));
+
+  // a ring that's been round once, then has half of it uploaded
+  for (int known = 1; known >= 0; known--) {
+    sim_reset();
+    cold_boot();
+    fill(SECTORS-1);
+    drain(0, 0, 0);
+    flash.EraseAhead(~0UL);
+    fill(SECTORS/2);
+    drain(0, 0, 0);
+    if (known) {
+      reboot();
+    } else {
+      cold_boot();
+      flash.internal.GetCurrentPage();
+    }
+    s = sim_stats;
+    flash.EraseAhead(~0UL);
+    sim_print(known ? "  EraseAhead(), known" : "  EraseAhead(), power up", sim_delta(s));
+  }
+}
+
+static void
+bench_write(void)
+{
+  static const int sizes[] = {16, 64, 128, RECORD_SIZE};
+
+  printf("\nper record write - WriteRecord() with DoInit() already done, averaged over a full ring\n");
+  for (unsigned int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+    char label[64];
+    unsigned long n = 0;
+
+    sim_reset();
+    cold_boot();
+    write_record(sizes[i]);
+    flash_sim_stats s = sim_stats;
+    while (write_record(sizes[i]))
+      n++;
+    snprintf(label, sizeof(label), "  %3d byte records", sizes[i]);
+    sim_print(label, sim_delta(s), n);
+  }
+
+  printf("\nper wake write - reboot then WriteRecord(), as unload_rtc_buffer() does on a deep sleep wake\n");
+  for (int trust = 1; trust >= 0; trust--) {
+    unsigned long n = 0;
+
+    sim_reset();
+    cold_boot();
+    write_record(RECORD_SIZE);
+    flash_sim_stats s = sim_stats;
+    for (;;) {
+      if (trust) {
+        reboot();
+      } else {
+        cold_boot();
+      }
+      if (!write_record(RECORD_SIZE))
+        break;
+      n++;
+    }
+    sim_print(trust ? "  RTC cursor" : "  no cursor (DoInit)", sim_delta(s), n);
+  }
+
+  // a trashed cursor must be noticed, and DoInit() must end up in the same place
+  {
+    unsigned int first, current;
+    int rejected = 0, same = 0;
+
+    sim_reset();
+    cold_boot();
+    fill(SECTORS/2);
+    first = flash.internal.GetFirstPage();
+    current = flash.internal.GetCurrentPage();
+    flash.SaveCursor(&rtc_cursor);
+    for (int i = 0; i < (int)sizeof(rtc_cursor); i++) {
+      flash_cursor c = rtc_cursor;
+
+      ((unsigned char *)&c)[i] ^= 0x10;
+      cold_boot();
+      if (!flash.RestoreCursor(&c))
+        rejected++;
+      if (flash.internal.GetFirstPage() == first && flash.internal.GetCurrentPage() == current)
+        same++;
+    }
+    printf("  corrupted cursors rejected %d/%d, position recovered %d/%d\n", rejected, (int)sizeof(rtc_cursor), same, (int)sizeof(rtc_cursor));
+  }
+}
+
+static void
+bench_upload(void)
+{
+  flash_sim_stats load, commit;
+  unsigned long calls = 0;
+
+  printf("\nfull drain upload - %d byte LoadBuffer()+CommitBuffer() until empty, ring full\n", UPLOAD_SIZE);
+  sim_reset();
+  cold_boot();
+  bytes_written = 0;
+  fill(SECTORS);
+  reboot();
+  memset(&load, 0, sizeof(load));
+  memset(&commit, 0, sizeof(commit));
+  bytes_read = 0;
+  drain(&load, &commit, &calls);
+  printf("  %lu calls, %llu of %llu bytes uploaded\n", calls, bytes_read, bytes_written);
+  sim_print("  LoadBuffer (per call)", load, calls);
+  sim_print("  CommitBuffer (per call)", commit, calls);
+  sim_print("  LoadBuffer (total)", load);
+  sim_print("  CommitBuffer (total)", commit);
+
+  // what FlashStream does - size it, then send it a record at a time in one request
+  printf("\nstreamed upload - Pending() then ReadRecord() to the end and one CommitBuffer(), ring full\n");
+  sim_reset();
+  cold_boot();
+  bytes_written = 0;
+  write_seq = upload_seq = 0;
+  order_errors = 0;
+  fill(SECTORS);
+  reboot();
+  {
+    flash_sim_stats s = sim_stats;
+    unsigned int pending = flash.Pending();
+    flash_sim_stats d = sim_delta(s);
+    unsigned long records = 0, streamed = 0;
+    const unsigned char *b;
+    int len;
+
+    sim_print("  Pending", d);
+    s = sim_stats;
+    while ((b = flash.ReadRecord(&len)) != 0) {
+      for (int i = 0; i < len; i++)
+        if (b[i] != (upload_seq++&0x7f))
+          order_errors++;
+      streamed += len;
+      records++;
+    }
+    sim_print("  ReadRecord (total)", sim_delta(s));
+    s = sim_stats;
+    flash.CommitBuffer();
+    sim_print("  CommitBuffer", sim_delta(s));
+    printf("  %lu records, %lu of %llu bytes streamed, Pending() said %u, %lu out of order\n", 
+      records, streamed, bytes_written, pending, order_errors);
+  }
+}
+
+//
+//  samples of 2-4 bytes collected in RTC memory and flushed as a record - as the sketch 
+//  used to, when there might not be room for another in the 255 byte buffer, vs flushing 
+//  when the record would reach ProgramRoom() and padding it out to that with nulls so that
+//  each record is one program operation. Filling the ring from empty, per KB of samples
+//
+static void
+bench_coalesce(void)
+{
+  printf("\nflushing samples from RTC memory, per KB of samples until the ring is full\n");
+  for (int aligned = 0; aligned <= 1; aligned++) {
+    unsigned long data = 0, pad = 0, records = 0;
+    int boff = 0, room;
+
+    sim_reset();
+    cold_boot();
+    flash_sim_stats s = sim_stats;
+    room = aligned ? flash.ProgramRoom(255) : 255;
+    for (unsigned long i = 0; ; i++) {
+      boff += 2+(i%3 == 0)+(i%7 == 0);
+      if (boff <= room-4)
+        continue;
+      if (!write_record(aligned ? room : boff))
+        break;
+      data += boff;
+      pad += aligned ? room-boff : 0;
+      records++;
+      boff = 0;
+      room = aligned ? flash.ProgramRoom(255) : 255;
+    }
+    sim_print(aligned ? "  at ProgramRoom(), padded" : "  at 255 bytes", sim_delta(s), data/1024);
+    printf("    %lu records, %lu KB of samples, %.1f%% padding\n", records, data/1024, 100.0*pad/(data+pad));
+  }
+}
+
+//
+//  a month of a room, a sample a minute as the sketch takes them by default - temperature
+//  and humidity follow the heating round the day, pressure wanders with the weather, all 
+//  with a little sensor noise and stored as the sketch has them: whole degrees C, % and hPa
+//
+#define TRACE_SAMPLES (30*24*60)
+#define TRACE_START (5904UL*24*60*60)   // 1 March 2016, in seconds since 2000
+
+static unsigned int trace_seed;
+
+static double
+trace_noise(double range)
+{
+  trace_seed = trace_seed*1103515245+12345;
+  return range*(((trace_seed>>8)&0xffff)/32768.0-1.0);
+}
+
+static void
+trace_sample(int minute, int *temp, int *humidity, int *pressure, int scale = 1)  // scale 10 for tenths
+{
+  static double weather;
+  double day = 2*M_PI*((minute+16*60)%(24*60))/(24*60);
+
+  if (!minute) {
+    trace_seed = 1;
+    weather = 0;
+  }
+  weather += trace_noise(0.02);
+  *temp = (int)floor((19.5+2.5*sin(day)+trace_noise(0.3))*scale+0.5);
+  *humidity = (int)floor((45-6*sin(day)+trace_noise(0.6))*scale+0.5);
+  *pressure = (int)floor((1013+8*sin(2*M_PI*minute/(5*24*60))+weather+trace_noise(0.3))*scale+0.5);
+}
+
+//
+//  where the previous record format (FLASH_MAGIC_V3 pages - 1 byte lengths, at most 255 bytes,
+//  4 byte aligned) would have put the same records, sized by the ProgramRoom() it had
+//
+static unsigned int v3_pages, v3_offset;
+
+static int
+v3_room(void)
+{
+  unsigned int o = v3_offset, end;
+
+  if (o+FLASH_PROGRAM_PAGE/4 > FLASH_PAGE_END)
+    o = sizeof(flash_page_header);
+  end = (o|(FLASH_PROGRAM_PAGE-1))+1;
+  if (end-o < FLASH_PROGRAM_PAGE/4)
+    end += FLASH_PROGRAM_PAGE;
+  if (end > FLASH_PAGE_END)
+    end = FLASH_PAGE_END;
+  return end-o-1 > 255 ? 255 : end-o-1;
+}
+
+static void
+v3_write(int len)
+{
+  unsigned int sz = (1+len+3)&~3;
+
+  if (v3_offset+sz > FLASH_PAGE_END) {
+    v3_pages++;
+    v3_offset = sizeof(flash_page_header);
+  }
+  v3_offset += sz;
+}
+
+//
+//  the sketch's compressor - SampleEncoder - with humidity and pressure sensors and a set
+//  RTC, into a buffer that's flushed to flash the way unload_rtc_buffer() does, padded out
+//  to flush_at with nulls. max is the most a record can hold, the sketch's is RTC_BUFF_SIZE
+//
+static class TraceSink: public SampleSink {
+public:
+  void write(int offset, const unsigned char *p, int len) { memcpy(&b[offset], p, len); }
+  unsigned char read(int offset) { return b[offset]; }
+  int flush(int len);
+  void now(time_stamp *t);
+  int room(void) { return v3 ? v3_room() : flash.ProgramRoom(max); }
+
+  unsigned char b[FLASH_RECORD_MAX];
+  int max;
+  bool v3;              // write to the v3_ model, not flash
+  int minute;           // of the trace
+  flash_summary sum;    // of the record so far
+  unsigned long records, nulls, flash_bytes;
+  unsigned char *copy;  // everything we wrote, in order
+} enc;
+static sample_encoder_state enc_state;
+static SampleEncoder encoder(&enc_state, &enc, sizeof(enc.b));
+
+#define TRACE_COPY (SECTORS*SPI_FLASH_SEC_SIZE)
+
+int
+TraceSink::flush(int len)
+{
+  while (len < enc_state.flush_at) {
+    b[len++] = 0xf7;
+    nulls++;
+  }
+  if (v3) {
+    v3_write(len);
+  } else
+  if (!flash.WriteRecord(&b[0], len, &sum)) {
+    printf("  trace: flash full\n");
+  }
+  SummaryClear(&sum);
+  memcpy(copy+flash_bytes, &b[0], len);
+  flash_bytes += len;
+  records++;
+  return room();
+}
+
+void
+TraceSink::now(time_stamp *t)
+{
+  t->valid = 1;
+  t->year = 2016;     // the trace starts on 1 March 2016
+  t->month = 3;
+  t->day = 1+minute/(24*60);
+  t->hour = minute/60%24;
+  t->minute = minute%60;
+  t->second = 0;
+}
+
+static void
+enc_sample(int temp, int humidity, int pressure, int scale = 1)
+{
+  int t = (temp+scale/2)/scale, h = (humidity+scale/2)/scale, p = (pressure+scale/2)/scale;  // the summary's in whole units
+
+  encoder.Sample(temp, humidity, pressure);   // a record it flushes first doesn't have it
+  enc.sum.samples++;
+  if (!enc.sum.first_time)
+    enc.sum.first_time = TRACE_START+enc.minute*60;
+  enc.sum.last_time = TRACE_START+enc.minute*60;
+  if (t < enc.sum.min_temp)
+    enc.sum.min_temp = t;
+  if (t > enc.sum.max_temp)
+    enc.sum.max_temp = t;
+  if (h < enc.sum.min_humidity)
+    enc.sum.min_humidity = h;
+  if (h > enc.sum.max_humidity)
+    enc.sum.max_humidity = h;
+  if (p < enc.sum.min_pressure)
+    enc.sum.min_pressure = p;
+  if (p > enc.sum.max_pressure)
+    enc.sum.max_pressure = p;
+  enc.minute++;
+}
+
+//
+//  a month of the trace through the sketch's compressor into the previous record format vs 
+//  this one - bytes of flash per sample, counting headers, footers, lengths and padding - 
+//  with the sketch's old 255 byte RTC buffer, the one it has now that uses the rest of RTC
+//  memory, and with a writer that could make longer records. Records that carry on from the
+//  one before (1111 1001) save a time signature and a full sample each, a day's worth of
+//  that is how much they save at a sample a minute. The same trace in tenths (1111 1010)
+//  shows what the finer samples cost. Then read the flash back to check we
+//  get what was written, and that pages in the old format are still read. The run the
+//  sketch does - RTC_BUFF_SIZE, SAMPLE_RESYNC - is left in trace.img for flash_dump
+//
+#define RTC_BUFF_SIZE 316   // the sketch's - RTC_USER_SIZE less the 8266's sizeof(rtc_info)
+#define SAMPLE_RESYNC 8
+
+static void
+bench_trace(void)
+{
+  static const struct {
+    bool v3;
+    int max;
+    int resync;
+    int scale;          // 10 for tenths
+    const char *label;
+  } runs[] = {
+    {1, 255, 1, 1, "  FLASH_MAGIC_V3, 255 max"},
+    {0, 255, 1, 1, "  packed, 255 max"},
+    {0, RTC_BUFF_SIZE, 1, 1, "  packed, 316 max"},
+    {0, RTC_BUFF_SIZE, SAMPLE_RESYNC, 1, "  ... resync every 8"},
+    {0, RTC_BUFF_SIZE, 64, 1, "  ... resync every 64"},
+    {0, RTC_BUFF_SIZE, 1, 10, "  ... in tenths"},
+    {0, RTC_BUFF_SIZE, SAMPLE_RESYNC, 10, "  ... in tenths, resync 8"},
+    {0, 1024, 1, 1, "  packed, 1024 max"},
+    {0, 1024, SAMPLE_RESYNC, 1, "  ... resync every 8"},
+    {0, FLASH_RECORD_MAX, 1, 1, "  packed, FLASH_RECORD_MAX"},
+  };
+  static unsigned char copy[TRACE_COPY];
+  double resync_used = 0;   // bytes/sample of the last run that resynced every record
+
+  printf("\na month of a sample a minute through the sketch's compressor, bytes of flash per sample\n");
+  wear_window = 1;  // so that refs count the pages we used
+  for (unsigned int i = 0; i < sizeof(runs)/sizeof(runs[0]); i++) {
+    flash_sim_stats s;
+    flash_cursor c;
+    unsigned long used, back = 0, bad = 0;
+    const unsigned char *b;
+    int len;
+
+    sim_reset();
+    cold_boot();
+    enc.v3 = runs[i].v3;
+    enc.max = runs[i].max;
+    enc.minute = 0;
+    enc.records = enc.nulls = enc.flash_bytes = 0;
+    enc.copy = &copy[0];
+    v3_pages = 1;
+    v3_offset = sizeof(flash_page_header);
+    SummaryClear(&enc.sum);
+    encoder.Init(SAMPLE_TH|SAMPLE_P|(runs[i].scale == 10 ? SAMPLE_TENTHS : 0), 60, enc.room(), runs[i].resync);
+    encoder.TimeSignature();
+    s = sim_stats;
+    for (int m = 0; m < TRACE_SAMPLES; m++) {
+      int t, h, p;
+
+      trace_sample(m, &t, &h, &p, runs[i].scale);
+      enc_sample(t, h, p, runs[i].scale);
+    }
+    if (enc.v3) {
+      used = (v3_pages-1)*SPI_FLASH_SEC_SIZE+v3_offset;
+    } else {
+      flash.SaveCursor(&c);
+      used = (flash.internal.GetNextRef()-1)*SPI_FLASH_SEC_SIZE+(c.internal.current_page_offset&~(FLASH_CURSOR_FULL|FLASH_CURSOR_OLD));
+    }
+    printf("%-28s %5.3f bytes/sample, %5lu records of %6.1f bytes, %4.1f%% nulls", runs[i].label,
+      (double)used/TRACE_SAMPLES, enc.records, (double)enc.flash_bytes/enc.records, 100.0*enc.nulls/enc.flash_bytes);
+    if (enc.v3) {
+      printf("\n");
+      continue;
+    }
+    printf(", %5.2f pp per KB", (double)sim_delta(s).program_pages*1024/enc.flash_bytes);
+    if (runs[i].scale == 10 && runs[i].resync == 1)
+      printf(", %4.0f bytes/day more", ((double)used/TRACE_SAMPLES-resync_used)*24*60);
+    if (runs[i].resync == 1)
+      resync_used = (double)used/TRACE_SAMPLES;
+    else
+      printf(", %4.0f bytes/day less", (resync_used-(double)used/TRACE_SAMPLES)*24*60);
+    printf("\n");
+    reboot();
+    while ((b = flash.ReadRecord(&len)) != 0) {
+      if (back+len > enc.flash_bytes || memcmp(b, &copy[back], len) != 0)
+        bad++;
+      back += len;
+    }
+    if (back != enc.flash_bytes || bad)
+      printf("    read back %lu of %lu bytes, %lu bad pieces\n", back, enc.flash_bytes, bad);
+    if (enc.max == RTC_BUFF_SIZE && runs[i].resync == SAMPLE_RESYNC && runs[i].scale == 1)   // what a unit would have in it, for trying flash_dump on
+      sim_save("trace.img");
+  }
+  wear_window = FLASH_WEAR_WINDOW;
+
+  // some FLASH_MAGIC_V3 pages as the previous firmware left them, then new records after them
+  sim_reset();
+  write_seq = upload_seq = 0;
+  order_errors = 0;
+  bytes_written = bytes_read = 0;
+  for (int p = 0; p < 3; p++) {
+    union {
+      unsigned char b[SPI_FLASH_SEC_SIZE];
+      unsigned int align;
+    } page;
+    flash_page_header *h = (flash_page_header *)&page.b[0];
+    unsigned int o = sizeof(*h);
+
+    memset(&page.b[0], 0xff, sizeof(page.b));
+    h->magic = FLASH_MAGIC_V3;
+    h->ref = p;
+    h->erases = 1;
+    while (o+((1+RECORD_SIZE+3)&~3) <= FLASH_PAGE_END) {
+      page.b[o] = RECORD_SIZE-1;
+      for (int i = 0; i < RECORD_SIZE; i++)
+        page.b[o+1+i] = (write_seq+i)&0x7f;
+      write_seq += RECORD_SIZE;
+      bytes_written += RECORD_SIZE;
+      o += (1+RECORD_SIZE+3)&~3;
+    }
+    spi_flash_write((FLASH_LAST-p)*SPI_FLASH_SEC_SIZE, &page.align, sizeof(page.b));
+  }
+  cold_boot();
+  flash.internal.GetCurrentPage();
+  reboot();   // the cursor has to remember the current page is an old one
+  for (int i = 0; i < 40; i++)
+    write_record(i&1 ? RECORD_SIZE : 100);
+  reboot();
+  drain(0, 0, 0);
+  printf("  3 FLASH_MAGIC_V3 pages then 40 new records: %llu of %llu bytes read back, %lu out of order\n",
+    bytes_read, bytes_written, order_errors);
+}
+
+//
+//  "give me the data from time t" - Seek() using the page footers vs reading records
+//  from the oldest until we get to it
+//
+static void
+bench_seek(void)
+{
+  static const int percent[] = {1, 25, 50, 75, 99};
+  flash_sim_stats seek, walk;
+  unsigned long records, bad = 0, n = sizeof(percent)/sizeof(percent[0]);
+
+  printf("\nseek to a time, ring nearly full of %d byte records, Seek() vs reading from the oldest\n", RECORD_SIZE);
+  sim_reset();
+  cold_boot();
+  record_time = BENCH_START_TIME;
+  bytes_written = 0;
+  fill(SECTORS-1);
+  records = bytes_written/RECORD_SIZE;
+  memset(&seek, 0, sizeof(seek));
+  memset(&walk, 0, sizeof(walk));
+  for (unsigned int i = 0; i < sizeof(percent)/sizeof(percent[0]); i++) {
+    unsigned int t = BENCH_START_TIME+(record_time-BENCH_START_TIME)/100*percent[i];
+    unsigned long at, want = (t-BENCH_START_TIME)/(RECORD_SIZE*2);
+    flash_sim_stats s;
+    int len;
+
+    reboot();
+    s = sim_stats;
+    flash.Seek(t, t+60*60);
+    sim_add(&seek, sim_delta(s));
+    at = records-flash.Pending()/RECORD_SIZE;  // the record we're at
+    if (at > want || want-at >= (FLASH_PAGE_END-sizeof(flash_page_header))/RECORD_BYTES(RECORD_SIZE))
+      bad++;  // not in the page that holds t
+    flash.UnCommitBuffer();
+
+    reboot();
+    s = sim_stats;
+    for (at = 0; at < want && flash.ReadRecord(&len); at++)
+      ;
+    sim_add(&walk, sim_delta(s));
+    flash.UnCommitBuffer();
+  }
+  sim_print("  Seek()", seek, n);
+  sim_print("  ReadRecord() from oldest", walk, n);
+  printf("  %lu records, %lu seeks landed on the wrong page\n", records, bad);
+}
+
+//
+//  a month of 1Hz sampling - samples go into RTC memory, every RECORD_SIZE
+//  bytes a wake flushes them into flash, once a day everything is uploaded,
+//  every other wake gives EraseAhead() its budget before going back to sleep
+//
+static void
+bench_month(double bytes_per_sample)
+{
+  const unsigned long wakes = 30UL*24*60*60;
+  double rtc = 0;
+  unsigned long flushes = 0, dropped = 0, uploads = 0, calls = 0;
+  unsigned long max_wear = 0, total_wear = 0;
+  flash_sim_stats flush, load, commit, background, s;
+
+  printf("\none month of 1Hz samples at %.2f bytes/sample, daily upload\n", bytes_per_sample);
+  sim_reset();
+  cold_boot();
+  memset(&flush, 0, sizeof(flush));
+  memset(&load, 0, sizeof(load));
+  memset(&commit, 0, sizeof(commit));
+  memset(&background, 0, sizeof(background));
+  bytes_read = bytes_written = 0;
+  for (unsigned long t = 0; t < wakes; t++) {
+    reboot();
+    rtc += bytes_per_sample;
+    if (rtc >= RECORD_SIZE) {
+      rtc -= RECORD_SIZE;
+      s = sim_stats;
+      if (!write_record(RECORD_SIZE))
+        dropped++;
+      sim_add(&flush, sim_delta(s));
+      flushes++;
+    } else
+    if ((t%(24*60*60)) == 24*60*60-1) {
+      drain(&load, &commit, &calls);
+      uploads++;
+    } else {
+      s = sim_stats;
+      flash.EraseAhead(FLASH_ERASE_BUDGET);
+      sim_add(&background, sim_delta(s));
+    }
+  }
+  for (int s = FLASH_FIRST; s <= FLASH_LAST; s++) {
+    total_wear += sim_erase_count[s];
+    if (sim_erase_count[s] > max_wear)
+      max_wear = sim_erase_count[s];
+  }
+  sim_print("  per wake", sim_stats, wakes);
+  sim_print("  per flush wake", flush, flushes);
+  sim_print("  per upload, LoadBuffer", load, uploads);
+  sim_print("  per upload, CommitBuffer", commit, uploads);
+  sim_print("  background, per wake", background, wakes-flushes-uploads);
+  printf("  erase time: flush wakes %.1f mS, uploads %.1f mS, background %.1f mS\n",
+    flush.erases*SIM_ERASE_NS/1e6, (load.erases+commit.erases)*SIM_ERASE_NS/1e6, background.erases*SIM_ERASE_NS/1e6);
+  printf("  %lu flushes, %lu dropped, %llu bytes written, %llu uploaded\n", flushes, dropped, bytes_written, bytes_read);
+  printf("  erases %lu, per sector mean %.1f max %lu\n", sim_stats.erases, (double)total_wear/SECTORS, max_wear);
+}
+
+//
+//  years of use - a page of records a day uploaded daily, sometimes with the flash
+//  erased every so often (a reflash with FLASH_ERASE, a factory reset) which used to
+//  restart the ring at FLASH_LAST each time. 'preworn' starts every 5th sector off
+//  with that many erases already. Every week we check that a cold boot finds the
+//  same ring, holes and all
+//
+static void
+bench_wear_run(int window, int per_day, int erase_every, int preworn, int days)
+{
+  flash_wear_stats w;
+  unsigned long min = ~0UL, max = 0, total = 0, bad = 0;
+  double sd = 0;
+  char label[80];
+
+  wear_window = window;
+  sim_reset();
+  for (int s = FLASH_FIRST; preworn && s <= FLASH_LAST; s += 5) {
+    unsigned int e = preworn;
+
+    memcpy(&sim_image[s*SPI_FLASH_SEC_SIZE+offsetof(flash_page_header, erases)], &e, sizeof(e));
+    sim_erase_count[s] = preworn;
+  }
+  cold_boot();
+  bytes_read = bytes_written = 0;
+  for (int day = 0; day < days; day++) {
+    for (int i = 0; i < per_day; i++) {
+      write_record(RECORD_SIZE);
+      reboot();
+      flash.EraseAhead(FLASH_ERASE_BUDGET);
+    }
+    drain(0, 0, 0);
+    if (erase_every && (day%erase_every) == erase_every-1) {
+      flash.Erase();
+      reboot();
+    }
+    if ((day%7) == 6) {
+      unsigned int first = flash.internal.GetFirstPage(), current = flash.internal.GetCurrentPage(), ref = flash.internal.GetNextRef();
+
+      flash.SaveCursor(&rtc_cursor);
+      cold_boot();
+      if (first != flash.internal.GetFirstPage() || current != flash.internal.GetCurrentPage() || ref != flash.internal.GetNextRef())
+        bad++;
+      flash.RestoreCursor(&rtc_cursor);
+    }
+  }
+  for (int s = FLASH_FIRST; s <= FLASH_LAST; s++) {
+    total += sim_erase_count[s];
+    if (sim_erase_count[s] < min)
+      min = sim_erase_count[s];
+    if (sim_erase_count[s] > max)
+      max = sim_erase_count[s];
+  }
+  for (int s = FLASH_FIRST; s <= FLASH_LAST; s++)
+    sd += (sim_erase_count[s]-(double)total/SECTORS)*(sim_erase_count[s]-(double)total/SECTORS);
+  flash.internal.GetWearStats(&w);
+  snprintf(label, sizeof(label), "%s, %3d records/day, erase every %2d days, preworn %3d", 
+    window > 1 ? "leveled" : "plain  ", per_day, erase_every, preworn);
+  printf("  %s: erases min %4lu mean %6.1f max %4lu sd %6.1f  headers min %4u max %4u uncounted %2u  %s%s\n", label,
+    min, (double)total/SECTORS, max, sqrt(sd/SECTORS), w.min, w.max, w.uncounted,
+    bytes_read == bytes_written ? "" : "LOST DATA ", bad ? "BAD COLD BOOT" : "");
+}
+
+static void
+bench_wear(void)
+{
+  static const struct {
+    int per_day, erase_every, preworn;
+  } runs[] = {{16, 0, 0}, {16, 7, 0}, {16, 30, 0}, {160, 30, 0}, {16, 0, 100}};
+  int years = 5;
+
+  printf("\nwear over %d years, daily upload, plain ring vs wear window %d\n", years, FLASH_WEAR_WINDOW);
+  for (unsigned int i = 0; i < sizeof(runs)/sizeof(runs[0]); i++) {
+    bench_wear_run(1, runs[i].per_day, runs[i].erase_every, runs[i].preworn, years*365);
+    bench_wear_run(FLASH_WEAR_WINDOW, runs[i].per_day, runs[i].erase_every, runs[i].preworn, years*365);
+  }
+  wear_window = FLASH_WEAR_WINDOW;
+}
+
+//
+//  a long spell without uploads at 0.5 bytes/sample - the internal ring fills in about 
+//  4 days, after that records are dropped unless there's an external chip to overflow 
+//  into. Then daily uploads resume for a week and we check that what came back was 
+//  everything we kept, once, in order. The cursor is lost halfway through the outage
+//
+#define EXTERNAL_SECTORS 256      // a 1M byte part
+
+static void
+bench_overflow_run(FileFlash *ext, int offline)
+{
+  const int per_day = 24*60*60/2/RECORD_SIZE;
+  unsigned long dropped = 0, calls = 0;
+  flash_sim_stats load, commit;
+
+  memset(&load, 0, sizeof(load));
+  memset(&commit, 0, sizeof(commit));
+  sim_reset();
+  external = ext;
+  if (ext)
+    ext->open("external.img", EXTERNAL_SECTORS);
+  cold_boot();
+  bytes_read = bytes_written = 0;
+  write_seq = upload_seq = 0;
+  order_errors = gaps = gap_records = gaps_at_least = 0;
+  for (int day = 0; day < offline+7; day++) {
+    for (int i = 0; i < per_day; i++) {
+      if (!write_record(RECORD_SIZE))
+        dropped++;
+      reboot();
+      flash.EraseAhead(FLASH_ERASE_BUDGET);
+    }
+    if (day == offline/2)
+      cold_boot();
+    if (day >= offline)
+      drain(&load, &commit, &calls);
+  }
+  unsigned long lost = (bytes_written-bytes_read)/RECORD_SIZE;
+  bool bad = order_errors != 0;
+
+  printf("  %s %2d days offline: %5lu dropped, %8llu bytes written, %8llu uploaded",
+    ext ? "external," : "internal,", offline, dropped, bytes_written, bytes_read);
+  if (overwrite) {  // the gaps have to add up to what we lost, or a lower bound on it after a cold boot
+    printf(", %lu lost, %lu gaps say %s%lu", lost, gaps, gaps_at_least ? "at least " : "", gap_records);
+    bad |= gaps_at_least ? gap_records > lost : gap_records != lost;
+    bad |= lost && !gaps;
+  }
+  if (ext)
+    printf(", external reads %lu writes %lu erases %lu busy %.1f S", ext->reads, ext->writes, ext->erases, ext->busy_ns/1e9);
+  if (order_errors)
+    printf(", %lu out of order", order_errors);
+  printf(bad ? " - FAILED\n" : "\n");
+  failures += bad;
+  if (ext)
+    ext->close();
+  external = 0;
+}
+
+static void
+bench_overflow(void)
+{
+  static FileFlash ext;
+  static const int days[] = {3, 7, 14, 30};
+
+  printf("\noffline then a week of daily uploads - internal flash only vs overflowing into %dk of external\n", 
+    EXTERNAL_SECTORS*SPI_FLASH_SEC_SIZE/1024);
+  for (unsigned int i = 0; i < sizeof(days)/sizeof(days[0]); i++) {
+    bench_overflow_run(0, days[i]);
+    bench_overflow_run(&ext, days[i]);
+  }
+}
+
+//
+//  with the ring full every write either drops the record or, with SetOverwrite(), throws
+//  away the oldest page - what does that cost per write once it's the steady state, with and
+//  without EraseAhead() getting a budget on the wakes in between
+//
+static void
+bench_overwrite(void)
+{
+  static const struct {
+    bool overwrite, erase_ahead;
+    const char *label;
+  } runs[] = {{0, 1, "  full, dropping"}, {1, 0, "  overwrite, no EraseAhead"}, {1, 1, "  overwrite, EraseAhead"}};
+  static const int days[] = {14, 30};
+  int per_page = (SPI_FLASH_SEC_SIZE-sizeof(flash_page_header))/RECORD_BYTES(RECORD_SIZE);
+
+  printf("\nsteady state write with the ring full, %d byte records, reboot between writes\n", RECORD_SIZE);
+  for (unsigned int i = 0; i < sizeof(runs)/sizeof(runs[0]); i++) {
+    flash_sim_stats write, background;
+    unsigned long n = 0, dropped = 0;
+
+    overwrite = runs[i].overwrite;
+    sim_reset();
+    cold_boot();
+    fill(SECTORS+1);  // full, and if we're overwriting, wrapped
+    memset(&write, 0, sizeof(write));
+    memset(&background, 0, sizeof(background));
+    for (int j = 0; j < 4*SECTORS*per_page; j++) {
+      flash_sim_stats s;
+
+      reboot();
+      s = sim_stats;
+      if (!write_record(RECORD_SIZE))
+        dropped++;
+      sim_add(&write, sim_delta(s));
+      n++;
+      reboot();
+      s = sim_stats;
+      if (runs[i].erase_ahead)
+        flash.EraseAhead(FLASH_ERASE_BUDGET);
+      sim_add(&background, sim_delta(s));
+    }
+    sim_print(runs[i].label, write, n);
+    sim_print("    background, per wake", background, n);
+    printf("    %lu dropped, %u evicted waiting to be reported\n", dropped, flash.Evicted());
+  }
+
+  // the count is only in the cursor, so a gap after the cold boot halfway through is 'at least'
+  printf("\noffline then a week of daily uploads, overwriting the oldest\n");
+  overwrite = 1;
+  for (unsigned int i = 0; i < sizeof(days)/sizeof(days[0]); i++) {
+    static FileFlash ext;
+
+    bench_overflow_run(0, days[i]);
+    bench_overflow_run(&ext, days[i]);
+  }
+  overwrite = 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "-v") == 0)
+    host_verbose = 1;
+  printf("HomeFlash on simulated flash, sectors %d-%d\n", FLASH_FIRST, FLASH_LAST);
+  bench_cold_boot();
+  bench_init_search();
+  bench_erase_verify();
+  bench_write();
+  bench_coalesce();
+  bench_trace();
+  bench_upload();
+  bench_seek();
+  bench_month(0.5);
+  bench_wear();
+  bench_overflow();
+  bench_overwrite();
+  if (failures)
+    printf("\n%d FAILED\n", failures);
+  return failures != 0;
+}
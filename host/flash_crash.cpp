@@ -0,0 +1,575 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  flash_crash [-v] - what HomeFlash is left with when the power goes at the wrong moment
+//
+//  a workload of wakes (restore the cursor, write a record or upload some, EraseAhead(),
+//  save the cursor, as setup() does) is run once to learn what's in the flash between each
+//  wake, then again from the same start once for every flash operation in it, cutting the
+//  power at that operation (see sim_cut_at) - before it starts, part way through it, and
+//  for the cursor save between it finishing and the RTC write. Then the unit comes back:
+//
+//    power cut - RTC memory is gone, DoInit() searches the flash
+//    reset     - the watchdog, or an exception. The flash part finishes whatever it was
+//                doing and RTC memory has the cursor from the end of the last wake
+//
+//  and we read back everything, write some more and read it all again. A record written
+//  before the wake that was cut, and not uploaded by it, that doesn't come back is lost,
+//  one that comes back twice or after it was freed is duplicated. A power cut loses where
+//  in the oldest page the last upload got to (that's only in the cursor) so the start of
+//  that page is sent again, those are counted but aren't errors. Neither is the record
+//  being written when the power went coming back torn, records have no checksum.
+//
+//  Recovery cost is the flash reads it takes to be ready to write again. Exits 1 if
+//  anything was lost, duplicated or corrupted
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spi_flash.h"
+#include "flash_sim.h"
+#include "../Flash.h"
+
+#define UPLOAD_SIZE   (8*256-20)    // what an upload reads at a time
+#define UPLOAD_BUFFERS 3            // and how many before it commits
+#define CRASH_TIME    500000000     // seconds since 2000, record n covers 100 seconds from here+100n
+#define POST_RECORDS  24            // written after recovery
+#define POST_SEQ      40000
+#define MAX_ITEMS     4096
+
+static flash_cursor rtc_cursor;     // RTC memory
+static bool overwrite;
+
+//
+//  a record is its seq, its length and then bytes that depend on both, so anything that's
+//  been overwritten, torn or cut short shows. Lengths cover both length encodings, long
+//  records that ReadRecord() returns in pieces, and go across FLASH_PROGRAM_PAGEs
+//
+static const int lengths[] = {250, 12, 129, 700, 60, 1500, 128, 251, 90, 400, 3000, 200};
+
+static int
+record_len(int seq)
+{
+  return lengths[seq%(sizeof(lengths)/sizeof(lengths[0]))];
+}
+
+static unsigned char
+record_byte(int seq, int i)
+{
+  return (seq*7+i*13+(i>>8))&0xff;
+}
+
+static bool
+write_record(int seq)
+{
+  unsigned char b[FLASH_RECORD_MAX];
+  int len = record_len(seq);
+  flash_summary sum;
+
+  b[0] = seq>>8;
+  b[1] = seq;
+  b[2] = len>>8;
+  b[3] = len;
+  for (int i = 4; i < len; i++)
+    b[i] = record_byte(seq, i);
+  SummaryClear(&sum);
+  sum.samples = 100;
+  sum.first_time = CRASH_TIME+seq*100;
+  sum.last_time = sum.first_time+99;
+  sum.min_temp = sum.max_temp = 20;
+  return flash.WriteRecord(&b[0], len, &sum);
+}
+
+//
+//  what a read back found, in order
+//
+typedef struct item {
+  int             seq;          // -1 if it isn't one of ours, -2 for a FLASH_GAP
+  int             len;
+} item;
+
+static int
+check_record(const unsigned char *b, int len)
+{
+  int seq;
+
+  if (len < 4)
+    return -1;
+  seq = (b[0]<<8)|b[1];
+  if (((b[2]<<8)|b[3]) != len || record_len(seq) != len)
+    return -1;
+  for (int i = 4; i < len; i++)
+  if (b[i] != record_byte(seq, i))
+    return -1;
+  return seq;
+}
+
+//
+//  everything ReadRecord() hands out from where we are, put back together - a piece the
+//  size of the read cache means there's more of the record to come
+//
+static int
+read_all(item *it)
+{
+  static unsigned char b[SPI_FLASH_SEC_SIZE];
+  const unsigned char *p;
+  int n = 0, have = 0, len;
+
+  while ((p = flash.ReadRecord(&len)) != 0 && n < MAX_ITEMS) {
+    if (!have && len == 3 && p[0] == FLASH_GAP) {
+      it[n].seq = -2;
+      it[n++].len = (p[1]<<8)|p[2];
+      continue;
+    }
+    if (have+len > (int)sizeof(b))
+      have = 0;
+    memcpy(&b[have], p, len);
+    have += len;
+    if (len == FLASH_READ_CACHE-3)
+      continue;
+    it[n].seq = check_record(&b[0], have);
+    it[n++].len = have;
+    have = 0;
+  }
+  flash.UnCommitBuffer();
+  return n;
+}
+
+//
+//  the seqs of the good records, which should be one run
+//
+static void
+seq_range(const item *it, int n, int *lo, int *hi)
+{
+  *lo = 1<<30;
+  *hi = -1;
+  for (int i = 0; i < n; i++)
+  if (it[i].seq >= 0 && it[i].seq < POST_SEQ) {
+    if (it[i].seq < *lo)
+      *lo = it[i].seq;
+    if (it[i].seq > *hi)
+      *hi = it[i].seq;
+  }
+}
+
+//
+//  a page's footer has to cover every record in it, or Seek() would skip records it
+//  shouldn't - straight from the image, FlashRing has no way to ask
+//
+static int
+bad_footers(void)
+{
+  int bad = 0;
+
+  for (int s = FLASH_FIRST; s <= FLASH_LAST; s++) {
+    const unsigned char *pg = &sim_image[s*SPI_FLASH_SEC_SIZE];
+    const flash_page_header *h = (const flash_page_header *)pg;
+    const flash_summary *f = (const flash_summary *)(pg+FLASH_PAGE_END);
+    unsigned int o = sizeof(flash_page_header);
+
+    if (h->magic != FLASH_MAGIC || f->magic != FLASH_SUMMARY_MAGIC || (f->flags&FLASH_SUMMARY_PARTIAL))
+      continue;
+    while (o < FLASH_PAGE_END && pg[o] != 0xff) {
+      int len = pg[o], data = o+1, seq;
+
+      if (len&0x80) {
+        len = ((len&0x7f)<<8)|pg[o+1];
+        data++;
+      }
+      len++;
+      if (data+len > (int)FLASH_PAGE_END)
+        break;
+      seq = check_record(pg+data, len);
+      if (seq >= 0 && seq < POST_SEQ &&
+          (CRASH_TIME+seq*100U < f->first_time || CRASH_TIME+seq*100U+99 > f->last_time)) {
+        bad++;
+        break;
+      }
+      o = data+len;
+    }
+  }
+  return bad;
+}
+
+//
+//  a deep sleep wake, and the start of the unit coming back after a reset
+//
+static void
+wake(void)
+{
+  memset((void *)&flash, 0, sizeof(flash));
+  flash._initHomeFlash();
+  flash.SetOverwrite(overwrite);
+  flash.RestoreCursor(&rtc_cursor);
+}
+
+static void
+cold_boot(void)
+{
+  memset((void *)&flash, 0, sizeof(flash));
+  flash._initHomeFlash();
+  flash.SetOverwrite(overwrite);
+}
+
+//
+//  the end of a wake - the RTC write is an operation the power can go before
+//
+static void
+go_to_sleep(void)
+{
+  flash_cursor c;
+
+  flash.SaveCursor(&c);
+  if (sim_op())
+    rtc_cursor = c;
+}
+
+//
+//  a workload is the state it starts from and a string of wakes - 'w' writes the next
+//  record, 'u' uploads UPLOAD_BUFFERS buffers (or what there is) and commits
+//
+typedef struct workload {
+  const char     *name;
+  const char     *wakes;
+  bool            overwrite;
+  int             seq;          // next to write
+  unsigned char   image[SIM_FLASH_SIZE];
+  unsigned long   erase_count[SIM_FLASH_SIZE/SPI_FLASH_SEC_SIZE];
+  flash_cursor    cursor;
+} workload;
+
+static void
+save_start(workload *w, int seq)
+{
+  w->seq = seq;
+  w->overwrite = overwrite;
+  memcpy(w->image, sim_image, sizeof(sim_image));
+  memcpy(w->erase_count, sim_erase_count, sizeof(sim_erase_count));
+  w->cursor = rtc_cursor;
+}
+
+static void
+restore_start(const workload *w)
+{
+  memcpy(sim_image, w->image, sizeof(sim_image));
+  memcpy(sim_erase_count, w->erase_count, sizeof(sim_erase_count));
+  rtc_cursor = w->cursor;
+  overwrite = w->overwrite;
+  sim_clear_stats();
+  sim_ops = 0;
+  sim_dead = 0;
+}
+
+//
+//  run wake i, false if the power went
+//
+static bool
+run_wake(const workload *w, int i, int *seq)
+{
+  static unsigned char b[UPLOAD_SIZE];
+
+  wake();
+  if (w->wakes[i] == 'w') {
+    if (write_record(*seq) && !sim_dead)
+      (*seq)++;
+  } else {
+    for (int j = 0; j < UPLOAD_BUFFERS; j++)
+    if (flash.LoadBuffer(&b[0], sizeof(b))&FLASH_END_MARKER)
+      break;
+    flash.CommitBuffer();
+  }
+  flash.EraseAhead(FLASH_ERASE_BUDGET);
+  go_to_sleep();
+  return !sim_dead;
+}
+
+//
+//  what the uncut run had in the flash at the start of each wake (and after the last),
+//  as seen through the cursor and after a cold boot
+//
+typedef struct boundary {
+  long            ops;          // sim_ops when the wake starts
+  int             lo, hi;       // seqs readable through the cursor
+  int             cold_lo;      // the oldest a cold boot would read
+} boundary;
+
+static boundary bounds[256];
+static item items[MAX_ITEMS], items2[MAX_ITEMS];
+
+static void
+measure(boundary *b)
+{
+  int n;
+
+  b->ops = sim_ops;
+  wake();
+  n = read_all(items);
+  seq_range(items, n, &b->lo, &b->hi);
+  cold_boot();
+  n = read_all(items);
+  seq_range(items, n, &b->cold_lo, &n);
+}
+
+typedef struct results {
+  unsigned long   runs;
+  unsigned long   lost, duplicated, corrupt, torn, resent, broken, footers;
+  unsigned long   searched;     // resets where the cursor was stale, DoInit() had to search
+  unsigned long   recoveries, reads, max_reads;
+  unsigned long long read_bytes, busy_ns, max_busy_ns;
+} results;
+
+static int verbose;
+
+static void
+failed(const char *what, const workload *w, long op, int how, bool reset, int wk)
+{
+  if (verbose)
+    printf("  %s: %s - op %ld of wake %d '%c' cut %d/256, %s\n", w->name, what, op, wk, w->wakes[wk], how,
+      reset ? "reset" : "power cut");
+}
+
+//
+//  cut the power at operation op, bring the unit back and see what survived
+//
+static void
+crash(const workload *w, int nwakes, long op, int how, bool reset, results *r)
+{
+  flash_sim_stats s, d;
+  static bool seen[POST_SEQ];
+  int seq = w->seq, wk, n, n2, expect;
+  unsigned long lost = 0, dup = 0, corrupt = 0;
+  bool searched = 0;
+
+  restore_start(w);
+  sim_cut_at = op;
+  sim_cut_how = how;
+  for (wk = 0; wk < nwakes; wk++)
+  if (!run_wake(w, wk, &seq))
+    break;
+  if (wk == nwakes)   // it never got there
+    return;
+  r->runs++;
+  sim_cut_at = -1;
+  sim_dead = 0;
+
+  // back up, ready to write again
+  s = sim_stats;
+  if (reset) {
+    wake();
+  } else {
+    cold_boot();
+  }
+  flash.internal.GetFirstPage();
+  if (reset) {
+    searched = flash.internal.Searched();   // the cursor didn't match the flash
+    r->searched += searched;
+  }
+  d = sim_delta(s);
+  r->recoveries++;
+  r->reads += d.read_calls;
+  r->read_bytes += d.read_bytes;
+  r->busy_ns += d.busy_ns;
+  if (d.read_calls > r->max_reads)
+    r->max_reads = d.read_calls;
+  if (d.busy_ns > r->max_busy_ns)
+    r->max_busy_ns = d.busy_ns;
+
+  // what was in the flash both before and after the wake has to be there, nothing older than
+  // either can be (from the start of the oldest page, unless the cursor survived)
+  const boundary *pre = &bounds[wk], *post = &bounds[wk+1];
+  int need_lo = pre->lo > post->lo ? pre->lo : post->lo;
+  int need_hi = pre->hi < post->hi ? pre->hi : post->hi;
+  int live_lo = pre->lo < post->lo ? pre->lo : post->lo;
+  int oldest = reset && !searched ? live_lo : (pre->cold_lo < post->cold_lo ? pre->cold_lo : post->cold_lo);
+  int newest = pre->hi > post->hi ? pre->hi : post->hi;
+
+  n = read_all(items);
+  expect = -1;
+  memset(seen, 0, sizeof(seen));
+  for (int i = 0; i < n; i++) {
+    int q = items[i].seq;
+
+    if (q == -2)
+      continue;
+    if (q < 0) {
+      if (i == n-1 && w->wakes[wk] == 'w') {   // the record being written, it's allowed
+        r->torn++;
+      } else {
+        corrupt++;
+      }
+      continue;
+    }
+    if (q < oldest || (expect >= 0 && q < expect)) {
+      dup++;
+      continue;
+    }
+    if (q > newest) {
+      corrupt++;
+      continue;
+    }
+    if (q < live_lo)
+      r->resent++;
+    seen[q] = 1;
+    expect = q+1;
+  }
+  for (int q = need_lo; q <= need_hi; q++)
+  if (!seen[q])
+    lost++;
+
+  if (lost)
+    failed("records lost", w, op, how, reset, wk);
+  if (dup)
+    failed("records duplicated", w, op, how, reset, wk);
+  if (corrupt)
+    failed("records corrupted", w, op, how, reset, wk);
+  r->lost += lost;
+  r->duplicated += dup;
+  r->corrupt += corrupt;
+
+  // it has to carry on as if nothing happened - what we read, less anything evicted, then
+  // the new records, intact
+  for (int i = 0; i < POST_RECORDS; i++)
+    write_record(POST_SEQ+i);
+  n2 = read_all(items2);
+  {
+    int i = 0, j = 0, k = 0;
+
+    while (j < n2 && items2[j].seq == -2)
+      j++;
+    if (overwrite)    // it may have thrown some of the old ones away
+    while (i < n && j < n2 && (items[i].seq != items2[j].seq || items[i].len != items2[j].len))
+      i++;
+    for (; i < n && j < n2; i++, j++)
+    if (items[i].seq != items2[j].seq || items[i].len != items2[j].len)
+      break;
+    for (; j < n2 && items2[j].seq == POST_SEQ+k; j++)
+      k++;
+    if (i < n || j < n2 || k != POST_RECORDS) {
+      failed("broken after recovery", w, op, how, reset, wk);
+      r->broken++;
+    }
+  }
+  if (bad_footers()) {
+    failed("footer doesn't cover its page", w, op, how, reset, wk);
+    r->footers++;
+  }
+}
+
+static void
+report(const char *label, const results *r)
+{
+  printf("  %-10s %5lu runs: lost %lu, duplicated %lu, corrupted %lu, broken after %lu, bad footers %lu"
+    " - torn %lu, resent %lu", label, r->runs, r->lost, r->duplicated, r->corrupt, r->broken, r->footers,
+    r->torn, r->resent);
+  if (r->searched)
+    printf(", stale cursors %lu", r->searched);
+  printf("\n");
+  if (r->recoveries)
+    printf("  %-10s recovery reads %.1f avg %lu max (%.0f bytes), %.1f us avg %.1f us max\n", "",
+      (double)r->reads/r->recoveries, r->max_reads, (double)r->read_bytes/r->recoveries,
+      (double)r->busy_ns/r->recoveries/1000.0, r->max_busy_ns/1000.0);
+}
+
+static const int tears[] = {0, 64, 160, 256};   // how far the cut operation gets, of 256
+
+static int
+run(workload *w)
+{
+  int nwakes = strlen(w->wakes), seq = w->seq;
+  results cut, reset;
+  long ops;
+
+  // the uncut run, to know what should be where
+  restore_start(w);
+  sim_cut_at = -1;
+  for (int i = 0; i < nwakes; i++) {
+    measure(&bounds[i]);
+    run_wake(w, i, &seq);
+  }
+  measure(&bounds[nwakes]);
+  ops = bounds[nwakes].ops;
+  printf("\n%s - %d wakes, records %d-%d, %ld flash operations\n", w->name, nwakes, w->seq, seq-1, ops);
+
+  memset(&cut, 0, sizeof(cut));
+  memset(&reset, 0, sizeof(reset));
+  for (long op = 0; op < ops; op++) {
+    for (unsigned int t = 0; t < sizeof(tears)/sizeof(tears[0]); t++)
+      crash(w, nwakes, op, tears[t], 0, &cut);
+    crash(w, nwakes, op, 0, 1, &reset);     // the flash finishes (or never starts) what it was doing
+    crash(w, nwakes, op, 256, 1, &reset);
+  }
+  report("power cut", &cut);
+  report("reset", &reset);
+  return cut.lost+cut.duplicated+cut.corrupt+cut.broken+cut.footers+
+    reset.lost+reset.duplicated+reset.corrupt+reset.broken+reset.footers != 0;
+}
+
+static workload w;
+
+int
+main(int argc, char **argv)
+{
+  flash_sim_stats s;
+  int seq = 0, bad = 0;
+
+  if (argc > 1 && strcmp(argv[1], "-v") == 0)
+    verbose = 1;
+  printf("HomeFlash power loss recovery, sectors %d-%d\n", FLASH_FIRST, FLASH_LAST);
+
+  // a ring part way round, part uploaded
+  sim_reset();
+  overwrite = 0;
+  cold_boot();
+  while (seq < 40)
+    write_record(seq++);
+  for (int i = 0; i < 2; i++) {
+    static unsigned char b[UPLOAD_SIZE];
+
+    flash.LoadBuffer(&b[0], sizeof(b));
+  }
+  flash.CommitBuffer();
+  flash.SaveCursor(&rtc_cursor);
+  s = sim_stats;
+  cold_boot();
+  flash.internal.GetFirstPage();
+  s = sim_delta(s);
+  printf("cold boot with nothing torn: %lu reads (%llu bytes), %.1f us\n", s.read_calls, s.read_bytes,
+    s.busy_ns/1000.0);
+  w.name = "writing and uploading";
+  w.wakes = "wwwwwwwwwuwwwwwwwwwwuwwwwwwwwwwwwwuuwwwwwwwwww";
+  save_start(&w, seq);
+  bad |= run(&w);
+
+  // a full ring throwing away its oldest pages
+  sim_reset();
+  overwrite = 1;
+  cold_boot();
+  seq = 0;
+  while (!flash.Evicted())
+    write_record(seq++);
+  flash.SaveCursor(&rtc_cursor);
+  w.name = "overwriting";
+  w.wakes = "wwwwwwwwwwwwwwwwwwwwwwwwwwwwwwuwwwwwwwwww";
+  save_start(&w, seq);
+  bad |= run(&w);
+  overwrite = 0;
+
+  printf("\n%s\n", bad ? "FAILED - run with -v for the details" : "ok");
+  return bad;
+}
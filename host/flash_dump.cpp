@@ -0,0 +1,259 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  flash_dump [-s|-p|-r] [-f first] [-l last] image ...
+//
+//  decodes the HomeFlash ring in raw flash images pulled off units - by default every
+//  sample as CSV (image,time,temp,humidity,pressure), -s a line per image, -p the pages in
+//  ring order, -r every record. -f/-l limit the sectors searched for pages, by default
+//  the whole image (a full read_flash dump of the 8266, or an external chip)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spi_flash.h"
+#include "../Flash.h"
+#include "../decompress.h"
+#include "flash_image.h"
+
+static const char *image_name;
+static const unsigned char *record;   // what decompress.c is decoding
+static int record_len;
+static bool quiet;                    // just count
+static unsigned long samples, marks, gaps;
+static unsigned long first_time, last_time;
+
+//
+//  decompress.c reads the record through us, and hands us what it finds
+//
+int
+get_compressed_byte(int offset)
+{
+  return offset < record_len ? record[offset] : -1;
+}
+
+static void
+print_time(const time_stamp *t)
+{
+  if (t->valid) {
+    printf("%04d-%02d-%02d %02d:%02d:%02d", t->year, t->month, t->day, t->hour, t->minute, t->second);
+  } else {
+    printf("-");
+  }
+}
+
+static void
+seen(const time_stamp *t)
+{
+  unsigned long s = time_stamp_seconds(t);
+
+  if (!s)
+    return;
+  if (!first_time || s < first_time)
+    first_time = s;
+  if (s > last_time)
+    last_time = s;
+}
+
+void
+log_data(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
+{
+  samples++;
+  seen(t);
+  if (quiet)
+    return;
+  printf("%s,", image_name);
+  print_time(t);
+  if (valid_th) {
+    printf(",%d,%d", temp, humidity);
+  } else {
+    printf(",,");
+  }
+  if (valid_p) {
+    printf(",%d\n", pressure);
+  } else {
+    printf(",\n");
+  }
+}
+
+void
+log_data_tenths(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
+{
+  samples++;
+  seen(t);
+  if (quiet)
+    return;
+  printf("%s,", image_name);
+  print_time(t);
+  if (valid_th) {
+    printf(",%.1f,%.1f", temp/10.0, humidity/10.0);
+  } else {
+    printf(",,");
+  }
+  if (valid_p) {
+    printf(",%.1f\n", pressure/10.0);
+  } else {
+    printf(",\n");
+  }
+}
+
+void
+log_mark(time_stamp *t, int mark)
+{
+  marks++;
+  if (quiet)
+    return;
+  printf("# %s mark %d at ", image_name, mark);
+  print_time(t);
+  printf("\n");
+}
+
+void
+log_gap(time_stamp *t, int records)
+{
+  gaps++;
+  if (quiet)
+    return;
+  printf("# %s %s%d records lost at ", image_name, records&0x8000 ? "at least " : "", records&0x7fff);
+  print_time(t);
+  printf("\n");
+}
+
+static const char *
+seconds_string(unsigned long s)   // since 2000
+{
+  static char b[2][32];
+  static int n;
+  time_t t = s+946684800;
+  struct tm *tm = gmtime(&t);
+
+  n ^= 1;
+  if (!s) {
+    strcpy(b[n], "-");
+  } else {
+    strftime(b[n], sizeof(b[n]), "%Y-%m-%d %H:%M:%S", tm);
+  }
+  return b[n];
+}
+
+static const char *
+magic_name(unsigned int m)
+{
+  if (m == FLASH_MAGIC)
+    return "packed";
+  if (m == FLASH_MAGIC_V3)
+    return "v3";
+  if (m == FLASH_MAGIC_V2)
+    return "v2";
+  return "v1";
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: flash_dump [-s|-p|-r] [-f first-sector] [-l last-sector] image ...\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  int first = -1, last = -1, c, status = 0;
+  char mode = 0;
+
+  while ((c = getopt(argc, argv, "sprf:l:")) != -1)
+  switch (c) {
+  case 's':
+  case 'p':
+  case 'r':
+    mode = c;
+    break;
+  case 'f':
+    first = atoi(optarg);
+    break;
+  case 'l':
+    last = atoi(optarg);
+    break;
+  default:
+    usage();
+  }
+  if (optind >= argc)
+    usage();
+  if (!mode)
+    printf("image,time,temp,humidity,pressure\n");
+  for (int i = optind; i < argc; i++) {
+    FlashImage im;
+    flash_image_pos pos;
+    decompress_state state;  // where decoding the records has got to
+    unsigned long records = 0, bytes = 0;
+
+    image_name = argv[i];
+    if (!im.Open(argv[i], first, last)) {
+      fprintf(stderr, "flash_dump: can't read %s\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    if (mode == 'p') {
+      printf("%s: %d pages in use\n", argv[i], im.Pages());
+      for (int j = 0; j < im.Pages(); j++) {
+        const flash_image_page *pg = im.Page(j);
+        const flash_summary *f = im.Footer(j);
+
+        printf("  sector %4u ref %8u %-6s erases ", pg->address/SPI_FLASH_SEC_SIZE, pg->ref, magic_name(pg->magic));
+        if (pg->erases == ~0U) {
+          printf("     -");
+        } else {
+          printf("%6u", pg->erases);
+        }
+        if (f)
+          printf("  %5u samples %s - %s%s", f->samples, seconds_string(f->first_time), seconds_string(f->last_time),
+            f->flags&FLASH_SUMMARY_PARTIAL ? " (partial)" : "");
+        printf("\n");
+      }
+    }
+    samples = marks = gaps = 0;
+    first_time = last_time = 0;
+    quiet = mode != 0;
+    im.Rewind(&pos);
+    decompress_start(&state);
+    while ((record = im.Next(&pos, &record_len)) != 0) {
+      int n;
+
+      records++;
+      bytes += record_len;
+      n = samples;
+      decompress(&state);   // a record may carry on from the one before
+      if (mode == 'r')
+        printf("%s: sector %u offset %4u len %4d, %lu samples\n", argv[i],
+          im.Page(pos.page)->address/SPI_FLASH_SEC_SIZE, pos.record, record_len, samples-n);
+    }
+    if (mode == 's' || im.duplicate_refs || im.ref_gaps || im.bad_records || im.dirty_tails) {
+      printf("%s%s: %d pages, %lu records, %lu bytes, %lu samples %s - %s, %lu marks, %lu gaps",
+        mode ? "" : "# ", argv[i], im.Pages(), records, bytes, samples,
+        seconds_string(first_time), seconds_string(last_time), marks, gaps);
+      if (im.duplicate_refs || im.ref_gaps || im.bad_records || im.dirty_tails)
+        printf(" - %u duplicate refs, %u ref gaps, %u bad records, %u dirty page tails",
+          im.duplicate_refs, im.ref_gaps, im.bad_records, im.dirty_tails);
+      printf("\n");
+    }
+  }
+  return status;
+}
@@ -0,0 +1,198 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "spi_flash.h"
+#include "../Flash.h"
+#include "flash_image.h"
+
+//
+//  the pages in use, in any order - FlashRing::DoInit() searches for the ends of the run but
+//  we have every header in memory already, so sorting them by ref is simpler and copes with
+//  whatever a broken unit left behind
+//
+static int
+ref_order(const void *a, const void *b)
+{
+  unsigned int ra = ((const flash_image_page *)a)->ref, rb = ((const flash_image_page *)b)->ref;
+
+  return ra < rb ? -1 : ra > rb;
+}
+
+bool
+FlashImage::Open(const char *path, int first, int last)
+{
+  struct stat st;
+  int fd, n;
+
+  Close();
+  duplicate_refs = ref_gaps = bad_records = dirty_tails = 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || st.st_size < SPI_FLASH_SEC_SIZE) {
+    close(fd);
+    return 0;
+  }
+  size = st.st_size;
+#ifndef _WIN32
+  base = (const unsigned char *)mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  mapped = base != (const unsigned char *)MAP_FAILED;
+  if (!mapped)
+    base = 0;
+#endif
+  if (!base) {  // can't map it (or no mmap()), read it instead
+    unsigned char *b = (unsigned char *)malloc(size);
+    unsigned long done = 0;
+    int r;
+
+    while (b && done < size && (r = read(fd, b+done, size-done)) > 0)
+      done += r;
+    if (!b || done != size) {
+      free(b);
+      close(fd);
+      size = 0;
+      return 0;
+    }
+    base = b;
+  }
+  close(fd);
+
+  n = size/SPI_FLASH_SEC_SIZE;
+  if (first < 0)
+    first = 0;
+  if (last < 0 || last >= n)
+    last = n-1;
+  pages = (flash_image_page *)malloc((last-first+1 > 0 ? last-first+1 : 1)*sizeof(*pages));
+  npages = 0;
+  for (int s = first; s <= last; s++) {
+    const flash_page_header *h = (const flash_page_header *)(base+s*SPI_FLASH_SEC_SIZE);
+    flash_image_page *pg = &pages[npages];
+
+    if (!FLASH_IN_USE(h->magic))  // free, freed or not ours
+      continue;
+    pg->address = s*SPI_FLASH_SEC_SIZE;
+    pg->magic = h->magic;
+    pg->ref = h->ref&~FLASH_REF_EVICTED;
+    pg->erases = h->magic == FLASH_MAGIC_V1 ? ~0U : h->erases;
+    pg->data = h->magic == FLASH_MAGIC_V1 ? FLASH_HEADER_V1 : sizeof(flash_page_header);
+    pg->packed = h->magic == FLASH_MAGIC;
+    npages++;
+  }
+  qsort(pages, npages, sizeof(pages[0]), ref_order);
+  for (int i = 1; i < npages; i++) {
+    if (pages[i].ref == pages[i-1].ref) {  // keep the first
+      duplicate_refs++;
+      memmove(&pages[i], &pages[i+1], (npages-i-1)*sizeof(pages[0]));
+      npages--;
+      i--;
+    } else
+    if (pages[i].ref-pages[i-1].ref > FLASH_WEAR_WINDOW) {
+      ref_gaps++;
+    }
+  }
+  return 1;
+}
+
+void
+FlashImage::Close()
+{
+  if (base) {
+#ifndef _WIN32
+    if (mapped)
+      munmap((void *)base, size);
+    else
+#endif
+    free((void *)base);
+  }
+  free(pages);
+  base = 0;
+  size = 0;
+  pages = 0;
+  npages = 0;
+}
+
+const flash_summary *
+FlashImage::Footer(int i)
+{
+  const flash_summary *f = (const flash_summary *)(base+pages[i].address+FLASH_PAGE_END);
+
+  if ((pages[i].magic != FLASH_MAGIC && pages[i].magic != FLASH_MAGIC_V3) || f->magic != FLASH_SUMMARY_MAGIC)
+    return 0;
+  return f;
+}
+
+//
+//  after the last record there should be nothing but FFs up to the footer (or the end of
+//  the page) - anything else is a torn write, or something scribbling on the flash
+//
+void
+FlashImage::check_tail(const flash_image_page *pg, unsigned int offset)
+{
+  unsigned int end = pg->magic == FLASH_MAGIC || pg->magic == FLASH_MAGIC_V3 ? FLASH_PAGE_END : SPI_FLASH_SEC_SIZE;
+
+  for (; offset < end; offset++)
+  if (base[pg->address+offset] != 0xff) {
+    dirty_tails++;
+    return;
+  }
+}
+
+//
+//  records are laid out as FlashRing::record_at() expects them - see Flash.cpp
+//
+const unsigned char *
+FlashImage::Next(flash_image_pos *p, int *len)
+{
+  for (; p->page < npages; p->page++, p->offset = 0) {
+    const flash_image_page *pg = &pages[p->page];
+    const unsigned char *b = base+pg->address;
+    unsigned int o = p->offset ? p->offset : pg->data, data, next;
+    int l;
+
+    if (o >= SPI_FLASH_SEC_SIZE || b[o] == 0xff) {
+      check_tail(pg, o);
+      continue;
+    }
+    data = o+1;
+    l = b[o];
+    if (pg->packed && (l&0x80)) {
+      l = o+1 < SPI_FLASH_SEC_SIZE ? ((l&0x7f)<<8)|b[o+1] : SPI_FLASH_SEC_SIZE;
+      data = o+2;
+    }
+    l++;
+    next = pg->packed ? data+l : (data+l+3)&~3;
+    if (next > SPI_FLASH_SEC_SIZE) {  // give up on the rest of this page
+      bad_records++;
+      continue;
+    }
+    p->record = o;
+    p->offset = next;
+    *len = l;
+    return b+data;
+  }
+  *len = 0;
+  return 0;
+}
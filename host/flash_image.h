@@ -0,0 +1,73 @@
+#ifndef FLASH_IMAGE_H
+#define FLASH_IMAGE_H
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  reads a raw dump of flash that a HomeFlash ring lives in - the 8266's own flash as
+//  esptool's read_flash gives it, or a whole external chip - on a PC. The image is
+//  mapped rather than read in, the ring is put back in order from the page refs and
+//  records are handed out as pointers into the mapping, so nothing is copied.
+//
+//  The flash doesn't say how far the last upload got (that's only in the cursor in RTC
+//  memory) so everything in the pages still in use is returned, the start of the oldest
+//  page may already have been uploaded. Include Flash.h first
+//
+typedef struct flash_image_page {
+  unsigned int    address;      // in the image
+  unsigned int    magic;
+  unsigned int    ref;
+  unsigned int    erases;       // ~0 if it hasn't a count
+  unsigned short  data;         // where its records start
+  bool            packed;       // FLASH_MAGIC, not one of the older record formats
+} flash_image_page;
+
+typedef struct flash_image_pos {
+  int             page;         // index into the pages, oldest first
+  unsigned int    offset;       // of the next record in it, 0 for the start
+  unsigned int    record;       // offset of the one Next() just returned
+} flash_image_pos;
+
+class FlashImage {
+public:
+  FlashImage() { base = 0; size = 0; mapped = 0; pages = 0; npages = 0; }
+  ~FlashImage() { Close(); }
+  bool Open(const char *path, int first = -1, int last = -1); // sectors to look at, default all
+  void Close();
+
+  int Pages() { return npages; }
+  const flash_image_page *Page(int i) { return &pages[i]; }   // oldest first
+  const flash_summary *Footer(int i);   // the page's summary, 0 if it hasn't one
+  unsigned long Size() { return size; }
+
+  void Rewind(flash_image_pos *p) { p->page = 0; p->offset = 0; p->record = 0; bad_records = dirty_tails = 0; }
+  const unsigned char *Next(flash_image_pos *p, int *len);  // the next record, 0 at the end
+
+  // found while reading, for triage - the last two by Next() since Rewind()
+  unsigned int duplicate_refs;  // pages claiming the same ref, all but one ignored
+  unsigned int ref_gaps;        // more refs skipped between pages than a wear window would
+  unsigned int bad_records;     // lengths that run off the end of their page
+  unsigned int dirty_tails;     // pages with something other than FFs after their last record
+private:
+  const unsigned char *base;
+  unsigned long size;
+  bool mapped;                  // else base was malloc()ed
+  flash_image_page *pages;
+  int npages;
+  void check_tail(const flash_image_page *pg, unsigned int offset);
+};
+#endif
@@ -0,0 +1,243 @@
+/*   
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "spi_flash.h"
+#include "flash_sim.h"
+
+flash_sim_stats sim_stats;
+unsigned char sim_image[SIM_FLASH_SIZE];
+unsigned long sim_erase_count[SIM_FLASH_SIZE/SPI_FLASH_SEC_SIZE];
+int host_verbose;
+void (*sim_read_hook)(uint32 src_addr, uint32 size);
+long sim_ops;
+long sim_cut_at = -1;
+int sim_cut_how;
+bool sim_dead;
+static unsigned int cut_seed = 1;
+
+static int irq_depth;
+
+void
+noInterrupts(void)
+{
+  if (!irq_depth++)
+    sim_stats.irq_off++;
+}
+
+void
+interrupts(void)
+{
+  irq_depth = 0;
+}
+
+unsigned long long sim_other_ns;
+
+unsigned long
+micros(void)
+{
+  return (sim_stats.busy_ns+sim_other_ns)/1000;
+}
+
+static void
+charge(unsigned long long ns)
+{
+  sim_stats.busy_ns += ns;
+  if (irq_depth)
+    sim_stats.irq_off_ns += ns;
+}
+
+void
+sim_reset(void)
+{
+  memset(sim_image, 0xff, sizeof(sim_image));
+  memset(sim_erase_count, 0, sizeof(sim_erase_count));
+  sim_clear_stats();
+  sim_ops = 0;
+  sim_cut_at = -1;
+  sim_dead = 0;
+}
+
+//
+//  1 if the next operation is to happen in full, -1 if it's the one being torn, 0 if
+//  the power has already gone
+//
+static int
+cut(void)
+{
+  if (sim_dead)
+    return 0;
+  if (sim_ops++ != sim_cut_at)
+    return 1;
+  sim_dead = 1;
+  cut_seed = sim_cut_at*31+sim_cut_how;
+  return -1;
+}
+
+bool
+sim_op(void)
+{
+  return cut() > 0;
+}
+
+static unsigned int
+cut_random(void)
+{
+  cut_seed = cut_seed*1103515245+12345;
+  return (cut_seed>>16)&0x7fff;
+}
+
+void
+sim_clear_stats(void)
+{
+  memset(&sim_stats, 0, sizeof(sim_stats));
+  sim_other_ns = 0;
+  irq_depth = 0;
+}
+
+SpiFlashOpResult
+spi_flash_erase_sector(uint16 sec)
+{
+  int c;
+
+  if (sec >= SIM_FLASH_SIZE/SPI_FLASH_SEC_SIZE)
+    return SPI_FLASH_RESULT_ERR;
+  if ((c = cut()) <= 0) {
+    if (c < 0) {  // torn
+      for (int i = 0; i < SPI_FLASH_SEC_SIZE; i++)
+      for (int b = 0; b < 8; b++)
+      if ((int)(cut_random()&0xff) < sim_cut_how)
+        sim_image[sec*SPI_FLASH_SEC_SIZE+i] |= 1<<b;
+    }
+    return SPI_FLASH_RESULT_OK;   // nobody is left to see the result
+  }
+  memset(&sim_image[sec*SPI_FLASH_SEC_SIZE], 0xff, SPI_FLASH_SEC_SIZE);
+  sim_erase_count[sec]++;
+  sim_stats.erases++;
+  charge(SIM_ERASE_NS);
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult
+spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size)
+{
+  const unsigned char *p = (const unsigned char *)src_addr;
+  int c;
+
+  if ((des_addr&3) || (size&3) || des_addr+size > SIM_FLASH_SIZE)
+    return SPI_FLASH_RESULT_ERR;
+  sim_stats.write_calls++;
+  sim_stats.write_bytes += size;
+  while (size) {
+    unsigned int n = SIM_PROGRAM_PAGE - (des_addr&(SIM_PROGRAM_PAGE-1));   // can't cross a program page
+    if (n > size)
+      n = size;
+    if ((c = cut()) <= 0) {
+      if (c < 0) {  // torn, part way through byte k
+        unsigned int k = n*sim_cut_how/256;
+
+        for (unsigned int i = 0; i < k; i++)
+          sim_image[des_addr+i] &= p[i];
+        if (k < n && sim_cut_how)
+          sim_image[des_addr+k] &= p[k]|cut_random();
+      }
+      return SPI_FLASH_RESULT_OK;
+    }
+    for (unsigned int i = 0; i < n; i++)
+      sim_image[des_addr+i] &= p[i];  // NOR - programming only clears bits
+    sim_stats.program_pages++;
+    charge(SIM_PROG_SETUP_NS + (unsigned long long)(n-1)*SIM_PROG_BYTE_NS);
+    des_addr += n;
+    p += n;
+    size -= n;
+  }
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult
+spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size)
+{
+  if ((src_addr&3) || (size&3) || src_addr+size > SIM_FLASH_SIZE)
+    return SPI_FLASH_RESULT_ERR;
+  memcpy(des_addr, &sim_image[src_addr], size);
+  if (sim_read_hook)
+    (*sim_read_hook)(src_addr, size);
+  sim_stats.read_calls++;
+  sim_stats.read_bytes += size;
+  charge(SIM_READ_SETUP_NS + (unsigned long long)size*SIM_READ_BYTE_NS);
+  return SPI_FLASH_RESULT_OK;
+}
+
+flash_sim_stats
+sim_delta(const flash_sim_stats &since)
+{
+  flash_sim_stats d;
+
+  d.read_calls = sim_stats.read_calls-since.read_calls;
+  d.read_bytes = sim_stats.read_bytes-since.read_bytes;
+  d.write_calls = sim_stats.write_calls-since.write_calls;
+  d.write_bytes = sim_stats.write_bytes-since.write_bytes;
+  d.program_pages = sim_stats.program_pages-since.program_pages;
+  d.erases = sim_stats.erases-since.erases;
+  d.irq_off = sim_stats.irq_off-since.irq_off;
+  d.busy_ns = sim_stats.busy_ns-since.busy_ns;
+  d.irq_off_ns = sim_stats.irq_off_ns-since.irq_off_ns;
+  return d;
+}
+
+void
+sim_add(flash_sim_stats *to, const flash_sim_stats &d)
+{
+  to->read_calls += d.read_calls;
+  to->read_bytes += d.read_bytes;
+  to->write_calls += d.write_calls;
+  to->write_bytes += d.write_bytes;
+  to->program_pages += d.program_pages;
+  to->erases += d.erases;
+  to->irq_off += d.irq_off;
+  to->busy_ns += d.busy_ns;
+  to->irq_off_ns += d.irq_off_ns;
+}
+
+//
+//  print a set of counters, averaged over n operations
+//
+void
+sim_print(const char *label, const flash_sim_stats &s, unsigned long n)
+{
+  if (!n)
+    n = 1;
+  printf("%-28s reads %7.1f (%8.1f B)  writes %6.2f (%7.1f B, %6.2f pp)  erases %6.3f  busy %9.1f us  irq-off %9.1f us\n",
+    label,
+    (double)s.read_calls/n, (double)s.read_bytes/n,
+    (double)s.write_calls/n, (double)s.write_bytes/n, (double)s.program_pages/n,
+    (double)s.erases/n,
+    (double)s.busy_ns/n/1000.0, (double)s.irq_off_ns/n/1000.0);
+}
+
+bool
+sim_save(const char *path)
+{
+  FILE *fp = fopen(path, "wb");
+  bool r;
+
+  if (!fp)
+    return 0;
+  r = fwrite(sim_image, sizeof(sim_image), 1, fp) == 1;
+  return fclose(fp) == 0 && r;
+}
@@ -0,0 +1,84 @@
+#ifndef FLASH_SIM_H
+#define FLASH_SIM_H
+/*   
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  RAM backed stand-in for the SDK's spi_flash_read/write/erase_sector so that
+//  HomeFlash can be run and measured on a PC.
+//
+//  It behaves like NOR flash - erase sets a whole sector to 0xff, a program can
+//  only clear bits - and enforces the 8266's 4 byte alignment rules. Every call
+//  is counted and charged a modelled latency, the numbers are typical datasheet
+//  values for the W25Q40 class parts fitted to ESP-12 style modules:
+//
+//    read     - command/address overhead plus 40MHz QIO transfer
+//    program  - split at 256 byte program pages, first byte plus per byte cost
+//    erase    - 4k sector erase
+//
+#include "c_types.h"
+
+#define SIM_FLASH_SIZE        (512*1024)
+#define SIM_PROGRAM_PAGE      256
+
+#define SIM_READ_SETUP_NS     2000    // command+address+dummy cycles
+#define SIM_READ_BYTE_NS      50      // ~20MB/s QIO
+#define SIM_PROG_SETUP_NS     30000   // tBP1
+#define SIM_PROG_BYTE_NS      2500    // tBPn
+#define SIM_ERASE_NS          45000000 // tSE typical
+
+typedef struct flash_sim_stats {
+  unsigned long       read_calls;
+  unsigned long long  read_bytes;
+  unsigned long       write_calls;
+  unsigned long long  write_bytes;
+  unsigned long       program_pages;  // 256 byte program operations issued to the part
+  unsigned long       erases;
+  unsigned long       irq_off;        // noInterrupts() calls
+  unsigned long long  busy_ns;        // modelled time the flash was busy
+  unsigned long long  irq_off_ns;     // modelled flash time spent with interrupts off
+} flash_sim_stats;
+
+extern flash_sim_stats sim_stats;
+extern unsigned char sim_image[SIM_FLASH_SIZE];
+extern unsigned long sim_erase_count[SIM_FLASH_SIZE/4096];  // per sector wear
+extern void (*sim_read_hook)(uint32 src_addr, uint32 size);  // if set called on every read
+extern int host_verbose;           // show the firmware's debug printf()s
+extern unsigned long long sim_other_ns;  // time other simulated devices were busy, micros() counts it
+
+void sim_reset(void);             // blank part, zero all counters
+void sim_clear_stats(void);       // zero the counters but keep the contents
+flash_sim_stats sim_delta(const flash_sim_stats &since);
+void sim_add(flash_sim_stats *to, const flash_sim_stats &d);
+void sim_print(const char *label, const flash_sim_stats &s, unsigned long n = 1);
+bool sim_save(const char *path); // the image, as read_flash would dump it - see flash_dump
+
+//
+//  power cuts, for flash_crash - every program page and erase is an operation, so is
+//  anything else that calls sim_op(). Operation sim_cut_at is torn sim_cut_how/256 of the
+//  way through (0 it never starts, 256 it finishes) and nothing after it happens: writes
+//  and erases are dropped, sim_op() returns false, until sim_cut_at is set again.
+//  A torn program has programmed a prefix of its bytes, the one it got to only partly.
+//  A torn erase has set each programmed bit back to 1 with that probability, NOR cells
+//  don't all erase at the same rate
+//
+extern long sim_ops;              // operations so far
+extern long sim_cut_at;           // the one that's torn, -1 for none
+extern int sim_cut_how;
+extern bool sim_dead;             // we've lost power
+bool sim_op(void);                // count an operation, false if it doesn't happen
+#endif
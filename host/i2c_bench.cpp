@@ -0,0 +1,383 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  i2c_bench - the HTS221, LPS25H and PC8563 drivers against a simulated I2C bus (see
+//  Wire.h), with made up register contents. For each thing the sketch asks of them,
+//  the I2C transactions, bytes and bus time at 100kHz it costs, checking that what
+//  comes back is what's in the registers and that it takes no more transactions than
+//  it should. Then SensorConversion, a wake's one-shot readings, with the parts taking
+//  their time, stuck, and missing - how long each took and that none of it runs past
+//  the deadline - and wakes that time out put through SampleEncoder the way the sketch
+//  does, decoded back with decompress.c. Exits 1 if anything's wrong
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "Wire.h"
+#include "../HTS221.h"
+#include "../LPS25H.h"
+#include "../PC8563.h"
+#include "../SensorConversion.h"
+#include "../SampleEncoder.h"
+#undef printf   // Arduino.h's, for the firmware's debug output
+
+static wire_sim_device *hts221, *lps25h, *pc8563;
+static int bad;
+
+static void
+check(const char *what, unsigned long transactions, bool ok)
+{
+  bool counted = wire_sim_transactions <= transactions;
+
+  printf("  %-28s %3lu transactions %4lu bytes %6lu us  %s\n", what, wire_sim_transactions,
+    wire_sim_bytes, wire_sim_us(), !ok ? "WRONG VALUE" : !counted ? "TOO MANY TRANSACTIONS" : "ok");
+  if (!ok || !counted)
+    bad++;
+  wire_sim_reset();
+}
+
+static void
+put16(wire_sim_device *d, int reg, int v)
+{
+  d->regs[reg] = v;
+  d->regs[reg+1] = v>>8;
+}
+
+static uint8_t
+bcd(int v)
+{
+  return (v%10)|((v/10)<<4);
+}
+
+//
+//  LPS25H::readFifo() with queued samples in its FIFO, overran if it's filled - they
+//  should come out oldest first, a burst of FIFO_BURST at a time
+//
+static void
+fifo(const char *what, int queued, bool overran)
+{
+  long p[32];
+  bool over;
+  int n;
+  bool ok;
+
+  lps25h->window_reg = 0x28;      // PRESS_OUT_XL to _H
+  lps25h->window_len = 3;
+  for (int i = 0; i < queued; i++) {
+    long v = 0x3f5400+i*37;
+
+    lps25h->fifo[3*i] = v;
+    lps25h->fifo[3*i+1] = v>>8;
+    lps25h->fifo[3*i+2] = v>>16;
+  }
+  lps25h->fifo_len = 3*queued;
+  lps25h->fifo_off = 0;
+  lps25h->regs[0x2f] = queued == 0 ? 0x20 : overran ? 0x40 : queued;  // FIFO_STATUS
+  n = smePressure.readFifo(&p[0], &over);
+  ok = n == queued && over == overran;
+  for (int i = 0; ok && i < n; i++)
+    if (p[i] != 0x3f5400+i*37)
+      ok = 0;
+  check(what, 1+(queued+9)/10, ok);
+  lps25h->window_len = 0;
+  lps25h->fifo_len = 0;
+}
+
+//
+//  one wake's Start() and Collect() with the HTS221 taking hts221_us to convert and the
+//  LPS25H lps25h_us (0 never), or not answering at all if it's missing. Checks what it
+//  got, and that it got it by the deadline, polling no more than it should
+//
+static void
+conversion(const char *what, unsigned long hts221_us, unsigned long lps25h_us, bool missing)
+{
+  static SensorConversion sensors;
+  unsigned long start, took;
+  int want = (hts221_us ? 1<<SENSOR_HUMIDITY : 0) | (lps25h_us && !missing ? 1<<SENSOR_PRESSURE : 0);
+  int got;
+  unsigned long transactions = 0;
+  bool ok;
+
+  hts221->convert_us = hts221_us;
+  lps25h->convert_us = lps25h_us;
+  lps25h->address = missing ? 0x7f : 0x5c;
+  wire_sim_reset();
+  start = micros();
+  sensors.Start(1, 1);
+  got = sensors.Collect();
+  took = micros()-start;
+  ok = got == want && took <= SENSOR_DEADLINE_US+5000;     // and the last looks and power downs
+  for (int i = 0; i < SENSORS; i++)
+    if (!sensors.TimedOut(i) != !((1<<i)&~got))
+      ok = 0;
+  for (int i = 0; i < SENSORS; i++) {
+    unsigned long us = i == SENSOR_HUMIDITY ? hts221_us : lps25h_us;
+
+    if (got&(1<<i) && (sensors.Latency(i) < us || sensors.Latency(i) > us+SENSOR_POLL_US+2000))
+      ok = 0;
+    if (!(got&(1<<i)) && sensors.Latency(i) != 0)
+      ok = 0;
+    // 2 writes to start it, a STATUS_REG read a look, the read out and a write to power down
+    if (!(got&(1<<i)))
+      us = SENSOR_DEADLINE_US;
+    transactions += 2+(us-(i == SENSOR_HUMIDITY ? SENSOR_HTS221_US : SENSOR_LPS25H_US))/SENSOR_POLL_US+2+2;
+  }
+  if (got&(1<<SENSOR_HUMIDITY) && (sensors.Humidity() != 6000 || sensors.Temperature() != 300))
+    ok = 0;
+  if (got&(1<<SENSOR_PRESSURE) && sensors.Pressure() != 0x3f5400)
+    ok = 0;
+  if (wire_sim_transactions > transactions)
+    ok = 0;
+  printf("  %-24s %6lu %6lu us %6lu us %3lu transactions  %s\n", what, sensors.Latency(SENSOR_HUMIDITY),
+    sensors.Latency(SENSOR_PRESSURE), took, wire_sim_transactions, ok ? "ok" : "WRONG");
+  if (!ok)
+    bad++;
+}
+
+//
+//  a wake a minute, so that the minute a time signature has is exact
+//
+static class WakeSink: public SampleSink {
+public:
+  void write(int offset, const unsigned char *p, int len) { memcpy(&b[offset], p, len); }
+  unsigned char read(int offset) { return b[offset]; }
+  int flush(int len) { return 0; }   // never gets that far
+  void now(time_stamp *t) { memset(t, 0, sizeof(*t)); t->valid = 1; t->year = 2016; t->month = 1; t->day = 1; t->minute = minute; }
+
+  unsigned char b[512];
+  int minute;
+} wake_sink;
+static sample_encoder_state wake_state;
+static SampleEncoder wake_encoder(&wake_state, &wake_sink, sizeof(wake_sink.b));
+
+//
+//  what each wake's sample should decode as, -1 for none
+//
+#define WAKES 10
+static int want_th[WAKES], want_p[WAKES];
+static int decoded_at[WAKES];
+static bool wake_bad;
+
+extern "C" int
+get_compressed_byte(int offset)
+{
+  return offset < wake_encoder.Length() ? wake_sink.b[offset] : -1;
+}
+
+extern "C" void
+log_data(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
+{
+  int m = t->minute;
+
+  if (t->second != 0 || m >= WAKES || want_th[m] < 0 || decoded_at[m]++ ||
+      temp != 20+want_th[m] || humidity != 40+want_th[m] || !valid_p || pressure != 1000+want_p[m]) {
+    printf("    minute %d: %d %d %d\n", m, temp, humidity, pressure);
+    wake_bad = 1;
+  }
+}
+
+extern "C" void
+log_data_tenths(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
+{
+  wake_bad = 1;
+}
+
+extern "C" void
+log_mark(time_stamp *t, int mark)
+{
+}
+
+extern "C" void
+log_gap(time_stamp *t, int records)
+{
+  wake_bad = 1;
+}
+
+static void
+wake_decode(void)
+{
+  decompress_state d;
+
+  decompress_start(&d);
+  decompress(&d);
+}
+
+//
+//  the sketch's wake, with the HTS221 and/or LPS25H never finishing - one that times out
+//  takes the last sample's values, or if there isn't one since the stream started afresh
+//  the sample's Skip()ped
+//
+static void
+wake(int m, bool hts221_stuck, bool lps25h_stuck)
+{
+  static SensorConversion sensors;
+  int temp = 0, humidity = 0, pressure = 0;
+  bool skip = 0;
+
+  wake_sink.minute = m;
+  put16(hts221, 0x28, 40+m);      // readings a wake's own, so we can tell which we got
+  put16(hts221, 0x2a, 20+m);
+  lps25h->regs[0x28] = 0;
+  put16(lps25h, 0x29, (1000+m)<<4);
+  hts221->convert_us = hts221_stuck ? 0 : 3000;
+  lps25h->convert_us = lps25h_stuck ? 0 : 7000;
+  sensors.Start(1, 1);
+  sensors.Collect();
+  if (sensors.TimedOut(SENSOR_HUMIDITY))
+    skip = !wake_encoder.Fill(SAMPLE_TH, &temp, &humidity, &pressure);
+  else {
+    humidity = sensors.Humidity();
+    temp = sensors.Temperature();
+  }
+  if (sensors.TimedOut(SENSOR_PRESSURE)) {
+    if (!wake_encoder.Fill(SAMPLE_P, &temp, &humidity, &pressure))
+      skip = 1;
+  } else
+    pressure = sensors.Pressure()>>12;
+  if (skip)
+    wake_encoder.Skip(60);
+  else
+    wake_encoder.Sample(temp, humidity, pressure);
+}
+
+static void
+timed_out_wakes(void)
+{
+  static const struct {
+    bool hts221_stuck, lps25h_stuck, reset;
+    int th, p;            // the wake whose values it should decode as, -1 not at all
+  } wakes[WAKES] = {
+    {1, 0, 0, -1, -1},    // straight after the time signature, nothing to stand in
+    {0, 0, 0, 1, 1},      // so it has a time signature of its own
+    {0, 0, 0, 2, 2},
+    {1, 0, 0, 2, 3},
+    {1, 0, 0, 2, 4},
+    {0, 1, 0, 5, 4},
+    {1, 1, 0, 5, 4},
+    {1, 0, 1, -1, -1},    // the stream starts afresh (an upload), nothing to stand in again
+    {0, 0, 0, 8, 8},
+    {0, 1, 0, 9, 8},
+  };
+  int n = 0;
+
+  printf("Wakes with a sensor timing out, through SampleEncoder\n");
+  wake_encoder.Init(SAMPLE_TH|SAMPLE_P, 60, sizeof(wake_sink.b));
+  wake_sink.minute = 0;
+  wake_encoder.TimeSignature();
+  for (int m = 0; m < WAKES; m++) {
+    want_th[m] = wakes[m].th;
+    want_p[m] = wakes[m].p;
+    if (wakes[m].reset) {           // what's been put so far goes, as it's uploaded
+      wake_decode();
+      wake_encoder.Reset();
+      wake_encoder.TimeSignature();
+    }
+    wake(m, wakes[m].hts221_stuck, wakes[m].lps25h_stuck);
+  }
+  wake_decode();
+  for (int m = 0; m < WAKES; m++) {
+    if (decoded_at[m] != (want_th[m] >= 0)) {
+      printf("    minute %d: decoded %d times\n", m, decoded_at[m]);
+      wake_bad = 1;
+    }
+    n += decoded_at[m];
+  }
+  printf("  %d wakes, %d samples decoded at the right times and values  %s\n", WAKES, n, wake_bad ? "WRONG" : "ok");
+  if (wake_bad)
+    bad++;
+}
+
+int
+main(int argc, char **argv)
+{
+  pc_time tm;
+  double h, t;
+
+  hts221 = wire_sim_add(0x5f, 1);
+  lps25h = wire_sim_add(0x5c, 1);
+  pc8563 = wire_sim_add(0x51, 0);
+
+  hts221->regs[0x0f] = 0xbc;      // WHO_AM_I
+  hts221->regs[0x27] = 0x03;      // STATUS, both ready
+  put16(hts221, 0x28, 6000);      // HUMIDITY_OUT
+  put16(hts221, 0x2a, 300);       // TEMP_OUT
+  hts221->regs[0x30] = 2*30;      // H0_rH_x2
+  hts221->regs[0x31] = 2*70;      // H1_rH_x2
+  hts221->regs[0x32] = (8*15)&0xff;   // T0_degC_x8 LSB
+  hts221->regs[0x33] = (8*40)&0xff;   // T1_degC_x8 LSB
+  hts221->regs[0x35] = (((8*40)>>8)<<2)|((8*15)>>8);  // their MSBs
+  put16(hts221, 0x36, 2000);      // H0_T0_OUT
+  put16(hts221, 0x3a, 10000);     // H1_T0_OUT
+  put16(hts221, 0x3c, -1000);     // T0_OUT
+  put16(hts221, 0x3e, 1000);      // T1_OUT
+
+  lps25h->regs[0x0f] = 0xbd;      // WHO_AM_I
+  lps25h->regs[0x27] = 0x03;      // STATUS
+  lps25h->regs[0x28] = 0x00;      // PRESS_OUT, 1013.25 hPa in 1/4096ths
+  lps25h->regs[0x29] = 0x54;
+  lps25h->regs[0x2a] = 0x3f;
+  put16(lps25h, 0x2b, 480*5);     // TEMP_OUT, 47.5C
+
+  pc8563->regs[2] = bcd(56);      // 2016/03/01 12:34:56
+  pc8563->regs[3] = bcd(34);
+  pc8563->regs[4] = bcd(12);
+  pc8563->regs[5] = bcd(1);
+  pc8563->regs[7] = bcd(3);
+  pc8563->regs[8] = bcd(16);
+
+  printf("I2C bus use, %dkHz\n", WIRE_SIM_KHZ);
+  wire_sim_reset();
+  check("HTS221 begin()", 5, smeHumidity.begin() &&
+    smeHumidity._h0_rH == 60 && smeHumidity._h1_rH == 140 &&
+    smeHumidity._T0_degC == 120 && smeHumidity._T1_degC == 320 &&
+    smeHumidity._H0_T0 == 2000 && smeHumidity._H1_T0 == 10000 &&
+    (int16_t)smeHumidity._T0_OUT == -1000 && (int16_t)smeHumidity._T1_OUT == 1000);
+  smeHumidity.storeCalibration();
+  check("  storeCalibration()", 1, smeHumidity._T1_degC == 320 && (int16_t)smeHumidity._T0_OUT == -1000);
+  h = smeHumidity.readHumidity();
+  check("  readHumidity()", 1, h == 30+(6000-2000)*(70-30)/(10000-2000));
+  t = smeHumidity.readTemperature();
+  check("  readTemperature()", 1, fabs(t-(15+(300+1000)*25.0/2000)) < 0.001);
+  check("LPS25H begin()", 4, smePressure.begin());
+  check("  readPressure()", 1, smePressure.readPressure() == 1013);
+  check("  readTemperature()", 1, smePressure.readTemperature() == 47);
+  fifo("  readFifo(), empty", 0, 0);
+  fifo("  readFifo(), 24 queued", 24, 0);
+  fifo("  readFifo(), overran", 32, 1);
+  check("PC8563 read()", 1, PC8563_RTC.read(tm) && tm.year == 2016 && tm.month == 3 && tm.day == 1 &&
+    tm.hour == 12 && tm.minute == 34 && tm.second == 56);
+
+  hts221->start_reg = lps25h->start_reg = 0x21;   // CTRL_REG2 ONE_SHOT
+  hts221->start_bit = lps25h->start_bit = 0x01;
+  hts221->ready_reg = lps25h->ready_reg = 0x27;   // STATUS_REG
+  hts221->ready_bits = lps25h->ready_bits = 0x03;
+  printf("SensorConversion one-shots - latency HTS221, LPS25H, and awake\n");
+  conversion("as expected", 3000, 7000, 0);
+  conversion("slow", 9000, 30000, 0);
+  conversion("LPS25H never finishes", 3000, 0, 0);
+  conversion("LPS25H missing", 3000, 7000, 1);
+  conversion("both never finish", 0, 0, 0);
+  timed_out_wakes();
+  if (bad) {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "rtc_sim.h"
+#include "../RtcMemory.h"
+
+rtc_sim_memory rtc_sim;
+unsigned long rtc_sim_reads, rtc_sim_writes;
+static unsigned int words[RTC_USER_SIZE/4];
+
+static void
+check(int i)
+{
+  if (i < 0 || i >= RTC_USER_SIZE/4) {
+    fprintf(stderr, "RTC memory word %d is out of range\n", i);
+    abort();
+  }
+}
+
+rtc_sim_word::operator unsigned int() const
+{
+  check(i);
+  rtc_sim_reads++;
+  return words[i];
+}
+
+rtc_sim_word &
+rtc_sim_word::operator=(unsigned int v)
+{
+  check(i);
+  rtc_sim_writes++;
+  words[i] = v;
+  return *this;
+}
+
+void
+rtc_sim_reset(void)
+{
+  for (int i = 0; i < RTC_USER_SIZE/4; i++)
+    words[i] = 0xdeadbeef*(i+1);  // what's there after a power on is anyone's guess
+  rtc_sim_reads = rtc_sim_writes = 0;
+}
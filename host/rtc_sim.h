@@ -0,0 +1,44 @@
+#ifndef RTC_SIM_H
+#define RTC_SIM_H
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+//  RAM backed stand-in for the 8266's RTC user memory (RTC_USER_MEM in RtcMemory.h)
+//  that counts the word reads and writes the part would make. Indexing past the
+//  RTC_USER_SIZE bytes the SDK leaves us aborts
+//
+class rtc_sim_word {
+public:
+  rtc_sim_word(int i) { this->i = i; }
+  operator unsigned int() const;
+  rtc_sim_word &operator=(unsigned int v);
+private:
+  int i;
+};
+
+class rtc_sim_memory {
+public:
+  rtc_sim_word operator[](int i) const { return rtc_sim_word(i); }
+};
+
+extern rtc_sim_memory rtc_sim;
+extern unsigned long rtc_sim_reads, rtc_sim_writes;
+
+void rtc_sim_reset(void);         // fill it with junk, zero the counters
+
+#endif
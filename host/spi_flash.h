@@ -0,0 +1,26 @@
+#ifndef HOST_SPI_FLASH_H
+#define HOST_SPI_FLASH_H
+//
+//  host stand-in for the ESP8266 SDK's spi_flash.h, the calls are implemented by
+//  the RAM backed flash simulator in flash_sim.cpp
+//
+#include "c_types.h"
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+  SPI_FLASH_RESULT_OK,
+  SPI_FLASH_RESULT_ERR,
+  SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size);
+#ifdef __cplusplus
+}
+#endif
+#endif
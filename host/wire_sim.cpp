@@ -0,0 +1,195 @@
+/*
+ *   Copyright (C) 2016 Paul Campbell
+
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Wire.h"
+
+TwoWire Wire;
+unsigned long wire_sim_transactions, wire_sim_bytes, wire_sim_bits;
+static unsigned long clock_us;
+
+#define DEVICES 4
+static wire_sim_device devices[DEVICES];
+static int ndevices;
+
+static wire_sim_device *dev;        // the one we're talking to, 0 if nobody answered
+static int written;                 // bytes written since the address
+static uint8_t rx[256];
+static int rx_len, rx_off;
+
+wire_sim_device *
+wire_sim_add(uint8_t address, bool msb_increment)
+{
+  wire_sim_device *d = &devices[ndevices++];
+
+  memset(d, 0, sizeof(*d));
+  d->address = address;
+  d->msb_increment = msb_increment;
+  return d;
+}
+
+void
+wire_sim_reset(void)
+{
+  wire_sim_transactions = wire_sim_bytes = wire_sim_bits = 0;
+  for (int i = 0; i < ndevices; i++)
+    devices[i].reads = 0;
+}
+
+unsigned long
+micros(void)
+{
+  return clock_us;
+}
+
+void
+delayMicroseconds(unsigned int us)
+{
+  clock_us += us;
+}
+
+static void
+bits(int n)
+{
+  wire_sim_bits += n;
+  clock_us += n*1000/WIRE_SIM_KHZ;
+}
+
+//
+//  a START (or repeated START) and the address byte
+//
+static void
+address(uint8_t a)
+{
+  bits(1+9);
+  wire_sim_bytes++;
+  dev = 0;
+  for (int i = 0; i < ndevices; i++)
+    if (devices[i].address == a)
+      dev = &devices[i];
+}
+
+static void
+stop(void)
+{
+  bits(1);
+  wire_sim_transactions++;
+}
+
+//
+//  the conversion going, if it's finished by now
+//
+static void
+convert(wire_sim_device *d)
+{
+  if (d->done_at && clock_us >= d->done_at) {
+    d->regs[d->ready_reg] |= d->ready_bits;
+    d->regs[d->start_reg] &= ~d->start_bit;
+    d->done_at = 0;
+  }
+}
+
+static void
+step(wire_sim_device *d)
+{
+  if (!d->increment)
+    return;
+  if (d->window_len && d->reg == d->window_reg+d->window_len-1)
+    d->reg = d->window_reg;
+  else
+    d->reg++;
+}
+
+static uint8_t
+read_reg(wire_sim_device *d)
+{
+  if (d->fifo_off < d->fifo_len && d->reg >= d->window_reg && d->reg < d->window_reg+d->window_len)
+    return d->fifo[d->fifo_off++];
+  return d->regs[d->reg];
+}
+
+void
+TwoWire::beginTransmission(uint8_t a)
+{
+  address(a);
+  written = 0;
+}
+
+size_t
+TwoWire::write(uint8_t b)
+{
+  bits(9);
+  wire_sim_bytes++;
+  if (dev) {
+    if (written == 0) {       // the sub-address
+      dev->reg = dev->msb_increment ? b&0x7f : b;
+      dev->increment = dev->msb_increment ? (b&0x80) != 0 : 1;
+    } else {
+      dev->regs[dev->reg] = b;
+      if (dev->start_bit && dev->reg == dev->start_reg && (b&dev->start_bit)) {
+        dev->regs[dev->ready_reg] &= ~dev->ready_bits;
+        dev->done_at = dev->convert_us ? clock_us+dev->convert_us : 0;
+      }
+      step(dev);
+    }
+  }
+  written++;
+  return 1;
+}
+
+uint8_t
+TwoWire::endTransmission(bool s)
+{
+  bool answered = dev != 0;
+
+  if (s)
+    stop();
+  return answered ? 0 : 2;
+}
+
+uint8_t
+TwoWire::requestFrom(uint8_t a, uint8_t len, bool s)
+{
+  address(a);
+  rx_len = rx_off = 0;
+  if (len > WIRE_SIM_BUFFER)
+    len = WIRE_SIM_BUFFER;
+  if (dev) {
+    for (int i = 0; i < len; i++) {
+      bits(9);
+      convert(dev);
+      rx[rx_len++] = read_reg(dev);
+      dev->reads++;
+      step(dev);
+    }
+    wire_sim_bytes += len;
+  }
+  if (s)
+    stop();
+  return rx_len;
+}
+
+int
+TwoWire::available(void)
+{
+  return rx_len-rx_off;
+}
+
+int
+TwoWire::read(void)
+{
+  return rx_off < rx_len ? rx[rx_off++] : -1;
+}
@@ -34,11 +34,25 @@
       //  1111 0010 - time signature + change following samples to pressure only (first Afollowing sample will be a full sample)
       //  1111 0011 - time signature + change following samples to temp/humidity followed by pressure (first following sample will be a full sample)
       //  1111 0100 - followed by 2 bytes MSB LSB, sampling rate in seconds (default is 60 seconds, one sample per minute)
+      //              from the last sample (or time signature) on - it can change between any two samples
       //  1111 0101 - followed by 0 terminated string comment
       //  1111 0110 - followed by a 1-byte value - 'mark' a user inserted mark in the stream (for example "I turned on the heater here")
       //  1111 0111 - null - ignored for padding
       //  1111 1000 - followed by 1-byte count 1-255 - previous value didn't change to N samples
-      //  1111 1001-1110 undefined
+      //  1111 1001 - followed by a 1-byte check - this record carries on from the end of the one before it:
+      //              the same stream type, sampling rate and 1111 1011, the next sample is a delta from its last one
+      //              and is a sampling period after it. The check is stream_check() of the last sample,
+      //              if it doesn't match what we have the record before is missing and we can't go on
+      //  1111 1010 - followed by a 1-byte stream type (1 temp/humidity, 2 pressure, 3 both) and a time signature -
+      //              the following samples are in tenths of a degree C, % and hPa (see decompress.h)
+      //  1111 1011 - followed by 2 bytes, N 1-255 and K 0-254 - in a temp/humidity and pressure stream only every
+      //              Nth sample has pressure, the next that does is K samples on (0 the next one), until the
+      //              next time signature. The rest are temp/humidity alone - no pressure byte(s), bit 3 means
+      //              nothing, and in tenths their pressure nibble count is 0
+      //  1111 1100-1101 undefined
+      //  1111 1110 - followed by 2 bytes MSB LSB, count of records (flash writes) lost here because the flash filled
+      //              and they were overwritten before being uploaded. Bit 15 set means at least the rest - the
+      //              unit lost power while it was counting, or there were more than 7FFF
       //
       // time signature:
       //  byte0 - bits 7:0 years since 2000 0-254 - value '0xff' means no time is known (bytes1-4 are missing)
@@ -49,8 +63,28 @@
 
 #define COUNT 60            // how many samples before trying to push upstream
 #define DELAY 1000000       // 1 SEC in uS
-#define MAGIC 0x76          // increment this (mod 256) when you make changes to force initialisation
+#define DELAY_MAX (8*DELAY) // the longest we sleep between samples while they aren't changing, DELAY to always sleep DELAY
+#define DELAY_STEADY 4      // unchanged samples before we double it
+#define MAGIC 0x81          // increment this (mod 256) when you make changes to force initialisation
 #define FLASH_ERASE 0
+#define FLASH_EXTERNAL 0    // 1 if there's a SPI NOR chip on HSPI for HomeFlash to overflow into
+#define FLASH_EXTERNAL_CS 15
+#define FLASH_OVERWRITE 0   // 1 to throw away the oldest data when the flash fills rather than the newest
+// records that carry on from the one before for each one that starts afresh - if the oldest
+// are overwritten the ones after them would be lost too, so don't
+#define SAMPLE_RESYNC (FLASH_OVERWRITE ? 1 : 8)
+#define SAMPLE_HIRES 0      // 1 to log tenths of a degree, % and hPa (1111 1010), about twice the flash
+// >1 to leave the LPS25H sampling pressure into its FIFO once a second while we sleep, and wake
+// every this many seconds to put them all, with one temp/humidity reading a wake
+#define PRESSURE_BATCH 0
+#if PRESSURE_BATCH && (DELAY != 1000000 || PRESSURE_BATCH > 24)
+#error "PRESSURE_BATCH needs a DELAY of 1 sec, and at most 24 so a late wake doesn't overrun the 32 sample FIFO"
+#endif
+// only read pressure every this many samples (1111 1011) - the LPS25H stays powered down for the rest
+#define PRESSURE_EVERY 1
+#if PRESSURE_BATCH && PRESSURE_EVERY != 1
+#error "PRESSURE_BATCH reads pressure every second, PRESSURE_EVERY must be 1"
+#endif
 
 extern "C" {
   #include "user_interface.h"
@@ -67,6 +101,15 @@ extern "C" {
 #include "decompress.h"
 #include "house_eeprom.h"
 #include "Flash.h"
+#include "FlashStream.h"
+#include "SampleEncoder.h"
+#include "SampleRate.h"
+#include "SensorConversion.h"
+#include "RtcMemory.h"
+#if FLASH_EXTERNAL
+#include "SpiNorFlash.h"
+SpiNorFlash ext_flash(FLASH_EXTERNAL_CS);
+#endif
 
 
 
@@ -91,30 +134,31 @@ typedef struct rtc_info {
 #define STATE_RTC_PRESENT       0x04    // we have an external RTC
 #define STATE_SENSORS_ACTIVE    0x08    // take a sample when you wake up
 #define STATE_TIME_SET          0x10    // RTC time is valid
+#define STATE_TIMED_OUT         0x20    // a sensor didn't finish last wake, and we've said so
 
-    unsigned char   compressor_state;   //
-#define CSTATE_SAME       0x01          // we have an active 'same' entry
-#define CSTATE_LAST_SAME  0x02          // the last entry we put was deltas '0'
-#define CSTATE_NOPR       0x04          // the last entry had a skipped - 0 pressure valoue
     unsigned long   delay;    // how long to wait for 
-    unsigned short  last_pressure;      // 0xffff means no last value
-    signed char     last_temp;          // 0x7f means no last value
-    unsigned char   last_humidity;      // 0xff means no last value
     unsigned char   _h0_rH, _h1_rH;     // humidity calibration parameters
     signed short    _H0_T0, _H1_T0;
     unsigned short  _T0_degC, _T1_degC; // temp calibration parameters
     signed short    _T0_OUT, _T1_OUT;
-    unsigned short  flash_start_offset; // offset of firest entry in flash
-
-    unsigned char   boff; // offset into buffer for next sample
+    flash_cursor    flash_state;        // where HomeFlash is up to
+    sample_encoder_state encoder;       // the compressor, and how much of the buffer it's filled
+    decompress_state decoder;           // the end of the last record written, for the next to carry on from
+    sample_rate_state rate;             // how long we sleep between samples
 } rtc_info;
 
 rtc_info save_info;
 bool commit_rtc_data_pending=0;
-void write_time_signature();
+flash_summary record_summary;           // what's in the record we're about to write, see log_data()
   
+//
+//  the samples go in the rest of RTC user memory after save_info - about 320 bytes, each
+//  one we fill is a flash record and a fresh time signature and full sample after it
+//
 #define RTC_BUFF_BASE (sizeof(rtc_info))
-#define RTC_BUFF_SIZE 255
+#define RTC_BUFF_SIZE (RTC_USER_SIZE-RTC_BUFF_BASE)
+static_assert(RTC_BUFF_SIZE >= 255, "rtc_info has grown into the sample buffer");
+RtcStream rtc_buffer(RTC_BUFF_BASE);    // the compressor's writes and the decoder's reads, see RtcSink
 
 #define HTS221_ADDRESS     0x5F
 #define LPS25H_ADDRESS     0x5C
@@ -125,11 +169,8 @@ CaptiveConfig *configGetter(nullptr);
 /// Similarly, DataUploader is used for uploading data over WiFi
 DataUploader *dataUploader(nullptr);
 
-// Needs to be at least 256 bytes to take a full record from HomeFlash
-#define UPLOAD_BUFFER_SIZE 8 * 256
-
 /// For passing data between flash and the DataUploader instance
-uint8_t *uploadBuf(nullptr);
+FlashStream *uploadStream(nullptr);
 
 /// Used to confirm that device knows user wants to do something
 uint8_t blinkCount(0);
@@ -141,10 +182,6 @@ void startBlink()
     blinkCount = 0x80;
 }
 
-// Unsure why, but Arduino precompiler thingy wants to put enter_deep_sleep()
-// before rtc_mem_write...
-void rtc_mem_write(int offset, void *p,  int bytes);
-
 /// Call this, then return from setup() or loop() to enter deep sleep
 void enter_deep_sleep()
 {
@@ -153,131 +190,74 @@ void enter_deep_sleep()
   digitalWrite(2, 1);
   eeprom.flush();
 
-  save_info.flash_start_offset = flash.GetRememberedOffset();
+  flash.SaveCursor(&save_info.flash_state);
+#if FLASH_EXTERNAL
+  ext_flash.sleep();
+#endif
+  rtc_buffer.Sync();
   rtc_mem_write(0, &save_info, sizeof(save_info));
   system_deep_sleep_set_option(0);
   system_deep_sleep(save_info.delay);
   esp_yield();
 }
 
-void
-rtc_mem_write(int offset, void *p,  int bytes)
-{
-  union {
-      unsigned char b[4];
-      unsigned long l;
-  }b;
-  unsigned char *pp = (unsigned char *)p;
-  volatile uint32 *rtc = ((uint32*)0x60001100) + 64 + (offset>>2);
-
-  offset &= 3;
-  if (offset) {
-    b.l = *rtc;
-
-    for (int i = offset; i < 4 && bytes>0; i++) {
-        b.b[i] = *pp++;
-        bytes--;
-    }
-    *rtc++ = b.l;
-    if (bytes == 0)
-      return;
-  }
-  if (((int)pp)&3) {
-    while (bytes >= 4) {
-      b.b[0] = pp[0];
-      b.b[1] = pp[1];
-      b.b[2] = pp[2];
-      b.b[3] = pp[3];
-      *rtc++ = b.l;
-      pp += 4;
-      bytes -= 4;
-    }
-  } else {
-    while (bytes >= 4) {
-      *rtc++ = *(unsigned long *)pp;
-      pp += 4;
-      bytes -= 4;
-    }
-  }
-  if (bytes&3) {
-    b.l = *rtc;
-    for (int i = 0; i < (bytes&3); i++)
-      b.b[i] = *pp++;
-    *rtc = b.l;
-  }
-}
-
-
-void
-rtc_mem_read(int offset, void *p,  int bytes)
-{
-  union {
-      unsigned char b[4];
-      unsigned long l;
-  }b;
-  unsigned char *pp = (unsigned char *)p;
-  volatile uint32 *rtc = ((uint32*)0x60001100) + 64 + (offset>>2);
-
-  offset &= 3;
-  if (offset) {
-    b.l = *rtc;
-    for (int i = offset; i < 4 && bytes>0; i++) {
-        *pp++ = b.b[i];
-        bytes--;
-    }
-    if (bytes == 0)
-      return;
-    rtc++;
-  }
-  
-  if (((int)pp)&3) {
-    while (bytes >= 4) {
-      b.l = *rtc++;
-      pp[0] = b.b[0];
-      pp[1] = b.b[1];
-      pp[2] = b.b[2];
-      pp[3] = b.b[3];  
-      pp += 4;
-      bytes -= 4;
-    }
-  } else {
-    while (bytes >= 4) {
-      *(unsigned long *)pp = *rtc++;
-      pp += 4;
-      bytes -= 4;
-    }
-  }
-  if (bytes&3) {
-    b.l = *rtc;
-    for (int i = 0; i < (bytes&3); i++)
-      *pp++ = b.b[i];
-  }
-}
-
 unsigned char 
 readRegister(unsigned char addr, unsigned char reg)
 {
     Wire.beginTransmission(addr);
     Wire.write(reg);
     Wire.endTransmission(false);
-    Wire.requestFrom((uint8_t)addr, (uint8_t)1);
-    while(!Wire.available());
+    if (Wire.requestFrom((uint8_t)addr, (uint8_t)1) != 1)
+      return 0;         // it's not there
     return Wire.read();  
 }
 
+SensorConversion sensors;   // a wake's temp/humidity and pressure readings
+static bool sample_skip;    // one of them timed out and there's no last sample to stand in for it
+
+//
+//  the compressor writes into the RTC buffer after save_info, a word at a time through
+//  rtc_buffer, and stores it as a flash record with unload_rtc_buffer() when it's full
+//
+int unload_rtc_buffer(int sz);
+
+class RtcSink: public SampleSink {
+public:
+  void write(int offset, const unsigned char *b, int len) { rtc_buffer.Write(offset, b, len); }
+  unsigned char read(int offset) { return rtc_buffer.Read(offset); }
+  int flush(int len) { rtc_buffer.Sync(); return unload_rtc_buffer(len); }
+  void now(time_stamp *t);
+} rtc_sink;
+
+SampleEncoder encoder(&save_info.encoder, &rtc_sink, RTC_BUFF_SIZE);
+SampleRate rate(&save_info.rate);
+static int sample_behind;   // samples the one we're putting was taken before now
+
 void
-log_string(const char *s)
+RtcSink::now(time_stamp *t)
 {
-  unsigned char c = 0xf5; 
-  save_info.compressor_state = 0;
-  rtc_mem_write(RTC_BUFF_BASE+save_info.boff++, &c, 1);
-  for (;;) {
-    rtc_mem_write(RTC_BUFF_BASE+save_info.boff++, (unsigned char *)s, 1);
-    if (!*s)
-      break;
-    s++;
+  t->valid = 0;
+  if ((save_info.state&(STATE_RTC_PRESENT|STATE_TIME_SET)) == (STATE_RTC_PRESENT|STATE_TIME_SET)) {
+    pc_time tm;
+
+    memset(&tm, 0, sizeof(tm));
+    PC8563_RTC.read(tm);
+    t->valid = 1;
+    t->year = tm.year;
+    t->month = tm.month;
+    t->day = tm.day;
+    t->hour = tm.hour;
+    t->minute = tm.minute;
+    t->second = tm.second;
+    time_stamp_back(t, sample_behind*(DELAY/1000000));
   }
 }
+
+void
+log_string(const char *s)
+{
+  encoder.Comment(s);
+}
 void 
 writeRegister(unsigned char addr, unsigned char reg, unsigned char val)
 {
@@ -290,68 +270,71 @@ writeRegister(unsigned char addr, unsigned char reg, unsigned char val)
 }
 
 
-void 
+//
+//  the record we write ends on a flash program page boundary, so that it's written
+//  in one operation, if we pad it out to flush_at with nulls. Returns the flush_at
+//  for the next one, 0 if it couldn't be written
+//
+int
 unload_rtc_buffer(int sz)
 {
-    unsigned char b[255];
+    unsigned char b[RTC_BUFF_SIZE];
+    int next = 0;
+    decompress_state d = save_info.decoder;  // kept if the record is written
     
-    int samples = dump_rtc_data();
+    SummaryClear(&record_summary);  // log_data() fills it in
+    int samples = decompress(&d);
     Serial.print(samples);
     Serial.print(" samples in ");
-    Serial.print(save_info.boff);
+    Serial.print(sz);
     Serial.println("bytes");
 
     rtc_mem_read(RTC_BUFF_BASE, &b[0], sz);
-    if (flash.WriteRecord(&b[0], sz)) {
-      save_info.last_humidity = 255;
-      save_info.last_temp = 127;
-      save_info.last_pressure = 0;
-      save_info.compressor_state &= ~(CSTATE_SAME|CSTATE_LAST_SAME|CSTATE_NOPR);
-      save_info.boff = 0;
-      write_time_signature();
+    while (sz < save_info.encoder.flush_at)
+      b[sz++] = 0xf7;   // null
+    if (flash.WriteRecord(&b[0], sz, &record_summary)) {
+      save_info.decoder = d;
+      next = flash.ProgramRoom(RTC_BUFF_SIZE);
+    }
+    if (flash.Evicted()) {
+      Serial.print(flash.Evicted());
+      Serial.println(" records overwritten since the last upload");
     }
     printf("Dump flash\n");
     flash.Dump();
+    return next;
 }
 
 //
-//  Call this routine to get at most max_len bytes of data into a buffer to send upstream
-//  It returns 0 when no data is available otherwise the number of bytes extracted
+//  Call this routine to get a stream of everything waiting to go upstream, the flash
+//  followed by what's still in the RTC buffer, after head_len bytes of head. It's read 
+//  straight out of the flash a record at a time as it's sent, so it doesn't matter 
+//  how much there is
 //
-//  If we return other than 0 then before we return to deep sleep, or before we call 
-//  get_stored_flash_data() again, we must call one of:
+//  Before we return to deep sleep we must call one of:
 //
 //  commit_stored_flash_data() - makes the space sent upstream available for more storage
 //  uncommit_stored_flash_data() - upstream write failed, leave the data in the flash for later
 //  
 
-int 
-get_stored_flash_data(unsigned char *p, int max_len)
-{
-  unsigned long l = flash.LoadBuffer(p, max_len);
+static unsigned char rtc_tail[RTC_BUFF_SIZE];
 
-  commit_rtc_data_pending = 0;
-  if (l&FLASH_END_MARKER) {
-      l &= ~FLASH_END_MARKER;
-      if (save_info.boff < (max_len-l)) {
-        rtc_mem_read(RTC_BUFF_BASE, &p[l], save_info.boff);
-        l += save_info.boff;
-        commit_rtc_data_pending = 1;
-      }
-  }
-  return l;
+FlashStream *
+get_stored_flash_stream(const unsigned char *head, int head_len)
+{
+  rtc_buffer.Sync();
+  rtc_mem_read(RTC_BUFF_BASE, &rtc_tail[0], encoder.Length());
+  commit_rtc_data_pending = 1;
+  return new FlashStream(head, head_len, &rtc_tail[0], encoder.Length());
 }
 
 void
 commit_stored_flash_data(void)
 {
     flash.CommitBuffer();
-    if (commit_rtc_data_pending) {
-      save_info.last_humidity = 255;
-      save_info.last_temp = 127;
-      save_info.last_pressure = 0;
-      save_info.compressor_state &= ~(CSTATE_SAME|CSTATE_LAST_SAME|CSTATE_NOPR);
-      save_info.boff = 0;
+    if (commit_rtc_data_pending) {  // the next record starts afresh
+      encoder.Reset();
+      encoder.TimeSignature();
     }
 }
 
@@ -362,74 +345,69 @@ uncommit_stored_flash_data(void)
   commit_rtc_data_pending = 0;
 }
 
-void
-write_time_signature()
-{
-    unsigned char b[6];
-
-    save_info.compressor_state = 0;
-    if (save_info.boff > (RTC_BUFF_SIZE-6-(save_info.delay==60000000?0:3))) {  // room for another?
-      unload_rtc_buffer(save_info.boff);
-      return; // unloads as a side effect
-    } 
-    b[0] = 0xf0 | (save_info.state&STATE_HUMID_PRESENT?1:0) | (save_info.state&STATE_PRESSURE_PRESENT?2:0);
-    if ((save_info.state&(STATE_RTC_PRESENT|STATE_TIME_SET)) == (STATE_RTC_PRESENT|STATE_TIME_SET)) {
-      pc_time tm;
-
-      memset(&tm, 0, sizeof(tm));
-      PC8563_RTC.read(tm);
-      b[1] = tm.year-2000;
-      b[2] = (tm.month<<4) | (tm.day>>1);
-      b[3] = (tm.day<<7) | (tm.hour<<2) | (tm.minute>>4);
-      b[4] = (tm.minute<<4) | 0xf;
-      rtc_mem_write(RTC_BUFF_BASE+save_info.boff, &b[0], 5); // save the data
-      save_info.boff += 5;
-    } else {
-      b[1] = 0xff;
-      rtc_mem_write(RTC_BUFF_BASE+save_info.boff, &b[0], 2); // save the data
-      save_info.boff += 2;
-    }
-    if (DELAY!=60000000) { // not 1 minute? output sampling rate
-      int v = DELAY/1000000;
-      b[0] = 0xf4;
-      b[1] = v>>8;
-      b[2] = v;
-      rtc_mem_write(RTC_BUFF_BASE+save_info.boff, &b[0], 3); // save the data
-      save_info.boff += 3;
-    }
-    if (save_info.boff > (RTC_BUFF_SIZE-4))   // room for another?
-      unload_rtc_buffer(save_info.boff);
-}
-
 int 
 get_compressed_byte(int offset) // called when dumping rtc contents
 {
-  unsigned char c;
-  
-  if (offset >= save_info.boff)
+  if (offset >= encoder.Length())
     return -1;
-  rtc_mem_read(RTC_BUFF_BASE+offset, &c, 1);
-  return c;
+  return rtc_buffer.Read(offset);
 }
 
+//
+//  the LPS25H's pressure, 24 bits in 1/4096 hPa, in what we log
+//
+static int
+pressure_units(long v)
+{
+#if SAMPLE_HIRES
+  return (v*10+2048)>>12;
+#else
+  return v>>12;
+#endif
+}
+
+#if PRESSURE_BATCH
+//
+//  the LPS25H has been sampling into its FIFO once a second since the last wake (see
+//  setup()) - read out everything queued, a burst of several at a time, then put it
+//  oldest first with this wake's temp/humidity. If we slept long enough for it to overrun
+//  the oldest are gone, and the ones after them decode that many seconds early, so say
+//  so. If the HTS221 timed out with no last sample to stand in for it they're dropped,
+//  and the next wake's are that many seconds further on
+//
+static void
+sample_pressure_fifo(int temp, int humidity)
+{
+  long p[32];               // the FIFO's depth
+  bool overran;
+  int n = smePressure.readFifo(&p[0], &overran);
+
+  if (overran)
+    encoder.Comment("pressure FIFO overran");
+  if (sample_skip) {
+    encoder.Skip(n);
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    sample_behind = n-1-i;
+    encoder.Sample(temp, humidity, pressure_units(p[i]));
+    encoder.Period(DELAY/1000000);      // back from a Skip()
+  }
+  sample_behind = 0;
+}
+#endif
+
 bool
 XinitVariant() 
 {
   // WARNING - crappy stack hacking occurs at the end of this routine if you add
   //    varibles here you must update the asm at the end of this routine
   //    
-  unsigned long tm;
-  unsigned char th_delta;
-  unsigned char p_delta;
-  signed char temp;
-  unsigned char humidity;
+  int temp;
+  int humidity;
+  int pressure;
   unsigned char status;
-  bool force;
-  bool same;
   int v;
-  int dt, dh;
-  int sz;
-  unsigned char b[4];
   unsigned short adc;
  // end WARNING
  
@@ -453,169 +431,100 @@ XinitVariant()
 //  Serial.println(save_info.state,HEX);
   if (save_info.magic != MAGIC)
     return 0;
-  flash.SetRememberedOffset(save_info.flash_start_offset);
+  flash.RestoreCursor(&save_info.flash_state);
   if (save_info.state&STATE_SENSORS_ACTIVE) {
-    if (adc > 500 && adc < 900) { // insert mark
-      b[0] = 0xf6; // mark
-      b[1] = 0x0;  // default mark
-      rtc_mem_write(RTC_BUFF_BASE+save_info.boff, &b[0], 2); // save the data
-      save_info.boff += 2;
-      if (save_info.boff > (RTC_BUFF_SIZE-4)) {  // room for another?
-       unload_rtc_buffer(save_info.boff);
-      }
-    }
-    force=0;
-    same=0;
+    if (adc > 500 && adc < 900) // insert mark
+      encoder.Mark(0);  // default mark
+    temp = 0;
+    humidity = 0;
+    pressure = 0;
     // activate internal pullups for twi.
     Wire.begin(4, 5);
     
-    if (save_info.state&STATE_HUMID_PRESENT) 
-      writeRegister(HTS221_ADDRESS, 0x20, 0x80|3); // wake up the HTS221
-    if (save_info.state&STATE_PRESSURE_PRESENT) 
-      writeRegister(LPS25H_ADDRESS, 0x20, 0x80|0x40); // wake up the LP25
-    if (save_info.state&STATE_HUMID_PRESENT) {
-      for (;;) {
-        status = readRegister(HTS221_ADDRESS, 0x27);
-        if (status&0x02) // humidity ready
-            break;
-      }
-      v = readRegister(HTS221_ADDRESS, 0x29)<<8;
-      v |= readRegister(HTS221_ADDRESS, 0x28);
+    // one-shots in both, we idle until they're done or SENSOR_DEADLINE_US
+    sensors.Start(save_info.state&STATE_HUMID_PRESENT,
+      !PRESSURE_BATCH && save_info.state&STATE_PRESSURE_PRESENT && encoder.PressureDue());
+    sensors.Collect();
+//printf("conversions %lu %lu us\n", sensors.Latency(SENSOR_HUMIDITY), sensors.Latency(SENSOR_PRESSURE));
+    // one that didn't finish puts its last sample again, so the times stay right, or if
+    // there isn't one the sample's left out - the first wake it happens says so
+    if (!sensors.TimedOut(SENSOR_HUMIDITY) && !sensors.TimedOut(SENSOR_PRESSURE))
+      save_info.state &= ~STATE_TIMED_OUT;
+    else
+    if (!(save_info.state&STATE_TIMED_OUT)) {
+      save_info.state |= STATE_TIMED_OUT;
+      encoder.Comment(sensors.TimedOut(SENSOR_HUMIDITY) ? "HTS221 timed out" : "LPS25H timed out");
+    }
+    sample_skip = 0;
+    if (sensors.TimedOut(SENSOR_HUMIDITY)) {
+      sample_skip = !encoder.Fill(SAMPLE_TH, &temp, &humidity, &pressure);
+    } else
+    if (sensors.Done(SENSOR_HUMIDITY)) {
+      v = sensors.Humidity();
 //Serial.print("v=");
 //Serial.println(v);
-      if (v&0x8000)
-        v |= 0xffff0000;
 
-      v = (save_info._h0_rH + (((v-save_info._H0_T0)*(save_info._h1_rH-save_info._h0_rH))/(save_info._H1_T0-save_info._H0_T0)))>>1;
+      v = save_info._h0_rH + (((v-save_info._H0_T0)*(save_info._h1_rH-save_info._h0_rH))/(save_info._H1_T0-save_info._H0_T0)); // in 1/2 %
+#if SAMPLE_HIRES
+      v *= 5;
+      if (v < 0) v = 0; else
+      if (v > 1000) v = 1000;
+#else
+      v >>= 1;
       if (v < 0) v = 0; else
       if (v > 100) v = 100;
+#endif
       humidity = v;
 //Serial.print("humidity=");Serial.println(humidity);
-      for (;;) {
-        if (status&0x01) // temp ready
-            break;
-        status = readRegister(HTS221_ADDRESS, 0x27);
-      }
-      v = readRegister(HTS221_ADDRESS, 0x2b)<<8;
-      v |= readRegister(HTS221_ADDRESS, 0x2a);
-      writeRegister(HTS221_ADDRESS, 0x20, 0);
+      v = sensors.Temperature();
 //printf("in %d %d\n", save_info._T0_degC, save_info._T1_degC);
 //printf("out %d %d\n", save_info._T0_OUT,save_info._T1_OUT);
 //printf("cvt %d ", v);
-      v = ((save_info._T0_degC + (((int16_t)v-(int16_t)save_info._T0_OUT)*(save_info._T1_degC-save_info._T0_degC))/((int16_t)save_info._T1_OUT-(int16_t)save_info._T0_OUT))+3)>>3;
+      v = save_info._T0_degC + (((int16_t)v-(int16_t)save_info._T0_OUT)*(save_info._T1_degC-save_info._T0_degC))/((int16_t)save_info._T1_OUT-(int16_t)save_info._T0_OUT); // in 1/8 C
+#if SAMPLE_HIRES
+      v = (v*10+4)>>3;
+#else
+      v = (v+3)>>3;
+#endif
       temp = v;
 //printf("%d\n", v);
 //Serial.print("temp=");Serial.println(temp);
-      dt = temp-save_info.last_temp;
-      save_info.last_temp = temp;
-      dh = humidity-save_info.last_humidity;
-      save_info.last_humidity = humidity;
-      if (dh > 3 || dh < -4 || dt > 3 || dt < -4)
-          force = 1;
-//Serial.print("dh=");Serial.println(dh);
-//Serial.print("dt=");Serial.println(dt);
-      th_delta = (dt&0x7)|((dh&0x7)<<4);
-    } else {
-      th_delta = 0x00;
     }
+#if PRESSURE_BATCH
     if (save_info.state&STATE_PRESSURE_PRESENT) {
-      while (!(readRegister(LPS25H_ADDRESS, 0x27)&0x02))
-        ;             
-      v = readRegister(LPS25H_ADDRESS, 0x2a)<<4;  // MSB
-      v |=  readRegister(LPS25H_ADDRESS, 0x29)>>4; //LSB
-      writeRegister(LPS25H_ADDRESS, 0x20, 0x10);
-      dt = v-save_info.last_pressure;
+      sample_pressure_fifo(temp, humidity);
+      save_info.delay = PRESSURE_BATCH*DELAY;
+    } else
+#endif
+    {
+      if (sensors.TimedOut(SENSOR_PRESSURE)) {
+        if (!encoder.Fill(SAMPLE_P, &temp, &humidity, &pressure))
+          sample_skip = 1;
+      } else
+      if (sensors.Done(SENSOR_PRESSURE)) {     // otherwise it wasn't due, and the encoder ignores it
+        pressure = pressure_units(sensors.Pressure());
 //Serial.print("press=");
-//Serial.println(v);
-      save_info.last_pressure = v;
-      if (dt > 63 || dt < -64)
-        force = 1;
-// Serial.print("dt=");
-//Serial.println(dt&0xff,HEX);
-      p_delta = (dt&0x7f);
-    } else {
-      p_delta = 0;
-    }
-    sz=0;
-//Serial.print(th_delta,HEX);
-// Serial.print("--");
-//Serial.println(p_delta,HEX);
-    if (force) {    // force means send full values rather than del;tas
-      save_info.compressor_state &= ~(CSTATE_SAME|CSTATE_LAST_SAME|CSTATE_NOPR);
-      if (save_info.state&STATE_HUMID_PRESENT) {
-        b[0] = 0x80|save_info.last_humidity;
-        b[1] = (unsigned char)save_info.last_temp;
-        sz = 2;
-      } else {
-        sz = 0;
+//Serial.println(pressure);
       }
-      if (save_info.state&STATE_PRESSURE_PRESENT) {
-        b[sz] = 0x80|(save_info.last_pressure>>8);
-        b[sz+1] = save_info.last_pressure;
-        sz += 2;
-      }
-    } else {
-      if (th_delta == 0x00 && p_delta == 0x00) {
-
-// Serial.print("cstate=");
-//Serial.println(save_info.compressor_state,HEX);        
-         if (save_info.compressor_state&CSTATE_SAME) { // 3rd and subsequent deltas
-            rtc_mem_read(RTC_BUFF_BASE+save_info.boff-1, &status, 1);
-            if (status == 255) {   // repeat is full, add an extra one
-                sz = 2;
-                b[0] = 0xf8;
-                b[1] = 1;
-            } else {          // increment count
-                save_info.boff--;
-                b[0] = status+1;
-                sz = 1;
-            }
-        } else
-        if (save_info.compressor_state&CSTATE_LAST_SAME) { // 2nd delta convert previous delta into a 'repeat'
-            if (save_info.state&STATE_HUMID_PRESENT) 
-              save_info.boff--;
-            if (save_info.state&STATE_PRESSURE_PRESENT && !(save_info.compressor_state&CSTATE_NOPR)) 
-              save_info.boff--;
-            save_info.compressor_state &= ~(CSTATE_LAST_SAME|CSTATE_NOPR);
-            save_info.compressor_state |= CSTATE_SAME;
-            sz = 2;
-            b[0] = 0xf8;
-            b[1] = 2;
-        } else { // first '0' delta just store the '0'
-          save_info.compressor_state |= CSTATE_LAST_SAME;          
-          sz = 0;
-          if (save_info.state&STATE_HUMID_PRESENT) {
-            b[sz++] = th_delta|0x08;
-            save_info.compressor_state |= CSTATE_NOPR;
-          } else
-          if (save_info.state&STATE_PRESSURE_PRESENT)
-            b[sz++] = p_delta;
-        }
-      } else {  // non-0 delta just save the deltas
-        save_info.compressor_state &= ~(CSTATE_SAME|CSTATE_LAST_SAME);
-        sz = 0;
-        if (p_delta == 0x00 && (save_info.state&(STATE_HUMID_PRESENT|STATE_PRESSURE_PRESENT)) == (STATE_HUMID_PRESENT|STATE_PRESSURE_PRESENT)) {
-          save_info.compressor_state |= CSTATE_NOPR;
-          b[sz++] = th_delta|0x08; 
+      if (sample_skip) {        // the next is a period on from where this would have been
+        encoder.Skip(rate.Period());
+        save_info.delay = rate.Period()*1000000UL;
+      } else {
+        encoder.Sample(temp, humidity, pressure);
+        if (sensors.TimedOut(SENSOR_HUMIDITY) || sensors.TimedOut(SENSOR_PRESSURE)) {
+          save_info.delay = rate.Period()*1000000UL;  // a repeat isn't the reading holding steady
         } else {
-          save_info.compressor_state &= ~CSTATE_NOPR;
-          if (save_info.state&STATE_HUMID_PRESENT)
-            b[sz++] = th_delta;
-          if (save_info.state&STATE_PRESSURE_PRESENT)
-            b[sz++] = p_delta;
+          save_info.delay = rate.Next(encoder.Unchanged())*1000000UL;
         }
+        encoder.Period(rate.Period());
       }
     }
-
-    rtc_mem_write(RTC_BUFF_BASE+save_info.boff, &b[0], sz); // save the data
-    save_info.boff += sz;
-    if (save_info.boff > (RTC_BUFF_SIZE-4)) {  // room for another?
-      unload_rtc_buffer(save_info.boff);
-    }
   }
-//printf("off=%d\n", save_info.boff);
+//printf("off=%d\n", encoder.Length());
   save_info.count--;
-  save_info.flash_start_offset = flash.GetRememberedOffset(); // save offset
+  flash.EraseAhead(FLASH_ERASE_BUDGET);     // nobody's waiting, get ahead on erasing freed flash
+  flash.SaveCursor(&save_info.flash_state); // save where we are in flash
+  rtc_buffer.Sync();
   rtc_mem_write(0, &save_info, sizeof(save_info));
   if (!save_info.count)
       return 0;
@@ -664,8 +573,42 @@ void log_mark(time_stamp *t, int mark)
   Serial.println(mark);
 }
 
+void log_gap(time_stamp *t, int records)
+{
+  log_time(t);
+  Serial.print("gap, lost ");
+  Serial.print(records);
+  Serial.println(" records");
+}
+
 void log_data(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
 {
+  flash_summary *r = &record_summary;
+  unsigned long when = time_stamp_seconds(t);
+
+  if (r->samples < 0xffff)
+    r->samples++;
+  if (when) {
+    if (!r->first_time)
+      r->first_time = when;
+    r->last_time = when;
+  }
+  if (valid_th) {
+    if (temp < r->min_temp)
+      r->min_temp = temp;
+    if (temp > r->max_temp)
+      r->max_temp = temp;
+    if (humidity < r->min_humidity)
+      r->min_humidity = humidity;
+    if (humidity > r->max_humidity)
+      r->max_humidity = humidity;
+  }
+  if (valid_p) {
+    if (pressure < r->min_pressure)
+      r->min_pressure = pressure;
+    if (pressure > r->max_pressure)
+      r->max_pressure = pressure;
+  }
   log_time(t);
   if (valid_th) {
     Serial.print(temp);
@@ -679,6 +622,17 @@ void log_data(time_stamp *t, unsigned char valid_th, int temp, int humidity, uns
   Serial.println();
 }
 
+static int
+round_tenths(int v)
+{
+  return (v+(v < 0 ? -5 : 5))/10;
+}
+
+void log_data_tenths(time_stamp *t, unsigned char valid_th, int temp, int humidity, unsigned char valid_p, int pressure)
+{
+  log_data(t, valid_th, round_tenths(temp), round_tenths(humidity), valid_p, round_tenths(pressure));  // the summary's in whole units
+}
+
 void
 write_time(int year,int month, int day, int hour, int minute, int second)
 {
@@ -693,7 +647,7 @@ write_time(int year,int month, int day, int hour, int minute, int second)
     tm.year = year;
     save_info.state |= STATE_TIME_SET;
     PC8563_RTC.write(tm);
-    write_time_signature();
+    encoder.TimeSignature();
   }
 }
 
@@ -703,6 +657,11 @@ setup() {
 
   Serial.begin(115200);
   Serial.println("");
+#if FLASH_EXTERNAL
+  if (ext_flash.begin())  // before anything touches the flash cursor
+    flash.SetExternal(&ext_flash);
+#endif
+  flash.SetOverwrite(FLASH_OVERWRITE);
   if (XinitVariant()) return;
   // put your setup code here, to run once:
  // Serial.begin(115200);
@@ -738,17 +697,18 @@ setup() {
        save_info._T0_OUT = smeHumidity._T0_OUT;
        save_info._T1_OUT = smeHumidity._T1_OUT;
     }
-    save_info.last_humidity = 255;
-    save_info.last_temp = 127;
     Serial.println("start pressure"); 
     pressurePresent = smePressure.begin();
     if (!pressurePresent) {
         Serial.println("- NO LPS25 Pressure Sensor found");
     } else {
       save_info.state |= STATE_PRESSURE_PRESENT;
+#if PRESSURE_BATCH
+      smePressure.startFifo();    // and leave it running
+#else
       smePressure.deactivate();
+#endif
     }
-    save_info.last_pressure = 0;
     if (!PC8563_RTC.begin()) {
       Serial.println("- NO PC8563 RTC found");
     } else {
@@ -756,6 +716,11 @@ setup() {
     }
     if (save_info.state&(STATE_PRESSURE_PRESENT|STATE_HUMID_PRESENT))
       save_info.state |= STATE_SENSORS_ACTIVE;
+    encoder.Init((save_info.state&STATE_HUMID_PRESENT ? SAMPLE_TH : 0) | (save_info.state&STATE_PRESSURE_PRESENT ? SAMPLE_P : 0) |
+      (SAMPLE_HIRES ? SAMPLE_TENTHS : 0),
+      DELAY/1000000, flash.ProgramRoom(RTC_BUFF_SIZE), SAMPLE_RESYNC, PRESSURE_EVERY);
+    decompress_start(&save_info.decoder);
+    rate.Init(DELAY/1000000, DELAY_MAX/1000000, DELAY_STEADY);
 
 
     save_info.state |= STATE_TIME_SET|STATE_RTC_PRESENT; // remove this when we have a working time load thing
@@ -763,12 +728,10 @@ setup() {
     save_info.delay = DELAY;   // 1 sec
     save_info.count = COUNT;
   } else {
-    flash.SetRememberedOffset(save_info.flash_start_offset);
+    flash.RestoreCursor(&save_info.flash_state);
 #ifdef NOTDEF
-    for (int i = 0; i < save_info.boff; i++){
-      unsigned char c;
-      rtc_mem_read(RTC_BUFF_BASE+i, &c, 1);
-      Serial.print(c, HEX);
+    for (int i = 0; i < encoder.Length(); i++){
+      Serial.print(rtc_buffer.Read(i), HEX);
       Serial.print(" ");
     }
     Serial.println(" ");
@@ -777,14 +740,11 @@ setup() {
     int samples = dump_rtc_data();
      Serial.print(samples);
      Serial.print(" samples in ");
-     Serial.print(save_info.boff);
+     Serial.print(encoder.Length());
      Serial.println(" bytes");
      
-     save_info.boff = 0;
-     save_info.last_humidity = 255;
-     save_info.last_temp = 127;
-     save_info.last_pressure = 0;
-     write_time_signature();
+     encoder.Reset();
+     encoder.TimeSignature();
 #endif
   }
   if (save_info.count == 0)
@@ -831,10 +791,8 @@ smePressure.deactivate();
           auto ep(eeprom.get_pointer());
           APCredentials preferredAP{ep->wifiSsid, ep->wifiPass};
 
-          uploadBuf = new uint8_t[UPLOAD_BUFFER_SIZE];
-          memcpy(uploadBuf, "Unique ID goes here.", 20); // TODO
-          auto uploadSz( get_stored_flash_data(uploadBuf + 20, UPLOAD_BUFFER_SIZE - 20) );
-          dataUploader = new DataUploader(uploadBuf, uploadSz + 20, &preferredAP);
+          uploadStream = get_stored_flash_stream((const unsigned char *)"Unique ID goes here.", 20); // TODO
+          dataUploader = new DataUploader(uploadStream, &preferredAP);
 
           return; // This return without enter_deep_sleep() means "go to loop()"
         }
@@ -891,7 +849,8 @@ loop() {
             delete dataUploader;
             dataUploader = nullptr;
 
-            delete [] uploadBuf;
+            delete uploadStream;
+            uploadStream = nullptr;
 
             enter_deep_sleep();
             return;